@@ -0,0 +1,404 @@
+/*
+
+  bench.c --
+
+  Offline micro-benchmarks of the storage engine.
+
+  Generates a reproducible synthetic corpus of place-name-like strings, then
+  times tokenising, put, find, delete, save and load individually, without
+  any Ruby code in the measured path.
+
+  Results are printed as tab-separated values, one operation per line.
+
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "storage.h"
+#include "tokeniser.h"
+#include "metrics.h"
+#include "blurrily.h"
+
+/******************************************************************************/
+
+#define NAME_MAX_LENGTH 64
+
+static const char consonants[] = "tnshrdlcmwfgypbvkjxqz"; /* most frequent first */
+static const char vowels[]     = "eaoiu";
+
+typedef struct options_t {
+  uint32_t    entries;      /* corpus size */
+  uint32_t    queries;      /* number of finds */
+  uint32_t    deletes;      /* number of deletes */
+  uint32_t    rounds;       /* number of saves and loads */
+  uint64_t    seed;
+  double      letter_skew;  /* Zipf exponent of letter frequencies */
+  double      query_skew;   /* Zipf exponent of query popularity */
+  uint16_t    limit;
+  const char* path;         /* where to save the map */
+} options_t;
+
+typedef struct zipf_t {
+  uint32_t size;
+  double*  cumulative;
+} zipf_t;
+
+typedef struct samples_t {
+  const char* name;
+  uint32_t    count;
+  uint64_t    elapsed;      /* wall time for the whole run */
+  uint64_t*   durations;
+} samples_t;
+
+/******************************************************************************/
+
+/* xorshift64*, so corpora are identical across platforms */
+static uint64_t next_random(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ull;
+}
+
+static double next_uniform(uint64_t* state)
+{
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/******************************************************************************/
+
+static int zipf_new(zipf_t* zipf, uint32_t size, double exponent)
+{
+  double total = 0;
+
+  zipf->size       = size;
+  zipf->cumulative = (double*) malloc(size * sizeof(double));
+  if (zipf->cumulative == NULL) return -1;
+
+  for (uint32_t k = 0; k < size; ++k) {
+    total += 1.0 / pow(k + 1, exponent);
+    zipf->cumulative[k] = total;
+  }
+  for (uint32_t k = 0; k < size; ++k) {
+    zipf->cumulative[k] /= total;
+  }
+  return 0;
+}
+
+/* rank in [0, size), lower ranks being more likely */
+static uint32_t zipf_next(zipf_t* zipf, uint64_t* state)
+{
+  double   target = next_uniform(state);
+  uint32_t low    = 0;
+  uint32_t high   = zipf->size - 1;
+
+  while (low < high) {
+    uint32_t middle = (low + high) / 2;
+    if (zipf->cumulative[middle] < target) low = middle + 1;
+    else                                   high = middle;
+  }
+  return low;
+}
+
+static void zipf_free(zipf_t* zipf)
+{
+  free(zipf->cumulative);
+  zipf->cumulative = NULL;
+}
+
+/******************************************************************************/
+
+/* 1 to 3 words of 1 to 4 syllables, e.g. "santo domerin" */
+static void generate_name(char* output, uint64_t* state, zipf_t* letters)
+{
+  int    words  = 1;
+  size_t length = 0;
+  double dice   = next_uniform(state);
+
+  if (dice > 0.70) ++words;
+  if (dice > 0.95) ++words;
+
+  for (int w = 0; w < words; ++w) {
+    int syllables = 1 + (int)(next_random(state) % 4);
+
+    if (w > 0) output[length++] = ' ';
+    for (int s = 0; s < syllables && length < NAME_MAX_LENGTH - 4; ++s) {
+      output[length++] = consonants[zipf_next(letters, state)];
+      output[length++] = vowels[next_random(state) % (sizeof(vowels) - 1)];
+      if (next_uniform(state) < 0.3) {
+        output[length++] = consonants[zipf_next(letters, state)];
+      }
+    }
+  }
+  output[length] = 0;
+}
+
+/* apply one random insertion, deletion or substitution, half of the time */
+static void misspell(char* name, uint64_t* state)
+{
+  size_t length   = strlen(name);
+  size_t position = 0;
+
+  if (length < 2 || next_uniform(state) < 0.5) return;
+  position = next_random(state) % length;
+
+  switch (next_random(state) % 3) {
+  case 0: /* insertion */
+    if (length + 1 >= NAME_MAX_LENGTH) break;
+    memmove(name + position + 1, name + position, length - position + 1);
+    name[position] = 'a' + (next_random(state) % 26);
+    break;
+  case 1: /* deletion */
+    memmove(name + position, name + position + 1, length - position);
+    break;
+  default: /* substitution */
+    name[position] = 'a' + (next_random(state) % 26);
+  }
+}
+
+/******************************************************************************/
+
+static int samples_new(samples_t* samples, const char* name, uint32_t count)
+{
+  samples->name      = name;
+  samples->count     = count;
+  samples->elapsed   = 0;
+  samples->durations = (uint64_t*) calloc(count > 0 ? count : 1, sizeof(uint64_t));
+  return samples->durations ? 0 : -1;
+}
+
+static int compare_durations(const void* left_p, const void* right_p)
+{
+  uint64_t left  = *(const uint64_t*)left_p;
+  uint64_t right = *(const uint64_t*)right_p;
+  return (left > right) - (left < right);
+}
+
+static uint64_t percentile(samples_t* samples, double ratio)
+{
+  if (samples->count == 0) return 0;
+  return samples->durations[(size_t)(ratio * (samples->count - 1))];
+}
+
+static void samples_report(samples_t* samples)
+{
+  uint64_t total = 0;
+
+  for (uint32_t k = 0; k < samples->count; ++k) total += samples->durations[k];
+  qsort(samples->durations, samples->count, sizeof(uint64_t), &compare_durations);
+
+  printf("%s\t%u\t%.1f\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+    samples->name,
+    samples->count,
+    samples->elapsed ? samples->count * 1e9 / samples->elapsed : 0.0,
+    samples->count ? total / samples->count : 0,
+    percentile(samples, 0.50),
+    percentile(samples, 0.99),
+    percentile(samples, 0.999)
+  );
+  fflush(stdout);
+
+  free(samples->durations);
+  samples->durations = NULL;
+}
+
+/******************************************************************************/
+
+static void usage(const char* program)
+{
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -n ENTRIES  corpus size (100000)\n"
+    "  -q QUERIES  number of finds (10000)\n"
+    "  -d DELETES  number of deletes (100)\n"
+    "  -r ROUNDS   number of saves and loads (5)\n"
+    "  -s SEED     random seed (42)\n"
+    "  -a SKEW     Zipf exponent of letter frequencies (1.0)\n"
+    "  -z SKEW     Zipf exponent of query popularity (1.0)\n"
+    "  -l LIMIT    results per find (10)\n"
+    "  -o PATH     where to save the map (/tmp/blurrily-bench.trigrams)\n",
+    program
+  );
+}
+
+static int parse_options(int argc, char** argv, options_t* options)
+{
+  int option = -1;
+
+  options->entries     = 100000;
+  options->queries     = 10000;
+  options->deletes     = 100;
+  options->rounds      = 5;
+  options->seed        = 42;
+  options->letter_skew = 1.0;
+  options->query_skew  = 1.0;
+  options->limit       = 10;
+  options->path        = "/tmp/blurrily-bench.trigrams";
+
+  while ((option = getopt(argc, argv, "n:q:d:r:s:a:z:l:o:h")) != -1) {
+    switch (option) {
+    case 'n': options->entries     = (uint32_t) strtoul(optarg, NULL, 10); break;
+    case 'q': options->queries     = (uint32_t) strtoul(optarg, NULL, 10); break;
+    case 'd': options->deletes     = (uint32_t) strtoul(optarg, NULL, 10); break;
+    case 'r': options->rounds      = (uint32_t) strtoul(optarg, NULL, 10); break;
+    case 's': options->seed        = strtoull(optarg, NULL, 10);           break;
+    case 'a': options->letter_skew = strtod(optarg, NULL);                 break;
+    case 'z': options->query_skew  = strtod(optarg, NULL);                 break;
+    case 'l': options->limit       = (uint16_t) strtoul(optarg, NULL, 10); break;
+    case 'o': options->path        = optarg;                               break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  if (options->entries == 0 || options->seed == 0 || options->limit == 0) {
+    usage(argv[0]);
+    return -1;
+  }
+  return 0;
+}
+
+/******************************************************************************/
+
+static int run(options_t* options)
+{
+  uint64_t         state    = options->seed;
+  char*            corpus   = NULL;
+  char*            queries  = NULL;
+  trigram_t*       trigrams = NULL;
+  trigram_match_t* results  = NULL;
+  trigram_map      haystack = NULL;
+  zipf_t           letters;
+  zipf_t           popularity;
+  samples_t        samples;
+  uint64_t         started_at;
+  int              res      = -1;
+
+  if (zipf_new(&letters, sizeof(consonants) - 1, options->letter_skew) < 0) return -1;
+  if (zipf_new(&popularity, options->entries, options->query_skew) < 0) return -1;
+
+  corpus   = (char*) malloc((size_t)options->entries * NAME_MAX_LENGTH);
+  queries  = (char*) malloc((size_t)options->queries * NAME_MAX_LENGTH);
+  trigrams = (trigram_t*) malloc((NAME_MAX_LENGTH + 1) * sizeof(trigram_t));
+  results  = (trigram_match_t*) malloc(options->limit * sizeof(trigram_match_t));
+  if (!corpus || !queries || !trigrams || !results) goto cleanup;
+
+  /* corpus, then queries picked by popularity, some misspelt */
+  for (uint32_t k = 0; k < options->entries; ++k) {
+    generate_name(corpus + (size_t)k * NAME_MAX_LENGTH, &state, &letters);
+  }
+  for (uint32_t k = 0; k < options->queries; ++k) {
+    char* query = queries + (size_t)k * NAME_MAX_LENGTH;
+    strcpy(query, corpus + (size_t)zipf_next(&popularity, &state) * NAME_MAX_LENGTH);
+    misspell(query, &state);
+  }
+  fprintf(stderr, "%u entries, %u queries, seed %" PRIu64 ", letter skew %.2f, query skew %.2f\n",
+    options->entries, options->queries, options->seed, options->letter_skew, options->query_skew);
+
+  printf("operation\tcount\tops_per_sec\tmean_ns\tp50_ns\tp99_ns\tp999_ns\n");
+
+  /* tokenise */
+  if (samples_new(&samples, "tokenise", options->entries) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->entries; ++k) {
+    uint64_t start = blurrily_metrics_now();
+    (void) blurrily_tokeniser_parse_string(corpus + (size_t)k * NAME_MAX_LENGTH, trigrams);
+    samples.durations[k] = blurrily_metrics_now() - start;
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+
+  /* put */
+  res = blurrily_storage_new(&haystack);
+  if (res < 0) goto cleanup;
+  if (samples_new(&samples, "put", options->entries) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->entries; ++k) {
+    uint64_t start = blurrily_metrics_now();
+    (void) blurrily_storage_put(haystack, corpus + (size_t)k * NAME_MAX_LENGTH, k + 1, 0);
+    samples.durations[k] = blurrily_metrics_now() - start;
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+
+  /* find */
+  if (samples_new(&samples, "find", options->queries) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->queries; ++k) {
+    uint64_t start = blurrily_metrics_now();
+    (void) blurrily_storage_find(haystack, queries + (size_t)k * NAME_MAX_LENGTH, options->limit, results);
+    samples.durations[k] = blurrily_metrics_now() - start;
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+
+  /* save */
+  if (samples_new(&samples, "save", options->rounds) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->rounds; ++k) {
+    uint64_t start = blurrily_metrics_now();
+    res = blurrily_storage_save(haystack, options->path);
+    samples.durations[k] = blurrily_metrics_now() - start;
+    if (res < 0) { perror("save"); goto cleanup; }
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+  (void) blurrily_storage_close(&haystack);
+
+  /* load */
+  if (samples_new(&samples, "load", options->rounds) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->rounds; ++k) {
+    uint64_t start = blurrily_metrics_now();
+    if (haystack) (void) blurrily_storage_close(&haystack);
+    res = blurrily_storage_load(&haystack, options->path, BLURRILY_LOAD_LAZY);
+    samples.durations[k] = blurrily_metrics_now() - start;
+    if (res < 0) { perror("load"); goto cleanup; }
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+
+  /* delete, from the loaded map */
+  if (samples_new(&samples, "delete", options->deletes) < 0) goto cleanup;
+  started_at = blurrily_metrics_now();
+  for (uint32_t k = 0; k < options->deletes; ++k) {
+    uint32_t reference = 1 + (uint32_t)(next_random(&state) % options->entries);
+    uint64_t start     = blurrily_metrics_now();
+    (void) blurrily_storage_delete(haystack, reference);
+    samples.durations[k] = blurrily_metrics_now() - start;
+  }
+  samples.elapsed = blurrily_metrics_now() - started_at;
+  samples_report(&samples);
+
+  res = 0;
+
+cleanup:
+  if (haystack) (void) blurrily_storage_close(&haystack);
+  (void) unlink(options->path);
+  zipf_free(&letters);
+  zipf_free(&popularity);
+  free(corpus);
+  free(queries);
+  free(trigrams);
+  free(results);
+  return res;
+}
+
+/******************************************************************************/
+
+int main(int argc, char** argv)
+{
+  options_t options;
+  int       res = -1;
+
+  if (parse_options(argc, argv, &options) < 0) return 1;
+  res = run(&options);
+  return (res < 0) ? 1 : 0;
+}
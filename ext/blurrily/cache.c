@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "blurrily.h"
+
+/******************************************************************************/
+
+#define CACHE_START_BUCKETS 256
+
+/******************************************************************************/
+
+/* one cached query; trigrams then results follow the structure */
+typedef struct cache_entry_t cache_entry_t;
+struct cache_entry_t
+{
+  uint32_t        hash;
+  uint32_t        generation;
+  uint16_t        limit;
+  uint16_t        nb_trigrams;
+  uint16_t        nb_results;
+
+  cache_entry_t*  chain;       /* next entry in the same bucket */
+  cache_entry_t*  newer;       /* LRU list, towards most recently used */
+  cache_entry_t*  older;       /* LRU list, towards least recently used */
+};
+
+struct blurrily_cache_t
+{
+  cache_entry_t** buckets;
+  uint32_t        nb_buckets;  /* always a power of two */
+  uint32_t        entries;
+  size_t          bytes;
+  size_t          max_bytes;
+
+  cache_entry_t*  newest;
+  cache_entry_t*  oldest;
+
+  uint64_t        hits;
+  uint64_t        misses;
+};
+
+/******************************************************************************/
+
+static trigram_t* entry_trigrams(cache_entry_t* entry)
+{
+  return (trigram_t*) (entry + 1);
+}
+
+static trigram_match_t* entry_results(cache_entry_t* entry)
+{
+  return (trigram_match_t*) (entry_trigrams(entry) + entry->nb_trigrams);
+}
+
+static size_t entry_size(int nb_trigrams, int nb_results)
+{
+  return sizeof(cache_entry_t) + nb_trigrams * sizeof(trigram_t) + nb_results * sizeof(trigram_match_t);
+}
+
+/******************************************************************************/
+
+/* FNV-1a over the trigram codes and the limit */
+static uint32_t hash_key(const trigram_t* trigrams, int nb_trigrams, uint16_t limit)
+{
+  uint32_t hash = 2166136261u;
+
+  for (int k = 0; k < nb_trigrams; ++k) {
+    hash = (hash ^ (trigrams[k] & 0xFF)) * 16777619u;
+    hash = (hash ^ (trigrams[k] >> 8))   * 16777619u;
+  }
+  hash = (hash ^ (limit & 0xFF)) * 16777619u;
+  hash = (hash ^ (limit >> 8))   * 16777619u;
+  return hash;
+}
+
+/******************************************************************************/
+
+static void lru_unlink(blurrily_cache_t* cache, cache_entry_t* entry)
+{
+  if (entry->newer) entry->newer->older = entry->older;
+  else              cache->newest       = entry->older;
+  if (entry->older) entry->older->newer = entry->newer;
+  else              cache->oldest       = entry->newer;
+  entry->newer = entry->older = NULL;
+}
+
+static void lru_push(blurrily_cache_t* cache, cache_entry_t* entry)
+{
+  entry->older = cache->newest;
+  entry->newer = NULL;
+  if (cache->newest) cache->newest->newer = entry;
+  cache->newest = entry;
+  if (!cache->oldest) cache->oldest = entry;
+}
+
+/******************************************************************************/
+
+static void remove_entry(blurrily_cache_t* cache, cache_entry_t* entry)
+{
+  cache_entry_t** link = cache->buckets + (entry->hash & (cache->nb_buckets - 1));
+
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+
+  lru_unlink(cache, entry);
+  cache->entries -= 1;
+  cache->bytes   -= entry_size(entry->nb_trigrams, entry->nb_results);
+  free(entry);
+}
+
+/******************************************************************************/
+
+/* double the number of buckets, rehashing all entries */
+static void grow_buckets(blurrily_cache_t* cache)
+{
+  uint32_t        nb_buckets = cache->nb_buckets * 2;
+  cache_entry_t** buckets    = NULL;
+
+  buckets = (cache_entry_t**) calloc(nb_buckets, sizeof(cache_entry_t*));
+  if (buckets == NULL) return; /* keep working with longer chains */
+
+  for (uint32_t k = 0; k < cache->nb_buckets; ++k) {
+    cache_entry_t* entry = cache->buckets[k];
+    while (entry) {
+      cache_entry_t* next  = entry->chain;
+      uint32_t       index = entry->hash & (nb_buckets - 1);
+      entry->chain = buckets[index];
+      buckets[index] = entry;
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets    = buckets;
+  cache->nb_buckets = nb_buckets;
+}
+
+/******************************************************************************/
+
+int blurrily_cache_new(blurrily_cache_t** cache_ptr, size_t max_bytes)
+{
+  blurrily_cache_t* cache = NULL;
+
+  cache = (blurrily_cache_t*) calloc(1, sizeof(blurrily_cache_t));
+  if (!cache) return -1;
+
+  cache->nb_buckets = CACHE_START_BUCKETS;
+  cache->buckets    = (cache_entry_t**) calloc(cache->nb_buckets, sizeof(cache_entry_t*));
+  if (!cache->buckets) { free(cache); return -1; }
+
+  cache->max_bytes = max_bytes;
+  *cache_ptr = cache;
+  return 0;
+}
+
+/******************************************************************************/
+
+void blurrily_cache_free(blurrily_cache_t** cache_ptr)
+{
+  blurrily_cache_t* cache = *cache_ptr;
+
+  while (cache->oldest) remove_entry(cache, cache->oldest);
+  free(cache->buckets);
+  free(cache);
+  *cache_ptr = NULL;
+}
+
+/******************************************************************************/
+
+int blurrily_cache_get(blurrily_cache_t* cache, uint32_t generation, const trigram_t* trigrams, int nb_trigrams, uint16_t limit, trigram_match results)
+{
+  uint32_t       hash  = hash_key(trigrams, nb_trigrams, limit);
+  cache_entry_t* entry = cache->buckets[hash & (cache->nb_buckets - 1)];
+
+  for (; entry; entry = entry->chain) {
+    if (entry->hash != hash || entry->limit != limit || entry->nb_trigrams != nb_trigrams) continue;
+    if (memcmp(entry_trigrams(entry), trigrams, nb_trigrams * sizeof(trigram_t)) != 0) continue;
+
+    if (entry->generation != generation) {
+      /* stale, the map changed since */
+      remove_entry(cache, entry);
+      break;
+    }
+
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+    memcpy(results, entry_results(entry), entry->nb_results * sizeof(trigram_match_t));
+    cache->hits += 1;
+    return entry->nb_results;
+  }
+
+  cache->misses += 1;
+  return -1;
+}
+
+/******************************************************************************/
+
+void blurrily_cache_put(blurrily_cache_t* cache, uint32_t generation, const trigram_t* trigrams, int nb_trigrams, uint16_t limit, const trigram_match_t* results, int nb_results)
+{
+  size_t         size  = entry_size(nb_trigrams, nb_results);
+  uint32_t       hash  = hash_key(trigrams, nb_trigrams, limit);
+  uint32_t       index = 0;
+  cache_entry_t* entry = NULL;
+
+  if (size > cache->max_bytes || nb_trigrams > UINT16_MAX) return;
+
+  /* make room, least recently used first */
+  while (cache->oldest && cache->bytes + size > cache->max_bytes) {
+    remove_entry(cache, cache->oldest);
+  }
+
+  entry = (cache_entry_t*) malloc(size);
+  if (entry == NULL) return;
+
+  entry->hash        = hash;
+  entry->generation  = generation;
+  entry->limit       = limit;
+  entry->nb_trigrams = (uint16_t) nb_trigrams;
+  entry->nb_results  = (uint16_t) nb_results;
+  memcpy(entry_trigrams(entry), trigrams, nb_trigrams * sizeof(trigram_t));
+  memcpy(entry_results(entry), results, nb_results * sizeof(trigram_match_t));
+
+  if (cache->entries >= cache->nb_buckets) grow_buckets(cache);
+  index = hash & (cache->nb_buckets - 1);
+  entry->chain = cache->buckets[index];
+  cache->buckets[index] = entry;
+  lru_push(cache, entry);
+
+  cache->entries += 1;
+  cache->bytes   += size;
+  LOG("cached %d results (%zd bytes in cache)\n", nb_results, cache->bytes);
+}
+
+/******************************************************************************/
+
+void blurrily_cache_stats(blurrily_cache_t* cache, blurrily_cache_stat_t* stats)
+{
+  stats->hits      = cache->hits;
+  stats->misses    = cache->misses;
+  stats->entries   = cache->entries;
+  stats->bytes     = cache->bytes;
+  stats->max_bytes = cache->max_bytes;
+}
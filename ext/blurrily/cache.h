@@ -0,0 +1,51 @@
+/*
+
+  cache.h --
+
+  Bounded LRU cache of query results, keyed by the needle's trigram set and
+  the result limit.
+
+  Entries are tagged with the generation of the map they were computed
+  from; entries from an older generation are treated as misses and
+  discarded lazily.
+
+*/
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+#include "tokeniser.h"
+#include "storage.h"
+
+typedef struct blurrily_cache_t blurrily_cache_t;
+
+typedef struct blurrily_cache_stat_t {
+  uint64_t hits;
+  uint64_t misses;
+  uint32_t entries;
+  size_t   bytes;
+  size_t   max_bytes;
+} blurrily_cache_stat_t;
+
+
+/* Allocate a cache holding at most <max_bytes> of entries */
+int blurrily_cache_new(blurrily_cache_t** cache_ptr, size_t max_bytes);
+
+/* Destroy a cache */
+void blurrily_cache_free(blurrily_cache_t** cache_ptr);
+
+/*
+  Look up results for <trigrams> and <limit> computed at <generation>.
+
+  Returns the number of results copied into <results> on a hit, -1 on a miss.
+*/
+int blurrily_cache_get(blurrily_cache_t* cache, uint32_t generation, const trigram_t* trigrams, int nb_trigrams, uint16_t limit, trigram_match results);
+
+/* Store <nb_results> <results> for <trigrams> and <limit> at <generation> */
+void blurrily_cache_put(blurrily_cache_t* cache, uint32_t generation, const trigram_t* trigrams, int nb_trigrams, uint16_t limit, const trigram_match_t* results, int nb_results);
+
+/* Copy counters into <stats> */
+void blurrily_cache_stats(blurrily_cache_t* cache, blurrily_cache_stat_t* stats);
+
+#endif
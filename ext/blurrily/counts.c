@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include "counts.h"
+
+/******************************************************************************/
+
+#define COUNTS_START_SLOTS 1024
+
+/******************************************************************************/
+
+static uint32_t hash_ref(uint32_t ref)
+{
+  /* murmur3 finaliser */
+  ref ^= ref >> 16;
+  ref *= 0x85ebca6b;
+  ref ^= ref >> 13;
+  ref *= 0xc2b2ae35;
+  ref ^= ref >> 16;
+  return ref;
+}
+
+/******************************************************************************/
+
+/* slot holding <ref>, or the free slot where it would go */
+static uint32_t find_slot(const count_slot_t* slots, uint32_t nb_slots, uint32_t ref)
+{
+  uint32_t mask = nb_slots - 1;
+  uint32_t slot = hash_ref(ref) & mask;
+
+  while (slots[slot].count != 0 && slots[slot].reference != ref) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/******************************************************************************/
+
+/* copies the table to the heap if still mapped from disk */
+static int detach(blurrily_counts_t* counts)
+{
+  count_slot_t* slots = NULL;
+
+  if (counts->slots_offset == 0) return 0;
+
+  slots = (count_slot_t*) malloc(counts->nb_slots * sizeof(count_slot_t));
+  if (slots == NULL) return -1;
+  memcpy(slots, counts->slots, counts->nb_slots * sizeof(count_slot_t));
+  counts->slots        = slots;
+  counts->slots_offset = 0;
+  return 0;
+}
+
+/******************************************************************************/
+
+static int grow_slots(blurrily_counts_t* counts)
+{
+  uint32_t      nb_slots = counts->nb_slots ? counts->nb_slots * 2 : COUNTS_START_SLOTS;
+  count_slot_t* slots    = (count_slot_t*) calloc(nb_slots, sizeof(count_slot_t));
+
+  if (slots == NULL) return -1;
+  for (uint32_t k = 0; k < counts->nb_slots; ++k) {
+    count_slot_t* slot = counts->slots + k;
+    if (slot->count == 0) continue;
+    slots[find_slot(slots, nb_slots, slot->reference)] = *slot;
+  }
+
+  free(counts->slots);
+  counts->slots    = slots;
+  counts->nb_slots = nb_slots;
+  return 0;
+}
+
+/******************************************************************************/
+
+void blurrily_counts_init(blurrily_counts_t* counts)
+{
+  counts->count        = 0;
+  counts->nb_slots     = 0;
+  counts->slots        = NULL;
+  counts->slots_offset = 0;
+}
+
+/******************************************************************************/
+
+void blurrily_counts_free(blurrily_counts_t* counts)
+{
+  if (counts->slots_offset == 0) free(counts->slots);
+  counts->slots = NULL;
+}
+
+/******************************************************************************/
+
+int blurrily_counts_put(blurrily_counts_t* counts, uint32_t reference, uint32_t nb_trigrams)
+{
+  count_slot_t* slot = NULL;
+
+  if (nb_trigrams == 0) return 0;
+  if (detach(counts) < 0) return -1;
+  if (2 * (counts->count + 1) > counts->nb_slots && grow_slots(counts) < 0) return -1;
+
+  slot = counts->slots + find_slot(counts->slots, counts->nb_slots, reference);
+  if (slot->count == 0) counts->count += 1;
+  slot->reference = reference;
+  slot->count     = nb_trigrams;
+  return 0;
+}
+
+/******************************************************************************/
+
+uint32_t blurrily_counts_get(const blurrily_counts_t* counts, uint32_t reference)
+{
+  if (counts->nb_slots == 0) return 0;
+  return counts->slots[find_slot(counts->slots, counts->nb_slots, reference)].count;
+}
+
+/******************************************************************************/
+
+void blurrily_counts_delete(blurrily_counts_t* counts, uint32_t reference)
+{
+  count_slot_t* slots = NULL;
+  uint32_t      mask  = counts->nb_slots - 1;
+  uint32_t      hole  = 0;
+  uint32_t      slot  = 0;
+
+  if (counts->nb_slots == 0) return;
+  if (blurrily_counts_get(counts, reference) == 0) return;
+  if (detach(counts) < 0) return;
+
+  /* backward-shift deletion, as in the reference set */
+  slots = counts->slots;
+  hole  = find_slot(slots, counts->nb_slots, reference);
+  slots[hole].count = 0;
+  counts->count -= 1;
+  for (slot = (hole + 1) & mask; slots[slot].count != 0; slot = (slot + 1) & mask) {
+    uint32_t home = hash_ref(slots[slot].reference) & mask;
+
+    if (hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot)) continue;
+
+    slots[hole] = slots[slot];
+    slots[slot].count = 0;
+    hole = slot;
+  }
+}
+
+/******************************************************************************/
+
+size_t blurrily_counts_memsize(const blurrily_counts_t* counts)
+{
+  return counts->nb_slots * sizeof(count_slot_t);
+}
@@ -0,0 +1,64 @@
+/*
+
+  counts.h --
+
+  Number of distinct trigrams of each reference, so finds can normalise
+  shared trigrams into a similarity between needle and reference.
+
+  An open-addressing table maps references to their count; a zero count
+  marks a free slot, as references without trigrams never match. The table
+  lives in the map file and is copied to the heap on the first write after
+  loading, like posting lists.
+
+*/
+#ifndef __COUNTS_H__
+#define __COUNTS_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include "blurrily.h"
+
+/* one slot of the table */
+struct BR_PACKED_STRUCT count_slot_t
+{
+  uint32_t reference;
+  uint32_t count;       /* 0 for a free slot */
+};
+typedef struct count_slot_t count_slot_t;
+
+/* embedded in the map header */
+struct BR_PACKED_STRUCT blurrily_counts_t
+{
+  uint32_t      count;
+  uint32_t      nb_slots;      /* a power of two, or zero */
+  count_slot_t* slots;         /* set when the structure is in memory */
+  off_t         slots_offset;  /* set when the structure is on disk */
+};
+typedef struct blurrily_counts_t blurrily_counts_t;
+
+
+/* Reset to an empty table */
+void blurrily_counts_init(blurrily_counts_t* counts);
+
+/* Release heap memory */
+void blurrily_counts_free(blurrily_counts_t* counts);
+
+/*
+  Record that <reference> has <nb_trigrams> trigrams, replacing any
+  previous count. Zero counts are not stored.
+
+  Returns 0 on success, negative on failure.
+*/
+int blurrily_counts_put(blurrily_counts_t* counts, uint32_t reference, uint32_t nb_trigrams);
+
+/* Trigrams of <reference>, 0 if unknown */
+uint32_t blurrily_counts_get(const blurrily_counts_t* counts, uint32_t reference);
+
+/* Forget the count of <reference> */
+void blurrily_counts_delete(blurrily_counts_t* counts, uint32_t reference);
+
+/* Bytes of the table */
+size_t blurrily_counts_memsize(const blurrily_counts_t* counts);
+
+#endif
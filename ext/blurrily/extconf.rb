@@ -12,6 +12,18 @@ when 'LINUX'
   SHARED_FLAGS << ' -D_FILE_OFFSET_BITS=64'
 end
 
+# characters trigrams are made of: `gem install blurrily --
+# --with-blurrily-alphabet=alnum` adds digits to the latin letters. Maps
+# saved with one alphabet cannot be loaded with the other.
+case with_config('blurrily-alphabet', 'latin')
+when 'latin' then nil
+when 'alnum' then SHARED_FLAGS << ' -DBLURRILY_ALPHABET_ALNUM'
+else abort 'blurrily-alphabet must be latin or alnum'
+end
+
+# lets the GC account for the memory of maps (Ruby 2.4 and later)
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
 # production
 $CFLAGS += " #{SHARED_FLAGS} -Os"
 
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+
+/******************************************************************************/
+
+static int compare_references(const void* left_p, const void* right_p)
+{
+  uint32_t left  = *(const uint32_t*)left_p;
+  uint32_t right = *(const uint32_t*)right_p;
+
+  return (left > right) - (left < right);
+}
+
+/******************************************************************************/
+
+int blurrily_filter_new(blurrily_filter_t** filter_ptr, const uint32_t* references, uint32_t nb_references)
+{
+  blurrily_filter_t* filter    = NULL;
+  uint32_t*          sorted    = NULL;
+  uint32_t           count     = 0;
+  uint64_t           nb_words  = 0;
+  int                res       = -1;
+
+  filter = (blurrily_filter_t*) calloc(1, sizeof(blurrily_filter_t));
+  if (filter == NULL) goto cleanup;
+
+  if (nb_references > 0) {
+    sorted = (uint32_t*) malloc(nb_references * sizeof(uint32_t));
+    if (sorted == NULL) goto cleanup;
+    memcpy(sorted, references, nb_references * sizeof(uint32_t));
+    qsort(sorted, nb_references, sizeof(uint32_t), &compare_references);
+
+    for (uint32_t k = 0; k < nb_references; ++k) {
+      if (count == 0 || sorted[count-1] != sorted[k]) sorted[count++] = sorted[k];
+    }
+    filter->max_reference = sorted[count-1];
+  }
+  filter->count = count;
+
+  /* a bitmap when no larger than the array */
+  nb_words = ((uint64_t)filter->max_reference >> 6) + 1;
+  if (count > 0 && nb_words * sizeof(uint64_t) <= (uint64_t)count * sizeof(uint32_t)) {
+    filter->bits = (uint64_t*) calloc(nb_words, sizeof(uint64_t));
+    if (filter->bits == NULL) goto cleanup;
+    for (uint32_t k = 0; k < count; ++k) {
+      filter->bits[sorted[k] >> 6] |= (uint64_t)1 << (sorted[k] & 63);
+    }
+    free(sorted);
+  } else {
+    filter->references = sorted;
+  }
+  sorted = NULL;
+
+  *filter_ptr = filter;
+  filter = NULL;
+  res = 0;
+
+cleanup:
+  free(sorted);
+  blurrily_filter_free(&filter);
+  return res;
+}
+
+/******************************************************************************/
+
+void blurrily_filter_free(blurrily_filter_t** filter_ptr)
+{
+  blurrily_filter_t* filter = *filter_ptr;
+
+  if (filter == NULL) return;
+  free(filter->bits);
+  free(filter->references);
+  free(filter);
+  *filter_ptr = NULL;
+}
+
+/******************************************************************************/
+
+size_t blurrily_filter_memsize(const blurrily_filter_t* filter)
+{
+  size_t size = sizeof(blurrily_filter_t);
+
+  if (filter->bits) size += (((size_t)filter->max_reference >> 6) + 1) * sizeof(uint64_t);
+  else size += filter->count * sizeof(uint32_t);
+  return size;
+}
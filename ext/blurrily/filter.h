@@ -0,0 +1,60 @@
+/*
+
+  filter.h --
+
+  Set of references a find may return, built once and reused across
+  queries.
+
+  Dense sets are stored as a bitmap indexed by reference; sparse ones, where
+  the bitmap would be larger, as a sorted array searched by bisection.
+
+*/
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+
+typedef struct blurrily_filter_t
+{
+  uint32_t  count;          /* distinct references */
+  uint32_t  max_reference;
+  uint64_t* bits;           /* bit <r> set for reference <r>, or NULL */
+  uint32_t* references;     /* sorted, when not a bitmap */
+} blurrily_filter_t;
+
+
+/*
+  Build a filter from <nb_references> <references>, in any order and
+  possibly repeated.
+
+  Returns 0 on success, negative on failure.
+*/
+int blurrily_filter_new(blurrily_filter_t** filter_ptr, const uint32_t* references, uint32_t nb_references);
+
+/* Destroy a filter */
+void blurrily_filter_free(blurrily_filter_t** filter_ptr);
+
+/* Bytes used by the filter */
+size_t blurrily_filter_memsize(const blurrily_filter_t* filter);
+
+/* Whether <reference> is in the filter */
+static inline int blurrily_filter_test(const blurrily_filter_t* filter, uint32_t reference)
+{
+  uint32_t low  = 0;
+  uint32_t high = 0;
+
+  if (reference > filter->max_reference) return 0;
+  if (filter->bits) return (int) ((filter->bits[reference >> 6] >> (reference & 63)) & 1);
+
+  high = filter->count;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+
+    if (filter->references[middle] < reference) low = middle + 1;
+    else high = middle;
+  }
+  return low < filter->count && filter->references[low] == reference;
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include <ruby.h>
+#include <ruby/encoding.h>
 #include <assert.h>
+#include <pthread.h>
 #include "storage.h"
+#include "tokeniser.h"
 #include "blurrily.h"
 
 static VALUE eClosedError = Qnil;
@@ -41,6 +44,87 @@ static void blurrily_mark(void* haystack)
 
 /******************************************************************************/
 
+static size_t blurrily_memsize(const void* haystack)
+{
+  trigram_memsize_t memsize;
+
+  if (haystack == NULL) return 0;
+  if (blurrily_storage_memsize((trigram_map) haystack, &memsize) < 0) return 0;
+  return memsize.mapped + memsize.heap;
+}
+
+/******************************************************************************/
+
+static const rb_data_type_t blurrily_type = {
+  .wrap_struct_name = "Blurrily::RawMap",
+  .function = {
+    .dmark = blurrily_mark,
+    .dfree = blurrily_free,
+    .dsize = blurrily_memsize,
+  },
+};
+
+/******************************************************************************/
+
+/* single puts between two reports of a map's heap to the GC, as measuring */
+/* it walks every posting list */
+#define GC_REPORT_PUTS 1024
+
+/*
+  Tells the GC how much the heap memory of the map <self> changed since
+  last reported, so that growing maps make it run as other allocations
+  would. The amount reported so far is kept in @gc_heap.
+*/
+static void report_heap(VALUE self, trigram_map haystack)
+{
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  VALUE             rb_reported = rb_ivar_get(self, rb_intern("@gc_heap"));
+  ssize_t           reported    = NIL_P(rb_reported) ? 0 : NUM2SSIZET(rb_reported);
+  ssize_t           heap        = 0;
+  trigram_memsize_t memsize;
+
+  if (haystack && blurrily_storage_memsize(haystack, &memsize) >= 0) heap = (ssize_t) memsize.heap;
+  rb_gc_adjust_memory_usage(heap - reported);
+  rb_ivar_set(self, rb_intern("@gc_heap"), SSIZET2NUM(heap));
+#endif
+  rb_ivar_set(self, rb_intern("@gc_puts"), INT2FIX(0));
+}
+
+/* <report_heap>, every GC_REPORT_PUTS calls */
+static void report_heap_after_put(VALUE self, trigram_map haystack)
+{
+  VALUE rb_puts = rb_ivar_get(self, rb_intern("@gc_puts"));
+  int   puts    = NIL_P(rb_puts) ? 1 : FIX2INT(rb_puts) + 1;
+
+  if (puts >= GC_REPORT_PUTS) {
+    report_heap(self, haystack);
+  } else {
+    rb_ivar_set(self, rb_intern("@gc_puts"), INT2FIX(puts));
+  }
+}
+
+/******************************************************************************/
+
+static void filter_free(void* filter)
+{
+  blurrily_filter_free((blurrily_filter_t**) &filter);
+}
+
+static size_t filter_memsize(const void* filter)
+{
+  return filter ? blurrily_filter_memsize((const blurrily_filter_t*) filter) : 0;
+}
+
+static const rb_data_type_t filter_type = {
+  .wrap_struct_name = "Blurrily::Filter",
+  .function = {
+    .dfree = filter_free,
+    .dsize = filter_memsize,
+  },
+};
+
+/******************************************************************************/
+
 static VALUE blurrily_new(VALUE class) {
   VALUE       wrapper  = Qnil;
   trigram_map haystack = (trigram_map)NULL;
@@ -49,23 +133,52 @@ static VALUE blurrily_new(VALUE class) {
   res = blurrily_storage_new(&haystack);
   if (res < 0) { rb_sys_fail(NULL); return Qnil; }
 
-  wrapper = Data_Wrap_Struct(class, blurrily_mark, blurrily_free, (void*)haystack);
+  wrapper = TypedData_Wrap_Struct(class, &blurrily_type, (void*)haystack);
+  report_heap(wrapper, haystack);
   rb_obj_call_init(wrapper, 0, NULL);
   return wrapper;
 }
 
 /******************************************************************************/
 
-static VALUE blurrily_load(VALUE class, VALUE rb_path) {
-  char*       path     = StringValuePtr(rb_path);
-  VALUE       wrapper  = Qnil;
-  trigram_map haystack = (trigram_map)NULL;
-  int         res      = -1;
+static const char* load_mode_names[BLURRILY_LOAD_MODES] = {
+  "lazy", "populate", "willneed", "random", "lock", "hugepages"
+};
+
+static blurrily_load_mode_t load_mode_from_options(VALUE rb_options) {
+  VALUE rb_mode = Qnil;
 
-  res = blurrily_storage_load(&haystack, path);
+  if (NIL_P(rb_options)) return BLURRILY_LOAD_LAZY;
+  rb_mode = rb_hash_aref(rb_options, ID2SYM(rb_intern("mode")));
+  if (NIL_P(rb_mode)) return BLURRILY_LOAD_LAZY;
+  if (!SYMBOL_P(rb_mode)) rb_raise(rb_eArgError, "load mode must be a symbol");
+
+  for (int mode = 0; mode < BLURRILY_LOAD_MODES; ++mode) {
+    if (SYM2ID(rb_mode) == rb_intern(load_mode_names[mode])) return (blurrily_load_mode_t) mode;
+  }
+  rb_raise(rb_eArgError, "unknown load mode");
+  return BLURRILY_LOAD_LAZY;
+}
+
+static VALUE blurrily_load(int argc, VALUE* argv, VALUE class) {
+  VALUE                rb_path    = Qnil;
+  VALUE                rb_options = Qnil;
+  char*                path       = NULL;
+  VALUE                wrapper    = Qnil;
+  trigram_map          haystack   = (trigram_map)NULL;
+  blurrily_load_mode_t mode       = BLURRILY_LOAD_LAZY;
+  int                  res        = -1;
+
+  rb_scan_args(argc, argv, "11", &rb_path, &rb_options);
+  path = StringValuePtr(rb_path);
+  if (!NIL_P(rb_options)) Check_Type(rb_options, T_HASH);
+  mode = load_mode_from_options(rb_options);
+
+  res = blurrily_storage_load(&haystack, path, mode);
   if (res < 0) { rb_sys_fail(NULL); return Qnil; }
 
-  wrapper = Data_Wrap_Struct(class, blurrily_mark, blurrily_free, (void*)haystack);
+  wrapper = TypedData_Wrap_Struct(class, &blurrily_type, (void*)haystack);
+  report_heap(wrapper, haystack);
   rb_obj_call_init(wrapper, 0, NULL);
   return wrapper;
 }
@@ -86,10 +199,11 @@ static VALUE blurrily_put(VALUE self, VALUE rb_needle, VALUE rb_reference, VALUE
   uint32_t     weight    = NUM2UINT(rb_weight);
 
   if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
 
   res = blurrily_storage_put(haystack, needle, reference, weight);
   assert(res >= 0);
+  report_heap_after_put(self, haystack);
 
   return INT2NUM(res);
 }
@@ -102,7 +216,7 @@ static VALUE blurrily_delete(VALUE self, VALUE rb_reference) {
   int          res       = -1;
 
   if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
 
   res = blurrily_storage_delete(haystack, reference);
   assert(res >= 0);
@@ -112,13 +226,79 @@ static VALUE blurrily_delete(VALUE self, VALUE rb_reference) {
 
 /******************************************************************************/
 
+/* <rb_puts> is an array of [needle, reference, weight] triplets */
+static VALUE blurrily_put_batch(VALUE self, VALUE rb_puts) {
+  trigram_map    haystack = (trigram_map)NULL;
+  trigram_put_t* puts     = NULL;
+  VALUE          rb_tmp   = 0;
+  long           nb_puts  = 0;
+  int            res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+  Check_Type(rb_puts, T_ARRAY);
+  nb_puts = RARRAY_LEN(rb_puts);
+
+  /* the array keeps the needles alive while we point to them */
+  puts = ALLOCV_N(trigram_put_t, rb_tmp, nb_puts);
+  for (long k = 0; k < nb_puts; ++k) {
+    VALUE rb_put    = rb_ary_entry(rb_puts, k);
+    VALUE rb_needle = Qnil;
+
+    Check_Type(rb_put, T_ARRAY);
+    if (RARRAY_LEN(rb_put) != 3) rb_raise(rb_eArgError, "puts must be [needle, reference, weight] triplets");
+    rb_needle = rb_ary_entry(rb_put, 0);
+    Check_Type(rb_needle, T_STRING);
+
+    puts[k].needle    = StringValueCStr(rb_needle);
+    puts[k].reference = NUM2UINT(rb_ary_entry(rb_put, 1));
+    puts[k].weight    = NUM2UINT(rb_ary_entry(rb_put, 2));
+  }
+
+  res = blurrily_storage_put_batch(haystack, puts, (int) nb_puts);
+  ALLOCV_END(rb_tmp);
+  if (res < 0) rb_sys_fail(NULL);
+  report_heap(self, haystack);
+
+  return INT2NUM(res);
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_delete_batch(VALUE self, VALUE rb_references) {
+  trigram_map haystack      = (trigram_map)NULL;
+  uint32_t*   references    = NULL;
+  VALUE       rb_tmp        = 0;
+  long        nb_references = 0;
+  int         res           = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+  Check_Type(rb_references, T_ARRAY);
+  nb_references = RARRAY_LEN(rb_references);
+
+  references = ALLOCV_N(uint32_t, rb_tmp, nb_references);
+  for (long k = 0; k < nb_references; ++k) {
+    references[k] = NUM2UINT(rb_ary_entry(rb_references, k));
+  }
+
+  res = blurrily_storage_delete_batch(haystack, references, (int) nb_references);
+  ALLOCV_END(rb_tmp);
+  if (res < 0) rb_sys_fail(NULL);
+  report_heap(self, haystack);
+
+  return INT2NUM(res);
+}
+
+/******************************************************************************/
+
 static VALUE blurrily_save(VALUE self, VALUE rb_path) {
   trigram_map  haystack  = (trigram_map)NULL;
   int          res       = -1;
   const char*  path      = StringValuePtr(rb_path);
 
   if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
 
   res = blurrily_storage_save(haystack, path);
   if (res < 0) rb_sys_fail(NULL);
@@ -128,51 +308,434 @@ static VALUE blurrily_save(VALUE self, VALUE rb_path) {
 
 /******************************************************************************/
 
-static VALUE blurrily_find(VALUE self, VALUE rb_needle, VALUE rb_limit) {
-  trigram_map   haystack   = (trigram_map)NULL;
-  int           res        = -1;
-  const char*   needle     = StringValuePtr(rb_needle);
-  int           limit      = NUM2UINT(rb_limit);
-  trigram_match matches    = NULL;
-  VALUE         rb_matches = Qnil;
+/*
+  Results buffer reused across finds, one per thread as Ruby threads are
+  native threads. Finds never release the GVL: the buffer is filled and the
+  result array built from it while holding it. The find_across workers fill
+  buffers of their own; only the calling thread merges into this one.
+*/
+typedef struct scratch_t {
+  trigram_match matches;
+  int           size;
+} scratch_t;
+
+static pthread_key_t  scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void* data)
+{
+  scratch_t* scratch = (scratch_t*) data;
 
-  if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  free(scratch->matches);
+  free(scratch);
+}
+
+static void scratch_create_key(void)
+{
+  int res = pthread_key_create(&scratch_key, scratch_free);
+  assert(res == 0);
+  (void) res;
+}
 
-  if (limit <= 0) {
-    // rb_limit = rb_const_get(eBlurrilyModule, rb_intern('LIMIT_DEFAULT'));
-    rb_limit = rb_const_get(eBlurrilyModule, rb_intern("LIMIT_DEFAULT"));
-    limit = NUM2UINT(rb_limit);
+/* a buffer for at least <limit> matches, or NULL */
+static trigram_match scratch_matches(int limit)
+{
+  scratch_t*    scratch = NULL;
+  trigram_match matches = NULL;
+
+  (void) pthread_once(&scratch_once, scratch_create_key);
+  scratch = (scratch_t*) pthread_getspecific(scratch_key);
+  if (scratch == NULL) {
+    scratch = (scratch_t*) calloc(1, sizeof(scratch_t));
+    if (scratch == NULL) return NULL;
+    if (pthread_setspecific(scratch_key, scratch) != 0) { free(scratch); return NULL; }
   }
-  matches = (trigram_match) malloc(limit * sizeof(trigram_match_t));
 
-  res = blurrily_storage_find(haystack, needle, limit, matches);
+  if (scratch->size < limit) {
+    matches = (trigram_match) realloc(scratch->matches, limit * sizeof(trigram_match_t));
+    if (matches == NULL) return NULL;
+    scratch->matches = matches;
+    scratch->size    = limit;
+  }
+  return scratch->matches;
+}
+
+/******************************************************************************/
+
+static const char* similarity_names[BLURRILY_SIMILARITIES] = {
+  "matches", "dice", "jaccard", "cosine"
+};
+
+static blurrily_similarity_t similarity_from_option(VALUE rb_similarity) {
+  if (NIL_P(rb_similarity)) return BLURRILY_SIMILARITY_MATCHES;
+  if (!SYMBOL_P(rb_similarity)) rb_raise(rb_eArgError, "similarity must be a symbol");
+
+  for (int similarity = 0; similarity < BLURRILY_SIMILARITIES; ++similarity) {
+    if (SYM2ID(rb_similarity) == rb_intern(similarity_names[similarity])) return (blurrily_similarity_t) similarity;
+  }
+  rb_raise(rb_eArgError, "unknown similarity");
+  return BLURRILY_SIMILARITY_MATCHES;
+}
+
+/*
+  Reads the :rerank, :budget, :timeout, :filter, :min_weight, :max_weight,
+  :similarity and :prefix of the <rb_options> Hash. The filter must outlive
+  the find.
+*/
+static void parse_find_options(VALUE rb_options, trigram_find_options_t* options)
+{
+  VALUE rb_rerank     = Qnil;
+  VALUE rb_budget     = Qnil;
+  VALUE rb_timeout    = Qnil;
+  VALUE rb_filter     = Qnil;
+  VALUE rb_min_weight = Qnil;
+  VALUE rb_max_weight = Qnil;
+
+  memset(options, 0, sizeof(*options));
+  if (NIL_P(rb_options)) return;
+
+  Check_Type(rb_options, T_HASH);
+  rb_rerank  = rb_hash_aref(rb_options, ID2SYM(rb_intern("rerank")));
+  rb_budget  = rb_hash_aref(rb_options, ID2SYM(rb_intern("budget")));
+  rb_timeout = rb_hash_aref(rb_options, ID2SYM(rb_intern("timeout")));
+  if (!NIL_P(rb_rerank))  options->rerank      = NUM2USHORT(rb_rerank);
+  if (!NIL_P(rb_budget))  options->max_entries = NUM2UINT(rb_budget);
+  if (!NIL_P(rb_timeout)) options->timeout_ns  = (uint64_t) (NUM2DBL(rb_timeout) * 1e9);
+
+  rb_filter     = rb_hash_aref(rb_options, ID2SYM(rb_intern("filter")));
+  rb_min_weight = rb_hash_aref(rb_options, ID2SYM(rb_intern("min_weight")));
+  rb_max_weight = rb_hash_aref(rb_options, ID2SYM(rb_intern("max_weight")));
+  if (!NIL_P(rb_filter))     options->filter     = (const blurrily_filter_t*) rb_check_typeddata(rb_filter, &filter_type);
+  if (!NIL_P(rb_min_weight)) options->min_weight = NUM2UINT(rb_min_weight);
+  if (!NIL_P(rb_max_weight)) options->max_weight = NUM2UINT(rb_max_weight);
+
+  options->similarity = similarity_from_option(rb_hash_aref(rb_options, ID2SYM(rb_intern("similarity"))));
+  options->prefix     = RTEST(rb_hash_aref(rb_options, ID2SYM(rb_intern("prefix"))));
+}
+
+/* The <rb_limit> argument, or LIMIT_DEFAULT if not positive */
+static int parse_limit(VALUE rb_limit)
+{
+  int limit = NUM2UINT(rb_limit);
+
+  if (limit > 0) return limit;
+  return NUM2UINT(rb_const_get(eBlurrilyModule, rb_intern("LIMIT_DEFAULT")));
+}
+
+/* A match as a Ruby array, with its distance if re-ranked */
+static VALUE match_to_array(trigram_match match, const trigram_find_options_t* options)
+{
+  int   reranked = options->rerank > 0;
+  int   scored   = options->similarity != BLURRILY_SIMILARITY_MATCHES;
+  VALUE rb_match = rb_ary_new2(3 + reranked + scored);
+
+  rb_ary_push(rb_match, rb_uint_new(match->reference));
+  rb_ary_push(rb_match, rb_uint_new(match->matches));
+  rb_ary_push(rb_match, rb_uint_new(match->weight));
+  if (reranked) {
+    rb_ary_push(rb_match, match->distance == BLURRILY_NO_DISTANCE ? Qnil : rb_uint_new(match->distance));
+  }
+  if (scored) {
+    rb_ary_push(rb_match, DBL2NUM((double) match->score / BLURRILY_SCORE_SCALE));
+  }
+  return rb_match;
+}
+
+/******************************************************************************/
+
+/*
+  Runs a find with the <needle>, <limit> and <options> Ruby arguments, and
+  points <matches> to the results in the scratch buffer. Records whether
+  the find ran out of budget in @truncated, and how it went in <explain>
+  if not NULL.
+
+  Returns the number of matches.
+*/
+static int find_matches(VALUE self, VALUE rb_needle, VALUE rb_limit, VALUE rb_options, trigram_find_options_t* options, trigram_match* matches, blurrily_explain_t* explain)
+{
+  trigram_map haystack   = (trigram_map)NULL;
+  const char* needle     = StringValuePtr(rb_needle);
+  int         limit      = parse_limit(rb_limit);
+  int         res        = -1;
+
+  parse_find_options(rb_options, options);
+  options->explain = explain;
+  raise_if_closed(self);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  *matches = scratch_matches(limit);
+  if (*matches == NULL) rb_memerror();
+
+  res = blurrily_storage_find_with(haystack, needle, limit, options, *matches);
   assert(res >= 0);
+  rb_ivar_set(self, rb_intern("@truncated"), options->truncated ? Qtrue : Qfalse);
+  return res;
+}
+
+/******************************************************************************/
+
+/* The <rb_matches> of a find on <rb_needle>, and how it went */
+static VALUE explain_to_hash(VALUE rb_needle, VALUE rb_matches, const blurrily_explain_t* explain)
+{
+  VALUE result      = rb_hash_new();
+  VALUE rb_trigrams = rb_ary_new();
+  VALUE rb_phases   = rb_hash_new();
+  char  trigram[4];
+
+  for (uint32_t k = 0; k < explain->nb_trigrams && k < BLURRILY_EXPLAIN_TRIGRAMS; ++k) {
+    if (blurrily_tokeniser_trigram(explain->trigrams[k], trigram) < 0) continue;
+    rb_ary_push(rb_trigrams, rb_assoc_new(rb_str_new_cstr(trigram), UINT2NUM(explain->list_lengths[k])));
+  }
+
+  /* the whole find, then each of its steps */
+  (void) rb_hash_aset(rb_phases, ID2SYM(rb_intern(blurrily_metrics_phase_name(BLURRILY_PHASE_FIND))), ULL2NUM(explain->phase_ns[BLURRILY_PHASE_FIND]));
+  for (int phase = BLURRILY_PHASE_TOKENISE; phase < BLURRILY_PHASE_COUNT; ++phase) {
+    (void) rb_hash_aset(rb_phases, ID2SYM(rb_intern(blurrily_metrics_phase_name((blurrily_phase_t) phase))), ULL2NUM(explain->phase_ns[phase]));
+  }
+
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("results")),      rb_matches);
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("needle")),       rb_needle);
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("nb_trigrams")),  UINT2NUM(explain->nb_trigrams));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("trigrams")),     rb_trigrams);
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("entries")),      ULL2NUM(explain->entries));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("candidates")),   UINT2NUM(explain->candidates));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("sorted_lists")), UINT2NUM(explain->sorted_lists));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("cached")),       explain->cached ? Qtrue : Qfalse);
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("by_weight")),    explain->by_weight ? Qtrue : Qfalse);
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("phases")),       rb_phases);
+  return result;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_find(int argc, VALUE* argv, VALUE self) {
+  VALUE                  rb_needle  = Qnil;
+  VALUE                  rb_limit   = Qnil;
+  VALUE                  rb_options = Qnil;
+  trigram_match          matches    = NULL;
+  VALUE                  rb_matches = Qnil;
+  int                    res        = -1;
+  int                    explained  = 0;
+  trigram_find_options_t options;
+  blurrily_explain_t     explain;
+
+  rb_scan_args(argc, argv, "21", &rb_needle, &rb_limit, &rb_options);
+  explained = !NIL_P(rb_options) && RB_TYPE_P(rb_options, T_HASH) && RTEST(rb_hash_aref(rb_options, ID2SYM(rb_intern("explain"))));
+  res = find_matches(self, rb_needle, rb_limit, rb_options, &options, &matches, explained ? &explain : NULL);
 
   /* wrap the matches into a Ruby array */
-  rb_matches = rb_ary_new();
+  rb_matches = rb_ary_new2(res);
+  for (int k = 0; k < res; ++k) {
+    rb_ary_push(rb_matches, match_to_array(matches + k, &options));
+  }
+  if (explained) return explain_to_hash(rb_needle, rb_matches, &explain);
+  return rb_matches;
+}
+
+/******************************************************************************/
+
+/*
+  Finds <needle> in each of the <maps> at once, and returns the best <limit>
+  matches overall, like <find>, each followed by the index of its map in
+  <maps>. Every map searched records in @truncated whether any of them ran
+  out of budget.
+*/
+static VALUE blurrily_find_across(int argc, VALUE* argv, VALUE UNUSED(klass)) {
+  VALUE                  rb_maps    = Qnil;
+  VALUE                  rb_needle  = Qnil;
+  VALUE                  rb_limit   = Qnil;
+  VALUE                  rb_options = Qnil;
+  VALUE                  rb_matches = Qnil;
+  VALUE                  rb_buffers = 0;
+  trigram_map*           haystacks  = NULL;
+  trigram_match          matches    = NULL;
+  int*                   sources    = NULL;
+  const char*            needle     = NULL;
+  long                   nb_maps    = 0;
+  int                    limit      = 0;
+  int                    res        = -1;
+  trigram_find_options_t options;
+
+  rb_scan_args(argc, argv, "31", &rb_maps, &rb_needle, &rb_limit, &rb_options);
+  Check_Type(rb_maps, T_ARRAY);
+  needle  = StringValuePtr(rb_needle);
+  limit   = parse_limit(rb_limit);
+  nb_maps = RARRAY_LEN(rb_maps);
+  parse_find_options(rb_options, &options);
+
+  haystacks = ALLOCV_N(trigram_map, rb_buffers, nb_maps);
+  for (long k = 0; k < nb_maps; ++k) {
+    VALUE rb_map = rb_ary_entry(rb_maps, k);
+
+    raise_if_closed(rb_map);
+    TypedData_Get_Struct(rb_map, struct trigram_map_t, &blurrily_type, haystacks[k]);
+  }
+
+  matches = scratch_matches(limit);
+  sources = (int*) malloc(limit * sizeof(int));
+  if (matches == NULL || sources == NULL) { free(sources); ALLOCV_END(rb_buffers); rb_memerror(); }
+
+  res = blurrily_storage_find_across(haystacks, (int) nb_maps, needle, limit, &options, matches, sources);
+  ALLOCV_END(rb_buffers);
+  if (res < 0) { free(sources); rb_memerror(); }
+
+  for (long k = 0; k < nb_maps; ++k) {
+    rb_ivar_set(rb_ary_entry(rb_maps, k), rb_intern("@truncated"), options.truncated ? Qtrue : Qfalse);
+  }
+
+  rb_matches = rb_ary_new2(res);
   for (int k = 0; k < res; ++k) {
-    VALUE rb_match = rb_ary_new();
-    rb_ary_push(rb_match, rb_uint_new(matches[k].reference));
-    rb_ary_push(rb_match, rb_uint_new(matches[k].matches));
-    rb_ary_push(rb_match, rb_uint_new(matches[k].weight));
+    VALUE rb_match = match_to_array(matches + k, &options);
+
+    rb_ary_push(rb_match, INT2NUM(sources[k]));
     rb_ary_push(rb_matches, rb_match);
   }
+  free(sources);
   return rb_matches;
 }
 
+/******************************************************************************/
+
+/*
+  Like <find>, but returns the matches as one binary string of packed
+  native-endian uint32 quintuplets (reference, matches, weight, distance,
+  score).
+  When given a <buffer> string, overwrites and returns it instead of
+  allocating a new one.
+*/
+static VALUE blurrily_find_packed(int argc, VALUE* argv, VALUE self) {
+  VALUE                  rb_needle  = Qnil;
+  VALUE                  rb_limit   = Qnil;
+  VALUE                  rb_options = Qnil;
+  VALUE                  rb_buffer  = Qnil;
+  trigram_match          matches    = NULL;
+  long                   length     = 0;
+  int                    res        = -1;
+  trigram_find_options_t options;
+
+  rb_scan_args(argc, argv, "22", &rb_needle, &rb_limit, &rb_options, &rb_buffer);
+  if (!NIL_P(rb_buffer)) {
+    StringValue(rb_buffer);
+    rb_str_modify(rb_buffer);
+  }
+  res    = find_matches(self, rb_needle, rb_limit, rb_options, &options, &matches, NULL);
+  length = res * (long) sizeof(trigram_match_t);
+
+  if (NIL_P(rb_buffer)) return rb_str_new((const char*) matches, length);
+
+  rb_str_resize(rb_buffer, length);
+  memcpy(RSTRING_PTR(rb_buffer), matches, length);
+  rb_enc_associate(rb_buffer, rb_ascii8bit_encoding());
+  return rb_buffer;
+}
+
+/******************************************************************************/
+
+/* Whether the last find ran out of its :budget or :timeout */
+static VALUE blurrily_truncated(VALUE self) {
+  return rb_ivar_get(self, rb_intern("@truncated")) == Qtrue ? Qtrue : Qfalse;
+}
+
+/******************************************************************************/
+
+/* References of the matches in a string returned by <find_packed> */
+static VALUE blurrily_packed_references(VALUE UNUSED(klass), VALUE rb_packed) {
+  const char* packed = NULL;
+  long        count  = 0;
+  VALUE       result = Qnil;
+
+  StringValue(rb_packed);
+  packed = RSTRING_PTR(rb_packed);
+  count  = RSTRING_LEN(rb_packed) / (long) sizeof(trigram_match_t);
+
+  result = rb_ary_new2(count);
+  for (long k = 0; k < count; ++k) {
+    trigram_match_t match;
+
+    memcpy(&match, packed + k * sizeof(trigram_match_t), sizeof(match));
+    rb_ary_push(result, rb_uint_new(match.reference));
+  }
+  return result;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_merge(VALUE self, VALUE rb_other) {
+  trigram_map haystack = (trigram_map)NULL;
+  trigram_map other    = (trigram_map)NULL;
+  int         res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  if (raise_if_closed(rb_other)) return Qnil;
+  TypedData_Get_Struct(self,     struct trigram_map_t, &blurrily_type, haystack);
+  TypedData_Get_Struct(rb_other, struct trigram_map_t, &blurrily_type, other);
+
+  res = blurrily_storage_merge(haystack, other);
+  if (res < 0) { rb_sys_fail(NULL); return Qnil; }
+  report_heap(self, haystack);
+  return INT2NUM(res);
+}
 
 /******************************************************************************/
 
-static VALUE blurrily_stats(VALUE self)
+static VALUE blurrily_list_stats(trigram_stat_t* stats)
 {
-  trigram_map     haystack = (trigram_map)NULL;
+  VALUE result  = rb_hash_new();
+  VALUE lengths = rb_ary_new();
+
+  for (int k = 0; k < BLURRILY_LIST_BUCKETS; ++k) {
+    rb_ary_push(lengths, UINT2NUM(stats->list_lengths[k]));
+  }
+
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("count")),   UINT2NUM(stats->lists));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("dirty")),   UINT2NUM(stats->dirty_lists));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("buckets")), ULL2NUM(stats->buckets));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("slack")),   ULL2NUM(stats->slack));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("lengths")), lengths);
+  return result;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_phase_stats(trigram_map haystack)
+{
+  VALUE             result = rb_hash_new();
+  blurrily_timing_t timing;
+  int               res    = -1;
+
+  for (int phase = 0; phase < BLURRILY_PHASE_COUNT; ++phase) {
+    VALUE rb_timing    = rb_hash_new();
+    VALUE rb_histogram = rb_ary_new();
+
+    res = blurrily_storage_timing(haystack, (blurrily_phase_t) phase, &timing);
+    assert(res >= 0);
+
+    for (int k = 0; k < BLURRILY_TIMING_BUCKETS; ++k) {
+      rb_ary_push(rb_histogram, ULL2NUM(timing.buckets[k]));
+    }
+    (void) rb_hash_aset(rb_timing, ID2SYM(rb_intern("count")),     ULL2NUM(timing.count));
+    (void) rb_hash_aset(rb_timing, ID2SYM(rb_intern("total_ns")),  ULL2NUM(timing.total_ns));
+    (void) rb_hash_aset(rb_timing, ID2SYM(rb_intern("histogram")), rb_histogram);
+
+    (void) rb_hash_aset(result, ID2SYM(rb_intern(blurrily_metrics_phase_name((blurrily_phase_t) phase))), rb_timing);
+  }
+  return result;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_stats(int argc, VALUE* argv, VALUE self)
+{
+  trigram_map     haystack    = (trigram_map)NULL;
   trigram_stat_t  stats;
-  VALUE           result   = rb_hash_new();
-  int             res      = -1;
+  VALUE           result      = rb_hash_new();
+  VALUE           rb_detailed = Qfalse;
+  int             res         = -1;
+
+  rb_scan_args(argc, argv, "01", &rb_detailed);
 
   if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
 
   res = blurrily_storage_stats(haystack, &stats);
   assert(res >= 0);
@@ -180,31 +743,212 @@ static VALUE blurrily_stats(VALUE self)
   (void) rb_hash_aset(result, ID2SYM(rb_intern("references")), UINT2NUM(stats.references));
   (void) rb_hash_aset(result, ID2SYM(rb_intern("trigrams")),   UINT2NUM(stats.trigrams));
 
+  if (stats.truncated > 0) {
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("truncated")), ULL2NUM(stats.truncated));
+  }
+
+  if (stats.needles_kept) {
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("needles")), UINT2NUM(stats.needles));
+  }
+
+  if (stats.cache_max_bytes > 0) {
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("cache_hits")),      ULL2NUM(stats.cache_hits));
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("cache_misses")),    ULL2NUM(stats.cache_misses));
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("cache_entries")),   UINT2NUM(stats.cache_entries));
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("cache_bytes")),     SIZET2NUM(stats.cache_bytes));
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("cache_max_bytes")), SIZET2NUM(stats.cache_max_bytes));
+  }
+
+  if (RTEST(rb_detailed)) {
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("lists")),  blurrily_list_stats(&stats));
+    (void) rb_hash_aset(result, ID2SYM(rb_intern("phases")), blurrily_phase_stats(haystack));
+  }
+
+  return result;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_memsize_breakdown(VALUE self)
+{
+  trigram_map       haystack = (trigram_map)NULL;
+  trigram_memsize_t memsize;
+  VALUE             result   = rb_hash_new();
+  int               res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_memsize(haystack, &memsize);
+  assert(res >= 0);
+
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("header")),   SIZET2NUM(memsize.header));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("postings")), SIZET2NUM(memsize.postings));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("slack")),    SIZET2NUM(memsize.slack));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("refs")),     SIZET2NUM(memsize.refs));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("needles")),  SIZET2NUM(memsize.needles));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("counts")),   SIZET2NUM(memsize.counts));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("prefixes")), SIZET2NUM(memsize.prefixes));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("by_weight")), SIZET2NUM(memsize.by_weight));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("other")),    SIZET2NUM(memsize.other));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("mapped")),   SIZET2NUM(memsize.mapped));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("heap")),     SIZET2NUM(memsize.heap));
+  (void) rb_hash_aset(result, ID2SYM(rb_intern("total")),    SIZET2NUM(memsize.mapped + memsize.heap));
+
   return result;
 }
 
 /******************************************************************************/
 
+static VALUE blurrily_shrink(VALUE self)
+{
+  trigram_map     haystack = (trigram_map)NULL;
+  int             res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_shrink(haystack);
+  if (res < 0) rb_sys_fail(NULL);
+  report_heap(self, haystack);
+
+  return self;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_set_keep_needles(VALUE self, VALUE rb_enabled)
+{
+  trigram_map haystack = (trigram_map)NULL;
+  int         res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_keep_needles(haystack, RTEST(rb_enabled));
+  if (res < 0) rb_sys_fail(NULL);
+
+  return rb_enabled;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_set_index_prefixes(VALUE self, VALUE rb_enabled)
+{
+  trigram_map haystack = (trigram_map)NULL;
+  int         res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_index_prefixes(haystack, RTEST(rb_enabled));
+  if (res < 0) rb_sys_fail(NULL);
+  report_heap(self, haystack);
+
+  return rb_enabled;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_set_order_by_weight(VALUE self, VALUE rb_enabled)
+{
+  trigram_map haystack = (trigram_map)NULL;
+  int         res      = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_order_by_weight(haystack, RTEST(rb_enabled));
+  if (res < 0) rb_sys_fail(NULL);
+  report_heap(self, haystack);
+
+  return rb_enabled;
+}
+
+/******************************************************************************/
+
+static VALUE blurrily_set_cache_size(VALUE self, VALUE rb_max_bytes)
+{
+  trigram_map     haystack  = (trigram_map)NULL;
+  size_t          max_bytes = NUM2SIZET(rb_max_bytes);
+  int             res       = -1;
+
+  if (raise_if_closed(self)) return Qnil;
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
+
+  res = blurrily_storage_cache(haystack, max_bytes);
+  if (res < 0) rb_sys_fail(NULL);
+
+  return rb_max_bytes;
+}
+
+/******************************************************************************/
+
 static VALUE blurrily_close(VALUE self)
 {
   trigram_map     haystack = (trigram_map)NULL;
   int             res      = -1;
 
   if (raise_if_closed(self)) return Qnil;
-  Data_Get_Struct(self, struct trigram_map_t, haystack);
+  TypedData_Get_Struct(self, struct trigram_map_t, &blurrily_type, haystack);
 
   res = blurrily_storage_close(&haystack);
   if (res < 0) rb_sys_fail(NULL);
 
   DATA_PTR(self) = NULL;
+  report_heap(self, NULL);
   mark_as_closed(self);
   return Qnil;
 }
 
 /******************************************************************************/
 
+/* A filter of the references in the <rb_references> array */
+static VALUE filter_new(VALUE class, VALUE rb_references) {
+  blurrily_filter_t* filter        = NULL;
+  uint32_t*          references    = NULL;
+  VALUE              rb_tmp        = 0;
+  long               nb_references = 0;
+  int                res           = -1;
+
+  Check_Type(rb_references, T_ARRAY);
+  nb_references = RARRAY_LEN(rb_references);
+
+  references = ALLOCV_N(uint32_t, rb_tmp, nb_references);
+  for (long k = 0; k < nb_references; ++k) {
+    references[k] = NUM2UINT(rb_ary_entry(rb_references, k));
+  }
+
+  res = blurrily_filter_new(&filter, references, (uint32_t) nb_references);
+  ALLOCV_END(rb_tmp);
+  if (res < 0) rb_memerror();
+
+  return TypedData_Wrap_Struct(class, &filter_type, filter);
+}
+
+static VALUE filter_include(VALUE self, VALUE rb_reference) {
+  blurrily_filter_t* filter = (blurrily_filter_t*) rb_check_typeddata(self, &filter_type);
+
+  return blurrily_filter_test(filter, NUM2UINT(rb_reference)) ? Qtrue : Qfalse;
+}
+
+static VALUE filter_size(VALUE self) {
+  blurrily_filter_t* filter = (blurrily_filter_t*) rb_check_typeddata(self, &filter_type);
+
+  return UINT2NUM(filter->count);
+}
+
+static VALUE filter_memsize_rb(VALUE self) {
+  blurrily_filter_t* filter = (blurrily_filter_t*) rb_check_typeddata(self, &filter_type);
+
+  return SIZET2NUM(blurrily_filter_memsize(filter));
+}
+
+/******************************************************************************/
+
 void Init_map_ext(void) {
   VALUE klass  = Qnil;
+  VALUE filter = Qnil;
 
   /* assume we haven't yet defined blurrily */
   eBlurrilyModule = rb_define_module("Blurrily");
@@ -217,14 +961,36 @@ void Init_map_ext(void) {
   assert(klass != Qnil);
 
   rb_define_singleton_method(klass, "new",  blurrily_new,  0);
-  rb_define_singleton_method(klass, "load", blurrily_load, 1);
+  rb_define_singleton_method(klass, "load", blurrily_load, -1);
+  rb_define_singleton_method(klass, "packed_references", blurrily_packed_references, 1);
+  rb_define_singleton_method(klass, "find_across", blurrily_find_across, -1);
+  rb_define_const(klass, "PACKED_MATCH_SIZE", INT2NUM(sizeof(trigram_match_t)));
+  rb_define_const(klass, "ALPHABET", rb_obj_freeze(rb_str_new_cstr(TRIGRAM_ALPHABET)));
 
   rb_define_method(klass, "initialize", blurrily_initialize, 0);
   rb_define_method(klass, "put",        blurrily_put,        3);
   rb_define_method(klass, "delete",     blurrily_delete,     1);
+  rb_define_method(klass, "put_batch",  blurrily_put_batch,  1);
+  rb_define_method(klass, "delete_batch", blurrily_delete_batch, 1);
   rb_define_method(klass, "save",       blurrily_save,       1);
-  rb_define_method(klass, "find",       blurrily_find,       2);
-  rb_define_method(klass, "stats",      blurrily_stats,      0);
+  rb_define_method(klass, "find",       blurrily_find,      -1);
+  rb_define_method(klass, "find_packed", blurrily_find_packed, -1);
+  rb_define_method(klass, "truncated?", blurrily_truncated,  0);
+  rb_define_method(klass, "merge",      blurrily_merge,      1);
+  rb_define_method(klass, "stats",      blurrily_stats,     -1);
+  rb_define_method(klass, "cache_size=", blurrily_set_cache_size, 1);
+  rb_define_method(klass, "keep_needles=", blurrily_set_keep_needles, 1);
+  rb_define_method(klass, "index_prefixes=", blurrily_set_index_prefixes, 1);
+  rb_define_method(klass, "order_by_weight=", blurrily_set_order_by_weight, 1);
+  rb_define_method(klass, "memsize",    blurrily_memsize_breakdown, 0);
+  rb_define_method(klass, "shrink!",    blurrily_shrink,     0);
   rb_define_method(klass, "close",      blurrily_close,      0);
+
+  filter = rb_define_class_under(eBlurrilyModule, "Filter", rb_cObject);
+  rb_undef_alloc_func(filter);
+  rb_define_singleton_method(filter, "new", filter_new, 1);
+  rb_define_method(filter, "include?", filter_include,    1);
+  rb_define_method(filter, "size",     filter_size,       0);
+  rb_define_method(filter, "memsize",  filter_memsize_rb, 0);
   return;
 }
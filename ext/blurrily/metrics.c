@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include "metrics.h"
+#include "blurrily.h"
+
+/******************************************************************************/
+
+static const char* phase_names[BLURRILY_PHASE_COUNT] = {
+  "find", "put", "delete", "save", "load",
+  "tokenise", "copy", "sort", "reduce", "rank", "rerank"
+};
+
+/******************************************************************************/
+
+int blurrily_metrics_new(blurrily_metrics_t** metrics_ptr)
+{
+  blurrily_metrics_t* metrics = NULL;
+
+  metrics = (blurrily_metrics_t*) calloc(1, sizeof(blurrily_metrics_t));
+  if (!metrics) return -1;
+
+  *metrics_ptr = metrics;
+  return 0;
+}
+
+/******************************************************************************/
+
+void blurrily_metrics_free(blurrily_metrics_t** metrics_ptr)
+{
+  free(*metrics_ptr);
+  *metrics_ptr = NULL;
+}
+
+/******************************************************************************/
+
+uint64_t blurrily_metrics_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec now;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+#else
+  struct timeval now;
+
+  (void) gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_usec * 1000ull;
+#endif
+}
+
+/******************************************************************************/
+
+static int bucket_for(uint64_t duration)
+{
+  int bucket = 0;
+
+  while (duration > 1 && bucket < BLURRILY_TIMING_BUCKETS - 1) {
+    duration >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+/******************************************************************************/
+
+uint64_t blurrily_metrics_record(blurrily_metrics_t* metrics, blurrily_phase_t phase, uint64_t start)
+{
+  uint64_t           now      = blurrily_metrics_now();
+  uint64_t           duration = now - start;
+  blurrily_timing_t* timing   = metrics->timings + phase;
+
+  __atomic_fetch_add(&timing->count,    1,        __ATOMIC_RELAXED);
+  __atomic_fetch_add(&timing->total_ns, duration, __ATOMIC_RELAXED);
+  __atomic_fetch_add(timing->buckets + bucket_for(duration), 1, __ATOMIC_RELAXED);
+  return now;
+}
+
+/******************************************************************************/
+
+void blurrily_metrics_get(blurrily_metrics_t* metrics, blurrily_phase_t phase, blurrily_timing_t* timing)
+{
+  blurrily_timing_t* source = metrics->timings + phase;
+
+  timing->count    = __atomic_load_n(&source->count,    __ATOMIC_RELAXED);
+  timing->total_ns = __atomic_load_n(&source->total_ns, __ATOMIC_RELAXED);
+  for (int k = 0; k < BLURRILY_TIMING_BUCKETS; ++k) {
+    timing->buckets[k] = __atomic_load_n(source->buckets + k, __ATOMIC_RELAXED);
+  }
+}
+
+/******************************************************************************/
+
+void blurrily_metrics_truncated(blurrily_metrics_t* metrics)
+{
+  __atomic_fetch_add(&metrics->truncated, 1, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************/
+
+uint64_t blurrily_metrics_truncations(blurrily_metrics_t* metrics)
+{
+  return __atomic_load_n(&metrics->truncated, __ATOMIC_RELAXED);
+}
+
+/******************************************************************************/
+
+const char* blurrily_metrics_phase_name(blurrily_phase_t phase)
+{
+  return phase_names[phase];
+}
@@ -0,0 +1,77 @@
+/*
+
+  metrics.h --
+
+  Always-on latency counters for the phases of map operations.
+
+  Durations are aggregated into log2 histograms of nanoseconds using relaxed
+  atomic increments, so recording is cheap and safe from any thread.
+
+*/
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <inttypes.h>
+
+/* bucket <k> counts durations in [2^k, 2^(k+1)) nanoseconds */
+#define BLURRILY_TIMING_BUCKETS 32
+
+typedef enum blurrily_phase_t {
+  /* whole operations */
+  BLURRILY_PHASE_FIND = 0,
+  BLURRILY_PHASE_PUT,
+  BLURRILY_PHASE_DELETE,
+  BLURRILY_PHASE_SAVE,
+  BLURRILY_PHASE_LOAD,
+
+  /* steps of a find */
+  BLURRILY_PHASE_TOKENISE,
+  BLURRILY_PHASE_COPY,
+  BLURRILY_PHASE_SORT,
+  BLURRILY_PHASE_REDUCE,
+  BLURRILY_PHASE_RANK,
+  BLURRILY_PHASE_RERANK,
+
+  BLURRILY_PHASE_COUNT
+} blurrily_phase_t;
+
+typedef struct blurrily_timing_t {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t buckets[BLURRILY_TIMING_BUCKETS];
+} blurrily_timing_t;
+
+typedef struct blurrily_metrics_t {
+  blurrily_timing_t timings[BLURRILY_PHASE_COUNT];
+  uint64_t          truncated;  /* finds cut short by their budget */
+} blurrily_metrics_t;
+
+
+/* Allocate zeroed metrics */
+int blurrily_metrics_new(blurrily_metrics_t** metrics_ptr);
+
+/* Destroy metrics */
+void blurrily_metrics_free(blurrily_metrics_t** metrics_ptr);
+
+/* Monotonic clock, in nanoseconds */
+uint64_t blurrily_metrics_now(void);
+
+/*
+  Record the time elapsed since <start> (as returned by <now>) against
+  <phase>, and return the current time.
+*/
+uint64_t blurrily_metrics_record(blurrily_metrics_t* metrics, blurrily_phase_t phase, uint64_t start);
+
+/* Copy a consistent-enough snapshot of <phase> into <timing> */
+void blurrily_metrics_get(blurrily_metrics_t* metrics, blurrily_phase_t phase, blurrily_timing_t* timing);
+
+/* Count a find cut short by its budget */
+void blurrily_metrics_truncated(blurrily_metrics_t* metrics);
+
+/* Number of finds cut short so far */
+uint64_t blurrily_metrics_truncations(blurrily_metrics_t* metrics);
+
+/* Name of <phase>, e.g. "find" or "tokenise" */
+const char* blurrily_metrics_phase_name(blurrily_phase_t phase);
+
+#endif
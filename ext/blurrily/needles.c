@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include "needles.h"
+
+/******************************************************************************/
+
+#define NEEDLES_START_SLOTS  1024
+#define NEEDLES_START_ARENA  4096
+#define NEEDLES_MAX_LENGTH   0xFFFF
+
+/******************************************************************************/
+
+static uint32_t hash_ref(uint32_t ref)
+{
+  /* murmur3 finaliser */
+  ref ^= ref >> 16;
+  ref *= 0x85ebca6b;
+  ref ^= ref >> 13;
+  ref *= 0xc2b2ae35;
+  ref ^= ref >> 16;
+  return ref;
+}
+
+/******************************************************************************/
+
+/* slot holding <ref>, or the free slot where it would go */
+static uint32_t find_slot(needle_slot_t* slots, uint32_t nb_slots, uint32_t ref)
+{
+  uint32_t mask = nb_slots - 1;
+  uint32_t slot = hash_ref(ref) & mask;
+
+  while (slots[slot].offset != NEEDLES_EMPTY && slots[slot].reference != ref) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/******************************************************************************/
+
+static needle_slot_t* allocate_slots(uint32_t nb_slots)
+{
+  needle_slot_t* slots = (needle_slot_t*) malloc(nb_slots * sizeof(needle_slot_t));
+
+  if (slots == NULL) return NULL;
+  for (uint32_t k = 0; k < nb_slots; ++k) {
+    slots[k].reference = 0;
+    slots[k].offset    = NEEDLES_EMPTY;
+  }
+  return slots;
+}
+
+/******************************************************************************/
+
+/* copies whatever is still mapped from disk to the heap */
+static int detach(blurrily_needles_t* needles)
+{
+  if (needles->slots_offset) {
+    needle_slot_t* slots = (needle_slot_t*) malloc(needles->nb_slots * sizeof(needle_slot_t));
+
+    if (slots == NULL) return -1;
+    memcpy(slots, needles->slots, needles->nb_slots * sizeof(needle_slot_t));
+    needles->slots        = slots;
+    needles->slots_offset = 0;
+  }
+
+  if (needles->arena_offset) {
+    uint32_t size  = needles->arena_used > NEEDLES_START_ARENA ? needles->arena_used : NEEDLES_START_ARENA;
+    uint8_t* arena = (uint8_t*) malloc(size);
+
+    if (arena == NULL) return -1;
+    memcpy(arena, needles->arena, needles->arena_used);
+    needles->arena        = arena;
+    needles->arena_size   = size;
+    needles->arena_offset = 0;
+  }
+  return 0;
+}
+
+/******************************************************************************/
+
+static int grow_slots(blurrily_needles_t* needles)
+{
+  uint32_t       nb_slots = needles->nb_slots ? needles->nb_slots * 2 : NEEDLES_START_SLOTS;
+  needle_slot_t* slots    = allocate_slots(nb_slots);
+
+  if (slots == NULL) return -1;
+  for (uint32_t k = 0; k < needles->nb_slots; ++k) {
+    needle_slot_t* slot = needles->slots + k;
+    if (slot->offset == NEEDLES_EMPTY) continue;
+    slots[find_slot(slots, nb_slots, slot->reference)] = *slot;
+  }
+
+  free(needles->slots);
+  needles->slots    = slots;
+  needles->nb_slots = nb_slots;
+  return 0;
+}
+
+/******************************************************************************/
+
+static int grow_arena(blurrily_needles_t* needles, uint32_t needed)
+{
+  uint64_t size  = needles->arena_size ? (uint64_t)needles->arena_size * 2 : NEEDLES_START_ARENA;
+  uint8_t* arena = NULL;
+
+  if (size < needed) size = needed;
+  if (size > (uint64_t)NEEDLES_EMPTY) size = NEEDLES_EMPTY;
+  if (size < needed) return -1;
+
+  arena = (uint8_t*) realloc(needles->arena, size);
+  if (arena == NULL) return -1;
+  needles->arena      = arena;
+  needles->arena_size = (uint32_t) size;
+  return 0;
+}
+
+/******************************************************************************/
+
+void blurrily_needles_init(blurrily_needles_t* needles)
+{
+  needles->enabled      = 0;
+  needles->count        = 0;
+  needles->nb_slots     = 0;
+  needles->slots        = NULL;
+  needles->slots_offset = 0;
+  needles->arena_size   = 0;
+  needles->arena_used   = 0;
+  needles->arena        = NULL;
+  needles->arena_offset = 0;
+}
+
+/******************************************************************************/
+
+void blurrily_needles_free(blurrily_needles_t* needles)
+{
+  if (needles->slots_offset == 0) free(needles->slots);
+  if (needles->arena_offset == 0) free(needles->arena);
+  needles->slots = NULL;
+  needles->arena = NULL;
+}
+
+/******************************************************************************/
+
+int blurrily_needles_put(blurrily_needles_t* needles, uint32_t reference, const char* needle, size_t length)
+{
+  uint16_t       stored = (uint16_t) (length > NEEDLES_MAX_LENGTH ? NEEDLES_MAX_LENGTH : length);
+  uint64_t       needed = (uint64_t)needles->arena_used + sizeof(uint16_t) + stored;
+  needle_slot_t* slot   = NULL;
+
+  if (detach(needles) < 0) return -1;
+  if (needed > NEEDLES_EMPTY) return -1;
+  if (2 * (needles->count + 1) > needles->nb_slots && grow_slots(needles) < 0) return -1;
+  if (needed > needles->arena_size && grow_arena(needles, (uint32_t) needed) < 0) return -1;
+
+  slot = needles->slots + find_slot(needles->slots, needles->nb_slots, reference);
+  if (slot->offset == NEEDLES_EMPTY) needles->count += 1;
+  slot->reference = reference;
+  slot->offset    = needles->arena_used;
+
+  memcpy(needles->arena + needles->arena_used, &stored, sizeof(uint16_t));
+  memcpy(needles->arena + needles->arena_used + sizeof(uint16_t), needle, stored);
+  needles->arena_used = (uint32_t) needed;
+  return 0;
+}
+
+/******************************************************************************/
+
+int blurrily_needles_get(blurrily_needles_t* needles, uint32_t reference, const uint8_t** needle, uint16_t* length)
+{
+  needle_slot_t* slot = NULL;
+
+  if (needles->nb_slots == 0) return -1;
+  slot = needles->slots + find_slot(needles->slots, needles->nb_slots, reference);
+  if (slot->offset == NEEDLES_EMPTY) return -1;
+
+  memcpy(length, needles->arena + slot->offset, sizeof(uint16_t));
+  *needle = needles->arena + slot->offset + sizeof(uint16_t);
+  return 0;
+}
+
+/******************************************************************************/
+
+void blurrily_needles_delete(blurrily_needles_t* needles, uint32_t reference)
+{
+  needle_slot_t* slots = needles->slots;
+  uint32_t       mask  = needles->nb_slots - 1;
+  uint32_t       hole  = 0;
+  uint32_t       slot  = 0;
+
+  if (needles->nb_slots == 0) return;
+  hole = find_slot(slots, needles->nb_slots, reference);
+  if (slots[hole].offset == NEEDLES_EMPTY) return;
+
+  /* backward-shift deletion, as in the reference set */
+  slots[hole].offset = NEEDLES_EMPTY;
+  needles->count -= 1;
+  for (slot = (hole + 1) & mask; slots[slot].offset != NEEDLES_EMPTY; slot = (slot + 1) & mask) {
+    uint32_t home = hash_ref(slots[slot].reference) & mask;
+
+    if (hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot)) continue;
+
+    slots[hole] = slots[slot];
+    slots[slot].offset = NEEDLES_EMPTY;
+    hole = slot;
+  }
+}
+
+/******************************************************************************/
+
+size_t blurrily_needles_memsize(blurrily_needles_t* needles)
+{
+  return needles->nb_slots * sizeof(needle_slot_t) + needles->arena_size;
+}
+
+/******************************************************************************/
+
+void blurrily_needles_shrink(blurrily_needles_t* needles)
+{
+  uint8_t* arena = NULL;
+
+  if (needles->arena_offset || needles->arena_used == needles->arena_size) return;
+  if (needles->arena_used == 0) return;
+
+  arena = (uint8_t*) realloc(needles->arena, needles->arena_used);
+  if (arena == NULL) return;
+  needles->arena      = arena;
+  needles->arena_size = needles->arena_used;
+}
+
+/******************************************************************************/
+
+/* Wagner-Fischer, one row at a time, for needles too long for Myers */
+static uint32_t edit_distance_rows(const uint8_t* left, size_t left_length, const uint8_t* right, size_t right_length, uint32_t bound)
+{
+  uint32_t* row    = (uint32_t*) malloc((left_length + 1) * sizeof(uint32_t));
+  uint32_t  result = bound + 1;
+
+  if (row == NULL) return bound + 1;
+  for (size_t i = 0; i <= left_length; ++i) row[i] = (uint32_t) i;
+
+  for (size_t j = 1; j <= right_length; ++j) {
+    uint32_t diagonal = row[0];
+    uint32_t lowest   = (uint32_t) j;
+
+    row[0] = (uint32_t) j;
+    for (size_t i = 1; i <= left_length; ++i) {
+      uint32_t above = row[i];
+      uint32_t cost  = diagonal + (left[i-1] == right[j-1] ? 0 : 1);
+
+      if (above + 1 < cost)  cost = above + 1;
+      if (row[i-1] + 1 < cost) cost = row[i-1] + 1;
+      row[i]   = cost;
+      diagonal = above;
+      if (cost < lowest) lowest = cost;
+    }
+    if (lowest > bound) goto cleanup;
+  }
+  result = row[left_length] > bound ? bound + 1 : row[left_length];
+
+cleanup:
+  free(row);
+  return result;
+}
+
+/******************************************************************************/
+
+uint32_t blurrily_edit_distance(const uint8_t* left, size_t left_length, const uint8_t* right, size_t right_length, uint32_t bound)
+{
+  uint64_t peq[256];
+  uint64_t pv    = ~(uint64_t)0;
+  uint64_t mv    = 0;
+  uint64_t high  = 0;
+  uint32_t score = (uint32_t) left_length;
+
+  if (bound >= NEEDLES_EMPTY) bound = NEEDLES_EMPTY - 1;
+
+  /* distance is at least the difference in length */
+  if ((left_length > right_length ? left_length - right_length : right_length - left_length) > bound) return bound + 1;
+
+  if (left_length > 64) {
+    if (right_length <= 64) return blurrily_edit_distance(right, right_length, left, left_length, bound);
+    return edit_distance_rows(left, left_length, right, right_length, bound);
+  }
+  if (left_length == 0) return (uint32_t) right_length;
+
+  memset(peq, 0, sizeof(peq));
+  for (size_t i = 0; i < left_length; ++i) peq[left[i]] |= (uint64_t)1 << i;
+  high = (uint64_t)1 << (left_length - 1);
+
+  for (size_t j = 0; j < right_length; ++j) {
+    uint64_t eq = peq[right[j]];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+
+    if (ph & high) ++score;
+    else if (mh & high) --score;
+
+    /* the top row counts insertions, hence the carried-in one */
+    ph = (ph << 1) | 1;
+    mh = mh << 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+
+    /* each remaining character lowers the score by at most one */
+    if ((uint64_t)score > (uint64_t)bound + (right_length - j - 1)) return bound + 1;
+  }
+  return score > bound ? bound + 1 : score;
+}
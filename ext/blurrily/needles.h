@@ -0,0 +1,89 @@
+/*
+
+  needles.h --
+
+  Optional store of the needle put for each reference, so results can be
+  re-ranked by edit distance without a round trip to the client's database.
+
+  Needles are appended to an arena, as a 16-bit length followed by the
+  bytes; an open-addressing table maps references to their offset in the
+  arena. Both live in the map file and are copied to the heap on the first
+  write after loading, like posting lists.
+
+*/
+#ifndef __NEEDLES_H__
+#define __NEEDLES_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include "blurrily.h"
+
+/* offset of free slots in the reference table */
+#define NEEDLES_EMPTY ((uint32_t)-1)
+
+/* one slot of the reference table */
+struct BR_PACKED_STRUCT needle_slot_t
+{
+  uint32_t reference;
+  uint32_t offset;      /* in the arena, NEEDLES_EMPTY for a free slot */
+};
+typedef struct needle_slot_t needle_slot_t;
+
+/* embedded in the map header */
+struct BR_PACKED_STRUCT blurrily_needles_t
+{
+  uint8_t        enabled;
+  uint32_t       count;
+  uint32_t       nb_slots;      /* a power of two, or zero */
+  needle_slot_t* slots;         /* set when the structure is in memory */
+  off_t          slots_offset;  /* set when the structure is on disk */
+
+  uint32_t       arena_size;
+  uint32_t       arena_used;
+  uint8_t*       arena;
+  off_t          arena_offset;
+};
+typedef struct blurrily_needles_t blurrily_needles_t;
+
+
+/* Reset to an empty, disabled store */
+void blurrily_needles_init(blurrily_needles_t* needles);
+
+/* Release heap memory */
+void blurrily_needles_free(blurrily_needles_t* needles);
+
+/*
+  Store <length> bytes of <needle> for <reference>, replacing any previous
+  one.
+
+  Returns 0 on success, negative on failure.
+*/
+int blurrily_needles_put(blurrily_needles_t* needles, uint32_t reference, const char* needle, size_t length);
+
+/*
+  Point <needle> to the needle stored for <reference>, and set <length>.
+
+  Returns 0 if found, -1 otherwise.
+*/
+int blurrily_needles_get(blurrily_needles_t* needles, uint32_t reference, const uint8_t** needle, uint16_t* length);
+
+/* Forget the needle of <reference>; its bytes stay in the arena */
+void blurrily_needles_delete(blurrily_needles_t* needles, uint32_t reference);
+
+/* Bytes of the table and arena */
+size_t blurrily_needles_memsize(blurrily_needles_t* needles);
+
+/* Give back unused arena space, when on the heap */
+void blurrily_needles_shrink(blurrily_needles_t* needles);
+
+/*
+  Levenshtein distance between <left> and <right>, computed with Myers'
+  bit-parallel algorithm when <left> fits a machine word.
+
+  Stops early and returns <bound> + 1 once the distance is known to
+  exceed <bound>.
+*/
+uint32_t blurrily_edit_distance(const uint8_t* left, size_t left_length, const uint8_t* right, size_t right_length, uint32_t bound);
+
+#endif
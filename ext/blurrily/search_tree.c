@@ -1,16 +1,84 @@
 #include <stdlib.h>
 #include <inttypes.h>
+#include "search_tree.h"
 #include "blurrily.h"
-#include "ruby.h"
 
 /******************************************************************************/
 
+#define REFS_START_SLOTS 1024
+#define REFS_EMPTY       ((uint32_t)-1)
+
+/******************************************************************************/
+
+/* open addressing hash set with linear probing, kept at most half full */
+/* REFS_EMPTY marks free slots, so membership of that value is kept aside */
 typedef struct blurrily_refs_t {
-  VALUE hash;
+  uint32_t* slots;
+  uint32_t  nb_slots;   /* always a power of two */
+  uint32_t  count;
+  int       has_empty;  /* whether REFS_EMPTY itself is in the set */
 } blurrily_refs_t;
 
 /******************************************************************************/
 
+static uint32_t hash_ref(uint32_t ref)
+{
+  /* murmur3 finaliser */
+  ref ^= ref >> 16;
+  ref *= 0x85ebca6b;
+  ref ^= ref >> 13;
+  ref *= 0xc2b2ae35;
+  ref ^= ref >> 16;
+  return ref;
+}
+
+/******************************************************************************/
+
+static uint32_t* allocate_slots(uint32_t nb_slots)
+{
+  uint32_t* slots = (uint32_t*) malloc(nb_slots * sizeof(uint32_t));
+
+  if (slots == NULL) return NULL;
+  for (uint32_t k = 0; k < nb_slots; ++k) slots[k] = REFS_EMPTY;
+  return slots;
+}
+
+/******************************************************************************/
+
+/* slot holding <ref>, or the empty slot where it would go */
+static uint32_t find_slot(blurrily_refs_t* refs, uint32_t ref)
+{
+  uint32_t mask = refs->nb_slots - 1;
+  uint32_t slot = hash_ref(ref) & mask;
+
+  while (refs->slots[slot] != REFS_EMPTY && refs->slots[slot] != ref) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/******************************************************************************/
+
+static int grow(blurrily_refs_t* refs)
+{
+  uint32_t* old_slots    = refs->slots;
+  uint32_t  old_nb_slots = refs->nb_slots;
+  uint32_t* slots        = allocate_slots(old_nb_slots * 2);
+
+  if (slots == NULL) return -1;
+
+  refs->slots    = slots;
+  refs->nb_slots = old_nb_slots * 2;
+  for (uint32_t k = 0; k < old_nb_slots; ++k) {
+    if (old_slots[k] == REFS_EMPTY) continue;
+    refs->slots[find_slot(refs, old_slots[k])] = old_slots[k];
+  }
+  free(old_slots);
+  return 0;
+}
+
+/******************************************************************************/
+
 int blurrily_refs_new(blurrily_refs_t** refs_ptr)
 {
   blurrily_refs_t* refs = NULL;
@@ -18,16 +86,21 @@ int blurrily_refs_new(blurrily_refs_t** refs_ptr)
   refs = (blurrily_refs_t*) malloc(sizeof(blurrily_refs_t));
   if (!refs) return -1;
 
-  refs->hash = rb_hash_new();
+  refs->slots = allocate_slots(REFS_START_SLOTS);
+  if (!refs->slots) { free(refs); return -1; }
+
+  refs->nb_slots  = REFS_START_SLOTS;
+  refs->count     = 0;
+  refs->has_empty = 0;
   *refs_ptr = refs;
   return 0;
 }
 
 /******************************************************************************/
 
-void blurrily_refs_mark(blurrily_refs_t* refs)
+void blurrily_refs_mark(blurrily_refs_t* UNUSED(refs))
 {
-  rb_gc_mark(refs->hash);
+  /* nothing managed by Ruby */
   return;
 }
 
@@ -37,7 +110,7 @@ void blurrily_refs_free(blurrily_refs_t** refs_ptr)
 {
   blurrily_refs_t* refs = *refs_ptr;
 
-  refs->hash = Qnil;
+  free(refs->slots);
   free(refs);
   *refs_ptr = NULL;
   return;
@@ -47,7 +120,18 @@ void blurrily_refs_free(blurrily_refs_t** refs_ptr)
 
 void blurrily_refs_add(blurrily_refs_t* refs, uint32_t ref)
 {
-  (void) rb_hash_aset(refs->hash, UINT2NUM(ref), Qtrue);
+  uint32_t slot = 0;
+
+  if (ref == REFS_EMPTY) { refs->has_empty = 1; return; }
+
+  if (2 * (refs->count + 1) > refs->nb_slots) (void) grow(refs);
+  if (refs->count + 1 >= refs->nb_slots) return; /* could not grow */
+
+  slot = find_slot(refs, ref);
+  if (refs->slots[slot] == ref) return;
+
+  refs->slots[slot] = ref;
+  refs->count += 1;
   return;
 }
 
@@ -55,12 +139,41 @@ void blurrily_refs_add(blurrily_refs_t* refs, uint32_t ref)
 
 void blurrily_refs_remove(blurrily_refs_t* refs, uint32_t ref)
 {
-  (void) rb_hash_aset(refs->hash, UINT2NUM(ref), Qnil);
+  uint32_t mask = refs->nb_slots - 1;
+  uint32_t hole = 0;
+  uint32_t slot = 0;
+
+  if (ref == REFS_EMPTY) { refs->has_empty = 0; return; }
+
+  hole = find_slot(refs, ref);
+  if (refs->slots[hole] != ref) return;
+
+  /* backward-shift deletion: pull later entries of the run into the hole */
+  refs->slots[hole] = REFS_EMPTY;
+  refs->count -= 1;
+  for (slot = (hole + 1) & mask; refs->slots[slot] != REFS_EMPTY; slot = (slot + 1) & mask) {
+    uint32_t home = hash_ref(refs->slots[slot]) & mask;
+
+    /* leave entries whose home lies cyclically in (hole, slot] */
+    if (hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot)) continue;
+
+    refs->slots[hole] = refs->slots[slot];
+    refs->slots[slot] = REFS_EMPTY;
+    hole = slot;
+  }
 }
 
 /******************************************************************************/
 
 int blurrily_refs_test(blurrily_refs_t* refs, uint32_t ref)
 {
-  return rb_hash_aref(refs->hash, UINT2NUM(ref)) == Qtrue ? 1 : 0;
+  if (ref == REFS_EMPTY) return refs->has_empty;
+  return refs->slots[find_slot(refs, ref)] == ref ? 1 : 0;
+}
+
+/******************************************************************************/
+
+size_t blurrily_refs_memsize(blurrily_refs_t* refs)
+{
+  return sizeof(blurrily_refs_t) + refs->nb_slots * sizeof(uint32_t);
 }
@@ -5,6 +5,7 @@
   List of all references that's fast to query for existence.
 
 */
+#include <stddef.h>
 #include <inttypes.h>
 
 
@@ -28,3 +29,6 @@ void blurrily_refs_remove(blurrily_refs_t* refs, uint32_t ref);
 
 /* Test for a reference (1 = present, 0 = absent) */
 int blurrily_refs_test(blurrily_refs_t* refs, uint32_t ref);
+
+/* Bytes of memory used */
+size_t blurrily_refs_memsize(blurrily_refs_t* refs);
@@ -7,6 +7,9 @@
 #include <sys/errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <math.h>
 
 #ifdef PLATFORM_LINUX
   #include <linux/limits.h>
@@ -23,12 +26,24 @@
 
 #include "storage.h"
 #include "search_tree.h"
+#include "cache.h"
+#include "metrics.h"
+#include "needles.h"
+#include "counts.h"
 
 /******************************************************************************/
 
 #define PAGE_SIZE                   4096
+#define FORMAT_VERSION              7
 #define TRIGRAM_COUNT               (TRIGRAM_BASE * TRIGRAM_BASE * TRIGRAM_BASE)
 #define TRIGRAM_ENTRIES_START_SIZE  PAGE_SIZE/sizeof(trigram_entry_t)
+#define FIND_ACROSS_MIN_ENTRIES     16384  /* below this, threads cost more than they save */
+#define PREFIX_DEPTH                6      /* start positions kept in the prefix index */
+#define ALPHABET_SIZE               40     /* room for TRIGRAM_ALPHABET in the header */
+#define BY_WEIGHT_MAX_LIMIT         100    /* above this, reading whole lists is cheaper */
+#define SAVE_THREAD_MIN_BYTES       (64 << 20) /* data each thread writes at least when saving */
+#define SAVE_MAX_THREADS            8
+#define SAVE_IOVECS                 64     /* blocks written per system call at most */
 
 /******************************************************************************/
 
@@ -43,7 +58,7 @@ typedef struct trigram_entry_t trigram_entry_t;
 
 /* collection of entries for a given trigram */
 /* <entries> points to an array of <buckets> entries */
-/* of which <used> are filled */
+/* of which <used> are filled, and the first <sorted> are in reference order */
 struct BR_PACKED_STRUCT trigram_entries_t
 {
   uint32_t         buckets;
@@ -52,28 +67,46 @@ struct BR_PACKED_STRUCT trigram_entries_t
   trigram_entry_t* entries;         /* set when the structure is in memory */
   off_t            entries_offset;  /* set when the structure is on disk */
 
-  uint8_t          dirty;           /* not optimised (presorted) yet */
+  uint32_t         sorted;          /* entries past this are an unsorted tail */
 };
 typedef struct trigram_entries_t trigram_entries_t;
 
 
 /* hash map of all possible trigrams to collection of entries */
-/* there are 28^3 = 19,683 possible trigrams */
+/* there are TRIGRAM_BASE^3 possible trigrams: 21,952 for letters, */
+/* 54,872 with digits */
 struct BR_PACKED_STRUCT trigram_map_t
 {
   char              magic[6];           /* the string "trigra" */
   uint8_t           big_endian;
   uint8_t           pointer_size;
+  uint32_t          format_version;     /* FORMAT_VERSION, bumped on layout changes */
+  char              alphabet[ALPHABET_SIZE]; /* TRIGRAM_ALPHABET trigrams were coded with */
 
   uint32_t          total_references;
   uint32_t          total_trigrams;
   size_t            mapped_size;        /* when mapped from disk, the number of bytes mapped */
   blurrily_refs_t*  refs;
-  
-  trigram_entries_t map[TRIGRAM_COUNT]; /* this whole structure is ~500KB */
+
+  uint32_t          generation;         /* bumped on every change, invalidates <cache> */
+  blurrily_cache_t* cache;              /* optional, results of recent finds */
+  blurrily_metrics_t* metrics;          /* per-phase timings */
+  blurrily_needles_t needles;           /* optional, for re-ranking */
+  blurrily_counts_t  counts;            /* trigrams per reference, for scoring */
+  trigram_entries_t* prefixes;          /* optional, TRIGRAM_COUNT lists of start trigrams */
+  off_t              prefixes_offset;   /* set when <prefixes> is on disk */
+  uint8_t            prefixes_complete; /* whether <prefixes> indexes every reference */
+  trigram_entries_t* by_weight;         /* optional, copies of <map> lists in weight order */
+  off_t              by_weight_offset;  /* set when <by_weight> is on disk */
+  uint32_t           by_weight_generation; /* <generation> the copies were made at */
+
+  trigram_entries_t map[TRIGRAM_COUNT]; /* this whole structure is ~600KB (1.5MB with digits) */
 };
 typedef struct trigram_map_t trigram_map_t;
 
+/* the alphabet and its NUL must fit in the header */
+typedef char alphabet_fits[(sizeof(TRIGRAM_ALPHABET) <= ALPHABET_SIZE) ? 1 : -1];
+
 /******************************************************************************/
 
 #ifdef PLATFORM_LINUX
@@ -122,10 +155,20 @@ static int compare_entries(const void* left_p, const void* right_p)
 {
   trigram_entry_t* left  = (trigram_entry_t*)left_p;
   trigram_entry_t* right = (trigram_entry_t*)right_p;
-  return (int)left->reference - (int)right->reference;
+  return (left->reference > right->reference) - (left->reference < right->reference);
+}
+
+/* compares entries on weight, then reference (ascending) */
+static int compare_weights(const void* left_p, const void* right_p)
+{
+  trigram_entry_t* left  = (trigram_entry_t*)left_p;
+  trigram_entry_t* right = (trigram_entry_t*)right_p;
+
+  if (left->weight != right->weight) return (left->weight < right->weight) ? -1 : 1;
+  return compare_entries(left_p, right_p);
 }
 
-/* compares matches on #matches (descending) then weight (ascending) */
+/* compares matches on score, then #matches (descending) then weight (ascending) */
 static int compare_matches(const void* left_p, const void* right_p)
 {
   trigram_match_t* left  = (trigram_match_t*)left_p;
@@ -133,20 +176,69 @@ static int compare_matches(const void* left_p, const void* right_p)
   /* int delta = (int)left->matches - (int)right->matches; */
   int delta = (int)right->matches - (int)left->matches;
 
+  if (left->score != right->score) return (left->score > right->score) ? -1 : 1;
+
   return (delta != 0) ? delta : ((int)left->weight - (int)right->weight);
 
 }
 
+/* compares re-ranked matches on distance (ascending), then as above */
+static int compare_distances(const void* left_p, const void* right_p)
+{
+  trigram_match_t* left  = (trigram_match_t*)left_p;
+  trigram_match_t* right = (trigram_match_t*)right_p;
+
+  if (left->distance != right->distance) return (left->distance < right->distance) ? -1 : 1;
+  return compare_matches(left_p, right_p);
+}
+
 /******************************************************************************/
 
-static void sort_map_if_dirty(trigram_entries_t* map)
+/* sorts the unsorted tail of <map>, then merges it into the sorted body; */
+/* returns whether there was one */
+static int sort_map_if_dirty(trigram_entries_t* map)
 { 
-  int res = -1;
-  if (! map->dirty) return;
-
-  res = MERGESORT(map->entries, map->used, sizeof(trigram_entry_t), &compare_entries);
+  int              res     = -1;
+  uint32_t         sorted  = map->sorted;
+  uint32_t         tail    = map->used - sorted;
+  trigram_entry_t* entries = map->entries;
+  trigram_entry_t* copy    = NULL;
+  int64_t          i       = 0;
+  int64_t          j       = 0;
+  int64_t          w       = 0;
+
+  if (tail == 0) return 0;
+
+  res = MERGESORT(entries + sorted, tail, sizeof(trigram_entry_t), &compare_entries);
   assert(res >= 0);
-  map->dirty = 0;
+
+  /* tail falls entirely after the body */
+  if (sorted == 0 || entries[sorted-1].reference <= entries[sorted].reference) goto done;
+
+  copy = SMALLOC(tail, trigram_entry_t);
+  if (copy == NULL) {
+    res = MERGESORT(entries, map->used, sizeof(trigram_entry_t), &compare_entries);
+    assert(res >= 0);
+    goto done;
+  }
+  memcpy(copy, entries + sorted, tail * sizeof(trigram_entry_t));
+
+  /* merge from the back, so the body can be shifted in place */
+  i = (int64_t)sorted - 1;
+  j = (int64_t)tail - 1;
+  w = (int64_t)map->used - 1;
+  while (j >= 0) {
+    if (i >= 0 && entries[i].reference > copy[j].reference) {
+      entries[w--] = entries[i--];
+    } else {
+      entries[w--] = copy[j--];
+    }
+  }
+  free(copy);
+
+done:
+  map->sorted = map->used;
+  return 1;
 }
 
 /******************************************************************************/
@@ -164,6 +256,11 @@ static size_t get_map_size(trigram_map haystack, int index)
   return haystack->map[index].buckets * sizeof(trigram_entry_t);
 }
 
+static size_t get_list_size(const trigram_entries_t* map)
+{
+  return map->buckets * sizeof(trigram_entry_t);
+}
+
 /******************************************************************************/
 
 static void free_if(void* ptr)
@@ -175,10 +272,86 @@ static void free_if(void* ptr)
 
 /******************************************************************************/
 
+static void drop_cache(trigram_map haystack)
+{
+  blurrily_cache_t* cache = haystack->cache;
+
+  if (cache == NULL) return;
+  blurrily_cache_free(&cache);
+  haystack->cache = NULL;
+}
+
+static void drop_metrics(trigram_map haystack)
+{
+  blurrily_metrics_t* metrics = haystack->metrics;
+
+  if (metrics == NULL) return;
+  blurrily_metrics_free(&metrics);
+  haystack->metrics = NULL;
+}
+
+/* frees a table of TRIGRAM_COUNT <lists>, except what is on disk */
+static void free_lists(trigram_entries_t* lists, off_t offset)
+{
+  if (lists == NULL) return;
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    if (lists[k].entries_offset == 0) free(lists[k].entries);
+  }
+  if (offset == 0) free(lists);
+}
+
+static void drop_prefixes(trigram_map haystack)
+{
+  free_lists(haystack->prefixes, haystack->prefixes_offset);
+  haystack->prefixes        = NULL;
+  haystack->prefixes_offset = 0;
+  haystack->prefixes_complete = 0;
+}
+
+static void drop_by_weight(trigram_map haystack)
+{
+  free_lists(haystack->by_weight, haystack->by_weight_offset);
+  haystack->by_weight        = NULL;
+  haystack->by_weight_offset = 0;
+}
+
+/******************************************************************************/
+
+/* copies each posting list to <by_weight> and sorts the copy by weight, */
+/* unless the map is unchanged since; returns negative on failure */
+static int order_by_weight(trigram_map haystack)
+{
+  if (haystack->by_weight == NULL || haystack->by_weight_generation == haystack->generation) return 0;
+
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map  = haystack->map + k;
+    trigram_entries_t* copy = haystack->by_weight + k;
+
+    if (copy->entries_offset || copy->buckets < map->used) {
+      trigram_entry_t* entries = SMALLOC(map->used, trigram_entry_t);
+
+      if (entries == NULL) return -1;
+      if (copy->entries_offset == 0) free_if(copy->entries);
+      copy->entries        = entries;
+      copy->entries_offset = 0;
+      copy->buckets        = map->used;
+    }
+    if (map->used > 0) memcpy(copy->entries, map->entries, map->used * sizeof(trigram_entry_t));
+    copy->used   = map->used;
+    copy->sorted = 0;  /* never in reference order */
+    qsort(copy->entries, copy->used, sizeof(trigram_entry_t), &compare_weights);
+  }
+  haystack->by_weight_generation = haystack->generation;
+  return 0;
+}
+
+/******************************************************************************/
+
 int blurrily_storage_new(trigram_map* haystack_ptr)
 {
   trigram_map         haystack = (trigram_map)NULL;
   trigram_entries_t*  ptr      = NULL;
+  blurrily_metrics_t* metrics  = NULL;
   int                 k        = 0;
 
   LOG("blurrily_storage_new\n");
@@ -186,34 +359,120 @@ int blurrily_storage_new(trigram_map* haystack_ptr)
   if (haystack == NULL) return -1;
 
   memcpy(haystack->magic, "trigra", 6);
-  haystack->big_endian   = get_big_endian();
-  haystack->pointer_size = get_pointer_size();
+  haystack->big_endian     = get_big_endian();
+  haystack->pointer_size   = get_pointer_size();
+  haystack->format_version = FORMAT_VERSION;
+  memset(haystack->alphabet, 0, ALPHABET_SIZE);
+  memcpy(haystack->alphabet, TRIGRAM_ALPHABET, sizeof(TRIGRAM_ALPHABET));
 
   haystack->mapped_size      = 0; /* not mapped, as we just created it in memory */
   haystack->total_references = 0;
   haystack->total_trigrams   = 0;
   haystack->refs             = NULL;
+  haystack->generation       = 0;
+  haystack->cache            = NULL;
+  haystack->metrics          = NULL;
+  blurrily_needles_init(&haystack->needles);
+  blurrily_counts_init(&haystack->counts);
+  haystack->prefixes         = NULL;
+  haystack->prefixes_offset  = 0;
+  haystack->prefixes_complete = 0;
+  haystack->by_weight        = NULL;
+  haystack->by_weight_offset = 0;
+  haystack->by_weight_generation = 0;
   for(k = 0, ptr = haystack->map ; k < TRIGRAM_COUNT ; ++k, ++ptr) {
     ptr->buckets = 0;
     ptr->used    = 0;
-    ptr->dirty   = 0;
+    ptr->sorted  = 0;
     ptr->entries = (trigram_entry_t*)NULL;
     ptr->entries_offset = 0;
   }
 
+  if (blurrily_metrics_new(&metrics) < 0) {
+    free(haystack);
+    return -1;
+  }
+  haystack->metrics = metrics;
+
   *haystack_ptr = haystack;
   return 0;
 }
 
 /******************************************************************************/
 
-int blurrily_storage_load(trigram_map* haystack, const char* path)
+#ifndef MAP_POPULATE
+/* reads one byte per page, so that all are faulted in */
+static void touch_pages(const uint8_t* start, size_t length)
+{
+  size_t            page_size = (size_t) sysconf(_SC_PAGESIZE);
+  volatile uint8_t  sink      = 0;
+
+  for (size_t offset = 0; offset < length; offset += page_size) {
+    sink ^= start[offset];
+  }
+  (void) sink;
+}
+#endif
+
+/******************************************************************************/
+
+/* applies <mode> to a freshly mapped file of <length> bytes */
+static int page_in(uint8_t* origin, size_t length, blurrily_load_mode_t mode)
+{
+  switch (mode) {
+    case BLURRILY_LOAD_POPULATE:
+#ifndef MAP_POPULATE
+      touch_pages(origin, length);
+#endif
+      return 0;
+    case BLURRILY_LOAD_WILLNEED:
+      (void) madvise(origin, length, MADV_WILLNEED);
+      return 0;
+    case BLURRILY_LOAD_RANDOM:
+      (void) madvise(origin, length, MADV_RANDOM);
+      return 0;
+    case BLURRILY_LOAD_LOCK:
+      return mlock(origin, length);
+    case BLURRILY_LOAD_HUGEPAGES:
+#ifdef MADV_HUGEPAGE
+      {
+        /* posting lists start on the page after the header */
+        size_t postings = round_to_page(sizeof(trigram_map_t));
+        if (length > postings) (void) madvise(origin + postings, length - postings, MADV_HUGEPAGE);
+      }
+#endif
+      return 0;
+    default:
+      return 0;
+  }
+}
+
+/******************************************************************************/
+
+/* the table of lists at <offset> of a file mapped at <origin>, */
+/* with entries pointing into the file */
+static trigram_entries_t* map_lists(uint8_t* origin, off_t offset)
+{
+  trigram_entries_t* lists = offset ? (trigram_entries_t*) (origin + offset) : NULL;
+
+  for (int k = 0; lists && k < TRIGRAM_COUNT; ++k) {
+    lists[k].entries = lists[k].entries_offset ? (trigram_entry_t*) (origin + lists[k].entries_offset) : NULL;
+  }
+  return lists;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_load(trigram_map* haystack, const char* path, blurrily_load_mode_t mode)
 {
-  int         fd          = -1;
-  int         res         = -1;
-  trigram_map header      = NULL;
-  uint8_t*    origin      = NULL;
-  struct stat metadata;
+  int                 fd          = -1;
+  int                 res         = -1;
+  trigram_map         header      = NULL;
+  uint8_t*            origin      = NULL;
+  blurrily_metrics_t* metrics     = NULL;
+  uint64_t            started_at  = blurrily_metrics_now();
+  int                 flags       = MAP_PRIVATE;
+  struct stat         metadata;
 
   /* open and map file */
   res = fd = open(path, O_RDONLY);
@@ -223,13 +482,17 @@ int blurrily_storage_load(trigram_map* haystack, const char* path)
   if (res < 0) goto cleanup;
 
   /* check this file is at least lng enough to have a header */
+  /* (maps coded with a smaller alphabet have a smaller one) */
   if (metadata.st_size < (off_t) sizeof(trigram_map_t)) {
     errno = EPROTO;
     res = -1;
     goto cleanup;
   }
 
-  header = (trigram_map) mmap(NULL, metadata.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+#ifdef MAP_POPULATE
+  if (mode == BLURRILY_LOAD_POPULATE || mode == BLURRILY_LOAD_LOCK) flags |= MAP_POPULATE;
+#endif
+  header = (trigram_map) mmap(NULL, metadata.st_size, PROT_READ|PROT_WRITE, flags, fd, 0);
   if (header == MAP_FAILED) {
     res = -1;
     header = NULL;
@@ -243,21 +506,44 @@ int blurrily_storage_load(trigram_map* haystack, const char* path)
 
   /* check magic */
   res = memcmp(header->magic, "trigra", 6);
-  if (res != 0 || header->big_endian != get_big_endian() || header->pointer_size != get_pointer_size()) {
+  if (res != 0 || header->big_endian != get_big_endian() || header->pointer_size != get_pointer_size() || header->format_version != FORMAT_VERSION) {
+    errno = EPROTO;
+    res = -1;
+    goto cleanup;
+  }
+
+  /* check trigrams were coded with the same alphabet */
+  if (strncmp(header->alphabet, TRIGRAM_ALPHABET, ALPHABET_SIZE) != 0) {
     errno = EPROTO;
     res = -1;
     goto cleanup;
   }
 
+  res = page_in((uint8_t*)header, metadata.st_size, mode);
+  if (res < 0) goto cleanup;
+
   /* fix header data */
   header->mapped_size = metadata.st_size;
+  header->refs        = NULL;
+  header->generation  = 0;
+  header->cache       = NULL;
+  res = blurrily_metrics_new(&metrics);
+  if (res < 0) goto cleanup;
+  header->metrics     = metrics;
+
   origin = (uint8_t*)header;
   for (int k = 0; k < TRIGRAM_COUNT; ++k) {
     trigram_entries_t* map = header->map + k;
     if (map->entries_offset == 0) continue;
     map->entries = (trigram_entry_t*) (origin + map->entries_offset);
   }
+  header->needles.slots = header->needles.slots_offset ? (needle_slot_t*) (origin + header->needles.slots_offset) : NULL;
+  header->needles.arena = header->needles.arena_offset ? (origin + header->needles.arena_offset) : NULL;
+  header->counts.slots  = header->counts.slots_offset ? (count_slot_t*) (origin + header->counts.slots_offset) : NULL;
+  header->prefixes      = map_lists(origin, header->prefixes_offset);
+  header->by_weight     = map_lists(origin, header->by_weight_offset);
   *haystack = header;
+  (void) blurrily_metrics_record(header->metrics, BLURRILY_PHASE_LOAD, started_at);
 
 cleanup:
   if (fd > 0) (void) close(fd);
@@ -281,6 +567,12 @@ int blurrily_storage_close(trigram_map* haystack_ptr)
   }
 
   if (haystack->refs) blurrily_refs_free(&haystack->refs);
+  blurrily_needles_free(&haystack->needles);
+  blurrily_counts_free(&haystack->counts);
+  drop_prefixes(haystack);
+  drop_by_weight(haystack);
+  drop_cache(haystack);
+  drop_metrics(haystack);
 
   if (haystack->mapped_size) {
     res = munmap(haystack, haystack->mapped_size);
@@ -296,84 +588,359 @@ cleanup:
 
 /******************************************************************************/
 
+/* a run of bytes to write at <offset> of a saved file */
+typedef struct save_block_t {
+  const void* data;
+  size_t      size;
+  off_t       offset;
+} save_block_t;
+
+/* the runs of blocks one thread writes */
+typedef struct save_job_t {
+  int                 fd;
+  const save_block_t* blocks;
+  size_t              nb_blocks;
+  int                 res;
+  int                 error;   /* errno of a failed write */
+} save_job_t;
+
+/* reserves <reserved> bytes (rounded to a page) at <*offset> for <size> */
+/* bytes of <data>, the rest being left as a hole; returns the offset of */
+/* the reservation, 0 if empty */
+static off_t add_block(save_block_t* blocks, size_t* nb_blocks, const void* data, size_t size, size_t reserved, size_t* offset)
+{
+  off_t at = (off_t) *offset;
+
+  if (reserved == 0) return 0;
+  if (size > 0) {
+    blocks[*nb_blocks].data   = data;
+    blocks[*nb_blocks].size   = size;
+    blocks[*nb_blocks].offset = at;
+    *nb_blocks += 1;
+  }
+  *offset += round_to_page(reserved);
+  return at;
+}
+
+/* lays out a table of <lists>, copied to <copy> with offsets instead of */
+/* pointers, then their entries; returns the offset of the table, 0 if none */
+static off_t add_lists(save_block_t* blocks, size_t* nb_blocks, const trigram_entries_t* lists, trigram_entries_t* copy, size_t* offset)
+{
+  size_t table_size = TRIGRAM_COUNT * sizeof(trigram_entries_t);
+  off_t  at         = 0;
+
+  if (lists == NULL) return 0;
+  memcpy(copy, lists, table_size);
+  at = add_block(blocks, nb_blocks, copy, table_size, table_size, offset);
+
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    copy[k].entries        = NULL;
+    copy[k].entries_offset = add_block(blocks, nb_blocks, lists[k].entries, lists[k].used * sizeof(trigram_entry_t), get_list_size(lists + k), offset);
+  }
+  return at;
+}
+
+/******************************************************************************/
+
+/* writes all of <iov>, resuming after short writes; returns negative on failure */
+static int write_vector(int fd, struct iovec* iov, int nb_iov, off_t offset)
+{
+  while (nb_iov > 0) {
+    ssize_t written = pwritev(fd, iov, nb_iov, offset);
+
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return -1;
+    offset += written;
+    for (; nb_iov > 0 && (size_t) written >= iov->iov_len; ++iov, --nb_iov) written -= iov->iov_len;
+    if (nb_iov > 0) {
+      iov->iov_base = (uint8_t*) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+/* writes a save job, one system call per run of adjacent blocks */
+static void* run_save_job(void* job_p)
+{
+  save_job_t*  job = (save_job_t*) job_p;
+  struct iovec iov[SAVE_IOVECS];
+  size_t       k   = 0;
+
+  job->res = 0;
+  while (k < job->nb_blocks && job->res == 0) {
+    off_t start  = job->blocks[k].offset;
+    off_t end    = start;
+    int   nb_iov = 0;
+
+    for (; k < job->nb_blocks && nb_iov < SAVE_IOVECS && job->blocks[k].offset == end; ++k, ++nb_iov) {
+      iov[nb_iov].iov_base = (void*) job->blocks[k].data;
+      iov[nb_iov].iov_len  = job->blocks[k].size;
+      end += job->blocks[k].size;
+    }
+    job->res = write_vector(job->fd, iov, nb_iov, start);
+  }
+  if (job->res < 0) job->error = errno;
+  return NULL;
+}
+
+/* writes <blocks> to <fd>, split by size across threads when large */
+static int write_blocks(int fd, const save_block_t* blocks, size_t nb_blocks)
+{
+  save_job_t jobs[SAVE_MAX_THREADS];
+  pthread_t  threads[SAVE_MAX_THREADS];
+  uint8_t    started[SAVE_MAX_THREADS];
+  long       nb_cpus    = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t     data_bytes = 0;
+  size_t     bytes      = 0;
+  size_t     first      = 0;
+  int        nb_jobs    = 0;
+
+  for (size_t k = 0; k < nb_blocks; ++k) data_bytes += blocks[k].size;
+  nb_jobs = (int) (data_bytes / SAVE_THREAD_MIN_BYTES);
+  if (nb_jobs > SAVE_MAX_THREADS) nb_jobs = SAVE_MAX_THREADS;
+  if (nb_cpus > 0 && nb_jobs > nb_cpus) nb_jobs = (int) nb_cpus;
+  if (nb_jobs < 1) nb_jobs = 1;
+
+  /* runs of blocks of about the same number of bytes */
+  for (int j = 0; j < nb_jobs; ++j) {
+    size_t last = first;
+    size_t goal = data_bytes / nb_jobs * (j+1);
+
+    while (last < nb_blocks && (j == nb_jobs-1 || bytes < goal)) bytes += blocks[last++].size;
+    jobs[j].fd        = fd;
+    jobs[j].blocks    = blocks + first;
+    jobs[j].nb_blocks = last - first;
+    jobs[j].res       = 0;
+    jobs[j].error     = 0;
+    first = last;
+  }
+
+  /* the calling thread writes the first run, and any a thread could not */
+  /* be started for */
+  for (int j = 1; j < nb_jobs; ++j) {
+    started[j] = pthread_create(threads + j, NULL, run_save_job, jobs + j) == 0;
+  }
+  (void) run_save_job(jobs);
+  for (int j = 1; j < nb_jobs; ++j) {
+    if (started[j]) (void) pthread_join(threads[j], NULL);
+    else (void) run_save_job(jobs + j);
+  }
+
+  for (int j = 0; j < nb_jobs; ++j) {
+    if (jobs[j].res < 0) {
+      errno = jobs[j].error;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* makes the rename of a file at <path> durable (best effort, as not all */
+/* file systems can sync directories) */
+static void sync_directory(const char* path)
+{
+  char  directory[PATH_MAX];
+  char* slash = NULL;
+  int   fd    = -1;
+
+  snprintf(directory, PATH_MAX, "%s", path);
+  slash = strrchr(directory, '/');
+  if (slash == NULL) {
+    snprintf(directory, PATH_MAX, ".");
+  } else {
+    slash[slash == directory ? 1 : 0] = 0;
+  }
+
+  fd = open(directory, O_RDONLY);
+  if (fd < 0) return;
+  (void) fsync(fd);
+  (void) close(fd);
+}
+
+/******************************************************************************/
+
 int blurrily_storage_save(trigram_map haystack, const char* path)
 {
-  int         fd          = -1;
-  int         res         = 0;
-  uint8_t*    ptr         = (uint8_t*)NULL;
-  size_t      total_size  = 0;
-  size_t      offset      = 0;
-  trigram_map header      = NULL;
-  char        path_tmp[PATH_MAX];
+  int                fd          = -1;
+  int                res         = 0;
+  int                created     = 0;
+  size_t             total_size  = 0;
+  trigram_map        header      = NULL;
+  trigram_entries_t* prefixes    = NULL;
+  trigram_entries_t* by_weight   = NULL;
+  save_block_t*      blocks      = NULL;
+  size_t             nb_blocks   = 0;
+  uint64_t           started_at  = blurrily_metrics_now();
+  size_t             slots_size  = haystack->needles.nb_slots * sizeof(needle_slot_t);
+  size_t             arena_size  = haystack->needles.arena_used;
+  size_t             counts_size = blurrily_counts_memsize(&haystack->counts);
+  char               path_tmp[PATH_MAX];
 
   /* cleanup maps in memory */
   for (int k = 0; k < TRIGRAM_COUNT; ++k) {
     sort_map_if_dirty(haystack->map + k);
+    if (haystack->prefixes) sort_map_if_dirty(haystack->prefixes + k);
   }
+  res = order_by_weight(haystack);
+  if (res < 0) goto cleanup;
 
   /* path for temporary file */
   snprintf(path_tmp, PATH_MAX, "%s.tmp.%ld", path, random());
 
-  /* compute storage space required */
-  total_size += round_to_page(sizeof(trigram_map_t));
+  /* lay the file out, building the header (and tables of optional lists) */
+  /* with offsets instead of pointers */
+  header    = SMALLOC(1, trigram_map_t);
+  blocks    = SMALLOC(4 + 3 * (TRIGRAM_COUNT + 1), save_block_t);
+  prefixes  = haystack->prefixes  ? SMALLOC(TRIGRAM_COUNT, trigram_entries_t) : NULL;
+  by_weight = haystack->by_weight ? SMALLOC(TRIGRAM_COUNT, trigram_entries_t) : NULL;
+  if (!header || !blocks || (haystack->prefixes && !prefixes) || (haystack->by_weight && !by_weight)) {
+    res = -1;
+    goto cleanup;
+  }
+
+  memcpy(header, (void*)haystack, sizeof(trigram_map_t));
+  header->mapped_size = 0;
+  header->refs        = NULL;
+  header->generation  = 0;
+  header->cache       = NULL;
+  header->metrics     = NULL;
+  (void) add_block(blocks, &nb_blocks, header, sizeof(trigram_map_t), sizeof(trigram_map_t), &total_size);
 
+  /* each list keeps room for its unused buckets */
   for (int k = 0; k < TRIGRAM_COUNT; ++k) {
-    total_size += round_to_page(get_map_size(haystack, k));
+    trigram_entries_t* map = haystack->map + k;
+
+    header->map[k].entries        = NULL;
+    header->map[k].entries_offset = add_block(blocks, &nb_blocks, map->entries, map->used * sizeof(trigram_entry_t), get_map_size(haystack, k), &total_size);
   }
 
-  /* open and map file */
-  fd = open(path_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
-  if (fd < 0) goto cleanup;
+  /* kept needles and trigram counts */
+  header->needles.slots        = NULL;
+  header->needles.slots_offset = add_block(blocks, &nb_blocks, haystack->needles.slots, slots_size, slots_size, &total_size);
+  header->needles.arena        = NULL;
+  header->needles.arena_offset = add_block(blocks, &nb_blocks, haystack->needles.arena, arena_size, arena_size, &total_size);
+  header->needles.arena_size   = arena_size;
+  header->counts.slots         = NULL;
+  header->counts.slots_offset  = add_block(blocks, &nb_blocks, haystack->counts.slots, counts_size, counts_size, &total_size);
+
+  /* the prefix index and weight-ordered lists */
+  header->prefixes             = NULL;
+  header->prefixes_offset      = add_lists(blocks, &nb_blocks, haystack->prefixes, prefixes, &total_size);
+  header->by_weight            = NULL;
+  header->by_weight_offset     = add_lists(blocks, &nb_blocks, haystack->by_weight, by_weight, &total_size);
+  header->by_weight_generation = 0;  /* as loading resets <generation> */
+
+  /* write the data only: padding and unused buckets stay holes */
+  fd = open(path_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) { res = -1 ; goto cleanup ; }
+  created = 1;
 
   res = ftruncate(fd, total_size);
   if (res < 0) goto cleanup;
 
-  ptr = mmap(NULL, total_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-  if (ptr == MAP_FAILED) { res = -1 ; goto cleanup ; }
+  res = write_blocks(fd, blocks, nb_blocks);
+  if (res < 0) goto cleanup;
+
+  /* the file must be on disk before it replaces the previous one */
+  res = fsync(fd);
+  if (res < 0) goto cleanup;
 
-  (void) close(fd);
+  res = close(fd);
   fd = -1;
+  if (res < 0) goto cleanup;
 
-  /* flush data */
-  memset(ptr, 0xFF, total_size);
-
-  /* copy header & clean copy */
-  memcpy(ptr, (void*)haystack, sizeof(trigram_map_t));
-  offset += round_to_page(sizeof(trigram_map_t));
-  header = (trigram_map)ptr;
+  /* commit by renaming the file */
+  res = rename(path_tmp, path);
+  if (res < 0) goto cleanup;
+  created = 0;
+  sync_directory(path);
 
-  header->mapped_size = 0;
-  header->refs        = NULL;
+cleanup:
+  if (fd >= 0) (void) close(fd);
+  if (created) (void) unlink(path_tmp);
+  free_if(header);
+  free_if(blocks);
+  free_if(prefixes);
+  free_if(by_weight);
+
+  (void) blurrily_metrics_record(haystack->metrics, BLURRILY_PHASE_SAVE, started_at);
+  return res;
+}
 
-  /* copy each map, set offset in header */
-  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
-    size_t block_size = get_map_size(haystack, k);
+/******************************************************************************/
 
-    if (block_size > 0) {
-      memcpy(ptr+offset, haystack->map[k].entries, block_size);
+/* makes room for <nb_entries> more entries in <map> (exponential growth) */
+static int reserve_entries(trigram_entries_t* map, uint32_t nb_entries)
+{
+  uint32_t         new_buckets = 0;
+  trigram_entry_t* new_entries = NULL;
 
-      header->map[k].entries        = NULL;
-      header->map[k].entries_offset = offset;
+  assert(map->used <= map->buckets);
+  if (map->used + nb_entries <= map->buckets) return 0;
 
-      offset += round_to_page(block_size);
-    } else {
-      header->map[k].entries        = NULL;
-      header->map[k].entries_offset = 0;
-    }
+  if (map->buckets == 0) {
+    LOG("- alloc\n");
+    new_buckets = TRIGRAM_ENTRIES_START_SIZE;
+  } else {
+    LOG("- realloc\n");
+    new_buckets = map->buckets * 4/3;
   }
-  assert(offset == total_size);
 
-cleanup:
-  if (ptr != NULL && total_size > 0) {
-    res = munmap(ptr, total_size);
+  /* lists shrunk to fit may be too short to grow by a third */
+  if (new_buckets < TRIGRAM_ENTRIES_START_SIZE) new_buckets = TRIGRAM_ENTRIES_START_SIZE;
+  if (new_buckets < map->used + nb_entries)     new_buckets = map->used + nb_entries;
+
+  /* copy old data, free old pointer */
+  new_entries = SMALLOC(new_buckets, trigram_entry_t);
+  if (new_entries == NULL) return -1;
+  if (map->used > 0) memcpy(new_entries, map->entries, map->used * sizeof(trigram_entry_t));
+
+  if (map->entries_offset) {
+    /* old data was on disk, just mark it as no longer on disk */
+    map->entries_offset = 0;
+  } else {
+    #ifndef NDEBUG
+      /* scribble old data */
+      if (map->entries) memset(map->entries, 0xFF, map->buckets * sizeof(trigram_entry_t));
+    #endif
+    free_if(map->entries);
   }
 
-  /* commit by renaming the file */
-  if (res >= 0 && path) {
-    res = rename(path_tmp, path);
+  /* swap fields */
+  map->buckets = new_buckets;
+  map->entries = new_entries;
+  return 0;
+}
+
+/* appends <entry> to <map>, which must have room for it */
+static void append_entry(trigram_entries_t* map, trigram_entry_t entry)
+{
+  assert(map->used < map->buckets);
+
+  /* increasing references extend the sorted body */
+  if (map->sorted == map->used && (map->used == 0 || map->entries[map->used-1].reference < entry.reference)) {
+    map->sorted += 1;
   }
+  map->entries[map->used] = entry;
+  map->used += 1;
+}
 
-  return res;
+/******************************************************************************/
+
+/* adds <entry> to the prefix lists of the start trigrams of <needle>, */
+/* using <trigrams> (as long as <needle>, plus one) as scratch space */
+static int put_prefixes(trigram_map haystack, const char* needle, trigram_entry_t entry, trigram_t* trigrams)
+{
+  int nb_trigrams = blurrily_tokeniser_parse_range(needle, trigrams, 0, PREFIX_DEPTH, 1);
+
+  for (int k = 0; k < nb_trigrams; ++k) {
+    trigram_entries_t* map = haystack->prefixes + trigrams[k];
+
+    if (reserve_entries(map, 1) < 0) return -1;
+    append_entry(map, entry);
+  }
+  return nb_trigrams;
 }
 
 /******************************************************************************/
@@ -400,6 +967,7 @@ int blurrily_storage_put(trigram_map haystack, const char* needle, uint32_t refe
   int        nb_trigrams  = -1;
   size_t     length       = strlen(needle);
   trigram_t* trigrams     = (trigram_t*)NULL;
+  uint64_t   started_at   = blurrily_metrics_now();
 
   if (!haystack->refs) {
     blurrily_refs_new(&haystack->refs);
@@ -420,139 +988,562 @@ int blurrily_storage_put(trigram_map haystack, const char* needle, uint32_t refe
     assert(t < TRIGRAM_COUNT);
     assert(map-> used <= map-> buckets);
 
-    /* allocate more space as needed (exponential growth) */
-    if (map->buckets == 0) {
-      LOG("- alloc for %d\n", t);
-
-      map->buckets = TRIGRAM_ENTRIES_START_SIZE;
-      map->entries = SMALLOC(map->buckets, trigram_entry_t);
-    }
-    else if (map->used == map->buckets) {
-      uint32_t         new_buckets = map->buckets * 4/3;
-      trigram_entry_t* new_entries = NULL;
-      LOG("- realloc for %d\n", t);
-
-      /* copy old data, free old pointer, zero extra space */
-      new_entries = SMALLOC(new_buckets, trigram_entry_t);
-      assert(new_entries != NULL);
-      memcpy(new_entries, map->entries, map->buckets * sizeof(trigram_entry_t));
-      /* scribble the rest of the map*/      
-      // memset(new_entries + map->buckets, 0xFF, (new_buckets - map->buckets) * sizeof(trigram_entry_t));
-
-      #ifndef NDEBUG
-        /* scribble old data */
-        memset(map->entries, 0xFF, map->buckets * sizeof(trigram_entry_t));
-      #endif
-
-      if (map->entries_offset) {
-        /* old data was on disk, just mark it as no longer on disk */
-        map->entries_offset = 0;
-      } else {
-        /* free old data */
-        free(map->entries);
-      }
-
-      /* swap fields */
-      map->buckets = new_buckets;
-      map->entries = new_entries;
+    if (reserve_entries(map, 1) < 0) {
+      nb_trigrams = -1;
+      goto cleanup;
     }
 
-    /* insert new entry */
-    assert(map->used < map->buckets);
-    map->entries[map->used] = entry;
-    map->used += 1;
-    map->dirty = 1;
+    append_entry(map, entry);
+  }
+  if (haystack->needles.enabled && blurrily_needles_put(&haystack->needles, reference, needle, length) < 0) {
+    nb_trigrams = -1;
+    goto cleanup;
+  }
+  if (blurrily_counts_put(&haystack->counts, reference, nb_trigrams) < 0) {
+    nb_trigrams = -1;
+    goto cleanup;
+  }
+  if (haystack->prefixes && put_prefixes(haystack, needle, (trigram_entry_t){ reference, weight }, trigrams) < 0) {
+    nb_trigrams = -1;
+    goto cleanup;
   }
   haystack->total_trigrams   += nb_trigrams;
   haystack->total_references += 1;
+  haystack->generation       += 1;
 
   blurrily_refs_add(haystack->refs, reference);
 
+cleanup:
   free((void*)trigrams);
+  (void) blurrily_metrics_record(haystack->metrics, BLURRILY_PHASE_PUT, started_at);
   return nb_trigrams;
 }
 
 /******************************************************************************/
 
-int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t limit, trigram_match results)
+/* an entry of a batch of puts, bound for the list of <trigram> */
+typedef struct batch_entry_t {
+  trigram_t       trigram;
+  trigram_entry_t entry;
+} batch_entry_t;
+
+/******************************************************************************/
+
+int blurrily_storage_put_batch(trigram_map haystack, const trigram_put_t* puts, int nb_puts)
 {
-  int              nb_trigrams = -1;
-  size_t           length      = strlen(needle);
-  trigram_t*       trigrams    = (trigram_t*)NULL;
-  int              nb_entries  = -1;
-  trigram_entry_t* entries     = NULL;
-  trigram_entry_t* entry_ptr   = NULL;
-  int              nb_matches  = -1;
-  trigram_match_t* matches     = NULL;
-  trigram_match_t* match_ptr   = NULL;
-  uint32_t         last_ref    = (uint32_t)-1;
-  int              nb_results  = 0;
+  batch_entry_t*   pending     = NULL;
+  size_t           nb_pending  = 0;
+  size_t           max_pending = 0;
+  trigram_entry_t* grouped     = NULL;
+  uint32_t*        ends        = NULL;  /* by trigram, then end of its entries in <grouped> */
+  uint32_t         offset      = 0;
+  trigram_t*       trigrams    = NULL;
+  size_t           max_length  = 0;
+  int              res         = -1;
+  uint64_t         started_at  = blurrily_metrics_now();
+
+  if (nb_puts == 0) return 0;
+  if (!haystack->refs) {
+    blurrily_refs_t* refs = NULL;
 
-  trigrams = SMALLOC(length+1, trigram_t);
-  nb_trigrams = blurrily_tokeniser_parse_string(needle, trigrams);
-  if (nb_trigrams == 0) goto cleanup;
+    if (blurrily_refs_new(&refs) < 0) return -1;
+    haystack->refs = refs;
+    add_all_refs(haystack);
+  }
 
-  LOG("%d trigrams in '%s'\n", nb_trigrams, needle);
+  for (int k = 0; k < nb_puts; ++k) {
+    size_t length = strlen(puts[k].needle);
 
-  /* measure size required for sorting */
-  nb_entries = 0;
-  for (int k = 0; k < nb_trigrams; ++k) {
-    trigram_t t = trigrams[k];
-    nb_entries += haystack->map[t].used;
+    max_pending += length + 1;
+    if (length > max_length) max_length = length;
   }
-  if (nb_entries == 0) goto cleanup;
+  pending  = SMALLOC(max_pending, batch_entry_t);
+  trigrams = SMALLOC(max_length + 1, trigram_t);
+  if (pending == NULL || trigrams == NULL) goto cleanup;
+
+  /* tokenise everything, skipping known references as <put> does */
+  for (int k = 0; k < nb_puts; ++k) {
+    const trigram_put_t* put         = puts + k;
+    size_t               length      = strlen(put->needle);
+    uint32_t             weight      = put->weight > 0 ? put->weight : (uint32_t) length;
+    int                  nb_trigrams = 0;
+
+    if (blurrily_refs_test(haystack->refs, put->reference)) continue;
+
+    nb_trigrams = blurrily_tokeniser_parse_string(put->needle, trigrams);
+    for (int j = 0; j < nb_trigrams; ++j) {
+      batch_entry_t* item = pending + nb_pending++;
+
+      assert(trigrams[j] < TRIGRAM_COUNT);
+      item->trigram         = trigrams[j];
+      item->entry.reference = put->reference;
+      item->entry.weight    = weight;
+    }
+    if (haystack->needles.enabled && blurrily_needles_put(&haystack->needles, put->reference, put->needle, length) < 0) goto cleanup;
+    if (blurrily_counts_put(&haystack->counts, put->reference, nb_trigrams) < 0) goto cleanup;
+    if (haystack->prefixes && put_prefixes(haystack, put->needle, (trigram_entry_t){ put->reference, weight }, trigrams) < 0) goto cleanup;
 
-  /* allocate sorting memory */
-  entries = SMALLOC(nb_entries, trigram_entry_t);
-  assert(entries != NULL);
-  LOG("allocated space for %zd trigrams entries\n", nb_entries);
+    haystack->total_trigrams   += nb_trigrams;
+    haystack->total_references += 1;
+    blurrily_refs_add(haystack->refs, put->reference);
+  }
 
-  /* copy data for sorting */
-  entry_ptr = entries;
-  for (int k = 0; k < nb_trigrams; ++k) {
-    trigram_t t       = trigrams[k];
-    size_t    buckets = haystack->map[t].used;
+  /* group entries by trigram (a stable counting sort) */
+  ends    = (uint32_t*) calloc(TRIGRAM_COUNT, sizeof(uint32_t));
+  grouped = SMALLOC(nb_pending > 0 ? nb_pending : 1, trigram_entry_t);
+  if (ends == NULL || grouped == NULL) goto cleanup;
+  for (size_t k = 0; k < nb_pending; ++k) ends[pending[k].trigram] += 1;
+  for (int t = 0; t < TRIGRAM_COUNT; ++t) {
+    uint32_t count = ends[t];
 
-    sort_map_if_dirty(haystack->map + t);
-    memcpy(entry_ptr, haystack->map[t].entries, buckets * sizeof(trigram_entry_t));
-    entry_ptr += buckets;
+    ends[t] = offset;
+    offset += count;
   }
-  assert(entry_ptr == entries + nb_entries);
+  for (size_t k = 0; k < nb_pending; ++k) grouped[ends[pending[k].trigram]++] = pending[k].entry;
 
-  /* sort data */
-  MERGESORT(entries, nb_entries, sizeof(trigram_entry_t), &compare_entries);
-  LOG("sorting entries\n");
+  /* then grow and append to each list once */
+  for (int t = 0; t < TRIGRAM_COUNT; ++t) {
+    trigram_entries_t* map   = haystack->map + t;
+    uint32_t           start = (t == 0) ? 0 : ends[t-1];
 
-  /* count distinct matches */
-  entry_ptr  = entries;
-  last_ref   = -1;
-  nb_matches = 0;
-  for (int k = 0; k < nb_entries; ++k) {
-    if (entry_ptr->reference != last_ref) {
-      last_ref = entry_ptr->reference;
-      ++nb_matches;
-    }
-    ++entry_ptr;    
+    if (ends[t] == start) continue;
+    if (reserve_entries(map, ends[t] - start) < 0) goto cleanup;
+
+    for (uint32_t k = start; k < ends[t]; ++k) append_entry(map, grouped[k]);
   }
-  assert(entry_ptr == entries + nb_entries);
-  LOG("total %zd distinct matches\n", nb_matches);
 
-  /* allocate maches result */
-  matches = SMALLOC(nb_matches, trigram_match_t);
-  assert(matches != NULL);
+  haystack->generation += 1;
+  res = (int) nb_pending;
 
-  /* reduction, counting matches per reference */
-  entry_ptr = entries;
+cleanup:
+  free_if(pending);
+  free_if(grouped);
+  free_if(ends);
+  free_if(trigrams);
+  (void) blurrily_metrics_record(haystack->metrics, BLURRILY_PHASE_PUT, started_at);
+  return res;
+}
+
+/******************************************************************************/
+
+/* orders the best <candidates> <matches> by edit distance to <needle> */
+static void rerank_matches(trigram_map haystack, const char* needle, size_t length, trigram_match_t* matches, int nb_matches, int candidates, int limit)
+{
+  uint32_t* best    = NULL; /* smallest distances so far, ascending */
+  int       nb_best = 0;
+
+  if (candidates > nb_matches) candidates = nb_matches;
+  if (limit > candidates) limit = candidates;
+  if (limit > 0) best = SMALLOC(limit, uint32_t);
+
+  for (int k = 0; k < candidates; ++k) {
+    const uint8_t* stored        = NULL;
+    uint16_t       stored_length = 0;
+    uint32_t       bound         = BLURRILY_NO_DISTANCE - 1;
+    uint32_t       distance      = 0;
+    int            slot          = 0;
+
+    matches[k].distance = BLURRILY_NO_DISTANCE;
+    if (blurrily_needles_get(&haystack->needles, matches[k].reference, &stored, &stored_length) < 0) continue;
+
+    /* no need for exact distances beyond the <limit> best */
+    if (best && nb_best == limit) bound = best[limit-1];
+    distance = blurrily_edit_distance((const uint8_t*)needle, length, stored, stored_length, bound);
+    matches[k].distance = distance;
+    if (best == NULL || (nb_best == limit && distance >= best[limit-1])) continue;
+
+    /* insert into <best>, dropping the worst if full */
+    slot = (nb_best < limit) ? nb_best++ : limit - 1;
+    for (; slot > 0 && best[slot-1] > distance; --slot) best[slot] = best[slot-1];
+    best[slot] = distance;
+  }
+
+  qsort(matches, candidates, sizeof(trigram_match_t), &compare_distances);
+  free_if(best);
+}
+
+/******************************************************************************/
+
+int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t limit, trigram_match results)
+{
+  return blurrily_storage_find_with(haystack, needle, limit, NULL, results);
+}
+
+/******************************************************************************/
+
+/* whether find <options> drop some entries */
+static int filters_entries(const trigram_find_options_t* options)
+{
+  return options && (options->filter || options->min_weight || options->max_weight);
+}
+
+/* copies the <nb_entries> <entries> passing the filters of <options> to */
+/* <output>, and returns how many */
+static uint32_t copy_filtered(trigram_entry_t* output, const trigram_entry_t* entries, uint32_t nb_entries, const trigram_find_options_t* options)
+{
+  const blurrily_filter_t* filter     = options->filter;
+  uint32_t                 min_weight = options->min_weight;
+  uint32_t                 max_weight = options->max_weight ? options->max_weight : (uint32_t)-1;
+  uint32_t                 kept       = 0;
+
+  for (uint32_t k = 0; k < nb_entries; ++k) {
+    uint32_t weight = entries[k].weight;
+
+    if (weight < min_weight || weight > max_weight) continue;
+    if (filter && !blurrily_filter_test(filter, entries[k].reference)) continue;
+    output[kept++] = entries[k];
+  }
+  return kept;
+}
+
+/******************************************************************************/
+
+/* sets the <score> of <matches> as per <similarity>, for a needle of */
+/* <nb_trigrams> trigrams */
+static void score_matches(trigram_map haystack, int similarity, uint32_t nb_trigrams, trigram_match_t* matches, int nb_matches)
+{
+  for (int k = 0; k < nb_matches; ++k) {
+    trigram_match_t* match  = matches + k;
+    uint64_t         shared = match->matches;
+    uint64_t         count  = blurrily_counts_get(&haystack->counts, match->reference);
+
+    /* references merged from maps without counts share all they have */
+    if (count < shared) count = shared;
+
+    switch (similarity) {
+    case BLURRILY_SIMILARITY_DICE:
+      match->score = (uint32_t) (2 * shared * BLURRILY_SCORE_SCALE / (nb_trigrams + count));
+      break;
+    case BLURRILY_SIMILARITY_JACCARD:
+      match->score = (uint32_t) (shared * BLURRILY_SCORE_SCALE / (nb_trigrams + count - shared));
+      break;
+    case BLURRILY_SIMILARITY_COSINE:
+      match->score = (uint32_t) (shared * BLURRILY_SCORE_SCALE / sqrt((double) (nb_trigrams * count)));
+      break;
+    }
+  }
+}
+
+/******************************************************************************/
+
+/* tokenises <needle> as the start of a string: its trigrams at the first */
+/* PREFIX_DEPTH positions come first, <nb_start> of them, then the others */
+static int parse_prefix(const char* needle, trigram_t* trigrams, int* nb_start)
+{
+  int nb_rest = 0;
+  int kept    = 0;
+
+  *nb_start = blurrily_tokeniser_parse_range(needle, trigrams, 0, PREFIX_DEPTH, 0);
+  if (*nb_start < 0) return -1;
+  nb_rest = blurrily_tokeniser_parse_range(needle, trigrams + *nb_start, PREFIX_DEPTH, (size_t)-1, 0);
+  if (nb_rest < 0) return -1;
+
+  /* a trigram is only looked up once */
+  for (int k = 0; k < nb_rest; ++k) {
+    trigram_t t      = trigrams[*nb_start + k];
+    int       repeat = 0;
+
+    for (int j = 0; j < *nb_start && !repeat; ++j) repeat = (trigrams[j] == t);
+    if (!repeat) trigrams[*nb_start + kept++] = t;
+  }
+  return *nb_start + kept;
+}
+
+/******************************************************************************/
+
+/* inserts <match> into the <nb_matches> best <matches> so far, keeping */
+/* at most <limit>; returns the new number of matches */
+static int insert_match(trigram_match matches, int nb_matches, int limit, trigram_match_t match)
+{
+  int k = nb_matches;
+
+  if (limit == 0) return 0;
+  if (nb_matches == limit) {
+    if (compare_matches(&match, matches + limit - 1) >= 0) return nb_matches;
+    k = limit - 1;
+  }
+  for (; k > 0 && compare_matches(&match, matches + k - 1) < 0; --k) {
+    matches[k] = matches[k-1];
+  }
+  matches[k] = match;
+  return (nb_matches < limit) ? nb_matches + 1 : nb_matches;
+}
+
+/******************************************************************************/
+
+/* the <limit> best matches for <trigrams>, by the threshold algorithm: */
+/* the weight-ordered lists are read one entry of each in turn, and each */
+/* reference first seen is counted in every list (by binary search). */
+/* Reading stops once no reference not seen yet can rank above the last */
+/* of the best so far: it would be in at most as many lists as are left */
+/* to read, and weigh at least the heaviest entry about to be read. */
+/* Returns the number of results, negative on failure, and accounts for */
+/* the entries read in <explain> if not NULL. */
+static int find_by_weight(trigram_map haystack, const trigram_t* trigrams, int nb_trigrams, uint16_t limit, trigram_match results, blurrily_explain_t* explain)
+{
+  uint32_t*         depths     = NULL;
+  int               nb_results = 0;
+  int               res        = -1;
+  blurrily_counts_t seen;
+
+  blurrily_counts_init(&seen);
+  depths = (uint32_t*) calloc(nb_trigrams, sizeof(uint32_t));
+  if (depths == NULL) goto cleanup;
+  for (int k = 0; k < nb_trigrams; ++k) {
+    if (sort_map_if_dirty(haystack->map + trigrams[k]) && explain) explain->sorted_lists += 1;
+  }
+
+  for (;;) {
+    uint32_t active   = 0;  /* lists not read to the end */
+    uint32_t frontier = 0;  /* heaviest next entry in those */
+
+    for (int k = 0; k < nb_trigrams; ++k) {
+      trigram_entries_t* ordered = haystack->by_weight + trigrams[k];
+      trigram_entry_t    entry;
+      trigram_match_t    match;
+
+      if (depths[k] >= ordered->used) continue;
+      entry = ordered->entries[depths[k]++];
+      if (blurrily_counts_get(&seen, entry.reference)) continue;
+      if (blurrily_counts_put(&seen, entry.reference, 1) < 0) goto cleanup;
+
+      match.reference = entry.reference;
+      match.matches   = 0;
+      match.weight    = entry.weight;
+      match.distance  = BLURRILY_NO_DISTANCE;
+      match.score     = 0;
+      for (int j = 0; j < nb_trigrams; ++j) {
+        trigram_entries_t* map = haystack->map + trigrams[j];
+
+        if (bsearch(&entry, map->entries, map->used, sizeof(trigram_entry_t), &compare_entries)) match.matches += 1;
+      }
+      nb_results = insert_match(results, nb_results, limit, match);
+    }
+
+    for (int k = 0; k < nb_trigrams; ++k) {
+      trigram_entries_t* ordered = haystack->by_weight + trigrams[k];
+
+      if (depths[k] >= ordered->used) continue;
+      active += 1;
+      if (ordered->entries[depths[k]].weight > frontier) frontier = ordered->entries[depths[k]].weight;
+    }
+    if (active == 0) break;
+    if (nb_results == limit && limit > 0) {
+      trigram_match_t* last = results + limit - 1;
+
+      if (active < last->matches) break;
+      if (active == last->matches && last->weight <= frontier) break;
+    }
+  }
+  res = nb_results;
+  if (explain) {
+    for (int k = 0; k < nb_trigrams; ++k) explain->entries += depths[k];
+    explain->candidates = seen.count;
+  }
+
+cleanup:
+  blurrily_counts_free(&seen);
+  free_if(depths);
+  return res;
+}
+
+/******************************************************************************/
+
+/* the posting list of <trigram>, from the prefix index if it is one of */
+/* the <start> trigrams of a prefix find and the index covers every reference */
+static trigram_entries_t* list_to_read(trigram_map haystack, trigram_t trigram, int start)
+{
+  if (start && haystack->prefixes && haystack->prefixes_complete) return haystack->prefixes + trigram;
+  return haystack->map + trigram;
+}
+
+/* records the time since <since> against <phase>, in the map's metrics */
+/* and in the explanation <options> ask for; returns the current time */
+static uint64_t record_phase(trigram_map haystack, trigram_find_options_t* options, blurrily_phase_t phase, uint64_t since)
+{
+  uint64_t now = blurrily_metrics_record(haystack->metrics, phase, since);
+
+  if (options && options->explain) options->explain->phase_ns[phase] += now - since;
+  return now;
+}
+
+/* <find_with> for an already tokenised <needle>, timed from <started_at>; */
+/* the first <nb_start> trigrams are read from the prefix index if any */
+static int find_trigrams(trigram_map haystack, const char* needle, const trigram_t* trigrams, int nb_trigrams, int nb_start, uint16_t limit, trigram_find_options_t* options, trigram_match results, uint64_t started_at)
+{
+  size_t           length      = strlen(needle);
+  int              nb_entries  = -1;
+  trigram_entry_t* entries     = NULL;
+  trigram_entry_t* entry_ptr   = NULL;
+  int              nb_matches  = -1;
+  trigram_match_t* matches     = NULL;
+  trigram_match_t* match_ptr   = NULL;
+  uint32_t         last_ref    = (uint32_t)-1;
+  int              nb_results  = 0;
+  uint64_t         phase_at    = blurrily_metrics_now();
+  uint16_t         rerank      = options ? options->rerank : 0;
+  uint32_t         max_entries = options ? options->max_entries : 0;
+  uint64_t         deadline    = (options && options->timeout_ns) ? started_at + options->timeout_ns : 0;
+  trigram_entries_t** lists   = NULL;
+  int              nb_lists    = 0;
+  int              truncated   = 0;
+  int              filtering   = filters_entries(options);
+  int              similarity  = options ? options->similarity : BLURRILY_SIMILARITY_MATCHES;
+  int              prefix      = options && options->prefix;
+  int              cacheable   = rerank == 0 && !filtering && !prefix && similarity == BLURRILY_SIMILARITY_MATCHES;
+  int              by_weight   = cacheable && !max_entries && !deadline && limit <= BY_WEIGHT_MAX_LIMIT &&
+                                 haystack->by_weight && haystack->by_weight_generation == haystack->generation;
+  blurrily_explain_t* explain = options ? options->explain : NULL;
+
+  if (nb_trigrams <= 0) goto cleanup;
+
+  LOG("%d trigrams in '%s'\n", nb_trigrams, needle);
+
+  if (explain) {
+    explain->nb_trigrams = (uint32_t) nb_trigrams;
+    for (int k = 0; k < nb_trigrams && k < BLURRILY_EXPLAIN_TRIGRAMS; ++k) {
+      trigram_entries_t* list = list_to_read(haystack, trigrams[k], k < nb_start);
+
+      explain->trigrams[k]     = trigrams[k];
+      explain->list_lengths[k] = list->used;
+    }
+  }
+
+  /* serve from the cache if the map hasn't changed since */
+  /* (re-ranked, filtered or scored results are not cached) */
+  if (haystack->cache && cacheable) {
+    int cached = blurrily_cache_get(haystack->cache, haystack->generation, trigrams, nb_trigrams, limit, results);
+    if (cached >= 0) {
+      nb_results = cached;
+      if (explain) explain->cached = 1;
+      goto cleanup;
+    }
+  }
+
+  /* with lists in weight order, stop reading once the best are known */
+  if (by_weight) {
+    nb_results = find_by_weight(haystack, trigrams, nb_trigrams, limit, results, explain);
+    phase_at = record_phase(haystack, options, BLURRILY_PHASE_REDUCE, phase_at);
+    if (explain) explain->by_weight = 1;
+    if (nb_results < 0) goto cleanup;
+    if (haystack->cache) blurrily_cache_put(haystack->cache, haystack->generation, trigrams, nb_trigrams, limit, results, nb_results);
+    goto cleanup;
+  }
+
+  /* with a budget, read the most selective (shortest) lists first */
+  lists = SMALLOC(nb_trigrams, trigram_entries_t*);
+  for (int k = 0; k < nb_trigrams; ++k) {
+    lists[k] = list_to_read(haystack, trigrams[k], k < nb_start);
+  }
+  if (max_entries || deadline) {
+    for (int k = 1; k < nb_trigrams; ++k) {
+      trigram_entries_t* list = lists[k];
+      int                j    = k;
+
+      for (; j > 0 && lists[j-1]->used > list->used; --j) lists[j] = lists[j-1];
+      lists[j] = list;
+    }
+  }
+
+  /* measure size required for sorting, within the budget; when even the */
+  /* shortest list exceeds it, the start of that list is read instead */
+  nb_entries = 0;
+  for (nb_lists = 0; nb_lists < nb_trigrams; ++nb_lists) {
+    uint32_t used = lists[nb_lists]->used;
+
+    if (max_entries && (uint64_t)nb_entries + used > max_entries) {
+      truncated = 1;
+      if (nb_lists == 0) {
+        nb_entries = (int) max_entries;
+        nb_lists   = 1;
+      }
+      break;
+    }
+    nb_entries += used;
+  }
+  if (nb_entries == 0) goto cleanup;
+
+  /* allocate sorting memory */
+  entries = SMALLOC(nb_entries, trigram_entry_t);
+  assert(entries != NULL);
+  LOG("allocated space for %zd trigrams entries\n", nb_entries);
+
+  /* copy data for sorting, checking the deadline between lists */
+  entry_ptr = entries;
+  for (int k = 0; k < nb_lists; ++k) {
+    trigram_entries_t* list    = lists[k];
+    size_t             buckets = list->used;
+    trigram_entry_t*   source  = NULL;
+
+    if (deadline && k > 0 && blurrily_metrics_now() > deadline) {
+      truncated = 1;
+      break;
+    }
+    if (sort_map_if_dirty(list) && explain) explain->sorted_lists += 1;
+    source = list->entries;
+
+    /* the start of a list too long for the budget: the lightest entries */
+    /* if its weight-ordered copy is current, else the lowest references */
+    if (buckets > (size_t) nb_entries) {
+      buckets = (size_t) nb_entries;
+      if (list >= haystack->map && list < haystack->map + TRIGRAM_COUNT &&
+          haystack->by_weight && haystack->by_weight_generation == haystack->generation) {
+        source = haystack->by_weight[list - haystack->map].entries;
+      }
+    }
+    if (explain) explain->entries += buckets;
+    if (filtering) {
+      entry_ptr += copy_filtered(entry_ptr, source, (uint32_t) buckets, options);
+    } else {
+      memcpy(entry_ptr, source, buckets * sizeof(trigram_entry_t));
+      entry_ptr += buckets;
+    }
+  }
+  nb_entries = (int) (entry_ptr - entries);
+  phase_at = record_phase(haystack, options, BLURRILY_PHASE_COPY, phase_at);
+
+  if (nb_entries == 0) goto cleanup;
+
+  /* sort data */
+  MERGESORT(entries, nb_entries, sizeof(trigram_entry_t), &compare_entries);
+  LOG("sorting entries\n");
+  phase_at = record_phase(haystack, options, BLURRILY_PHASE_SORT, phase_at);
+
+  /* count distinct matches */
+  entry_ptr  = entries;
+  last_ref   = -1;
+  nb_matches = 0;
+  for (int k = 0; k < nb_entries; ++k) {
+    if (entry_ptr->reference != last_ref) {
+      last_ref = entry_ptr->reference;
+      ++nb_matches;
+    }
+    ++entry_ptr;    
+  }
+  assert(entry_ptr == entries + nb_entries);
+  LOG("total %zd distinct matches\n", nb_matches);
+  if (explain) explain->candidates = (uint32_t) nb_matches;
+
+  /* allocate maches result */
+  matches = SMALLOC(nb_matches, trigram_match_t);
+  assert(matches != NULL);
+
+  /* reduction, counting matches per reference */
+  entry_ptr = entries;
   match_ptr = matches;
   match_ptr->matches   = 0;
   match_ptr->reference = entry_ptr->reference; /* setup the first match to */
   match_ptr->weight    = entry_ptr->weight;    /* simplify the loop */
+  match_ptr->distance  = BLURRILY_NO_DISTANCE;
+  match_ptr->score     = 0;
   for (int k = 0; k < nb_entries; ++k) {
     if (entry_ptr->reference != match_ptr->reference) {
       ++match_ptr;
       match_ptr->reference = entry_ptr->reference;
       match_ptr->weight    = entry_ptr->weight;
       match_ptr->matches   = 1;
+      match_ptr->distance  = BLURRILY_NO_DISTANCE;
+      match_ptr->score     = 0;
     } else {
       match_ptr->matches  += 1;
     }
@@ -561,9 +1552,19 @@ int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t lim
   }
   assert(match_ptr == matches + nb_matches - 1);
   assert(entry_ptr == entries + nb_entries);
+  if (similarity != BLURRILY_SIMILARITY_MATCHES) {
+    score_matches(haystack, similarity, (uint32_t) nb_trigrams, matches, nb_matches);
+  }
+  phase_at = record_phase(haystack, options, BLURRILY_PHASE_REDUCE, phase_at);
 
   /* sort by weight (qsort) */
   qsort(matches, nb_matches, sizeof(trigram_match_t), &compare_matches);
+  phase_at = record_phase(haystack, options, BLURRILY_PHASE_RANK, phase_at);
+
+  if (rerank > 0) {
+    rerank_matches(haystack, needle, length, matches, nb_matches, rerank, limit);
+    phase_at = record_phase(haystack, options, BLURRILY_PHASE_RERANK, phase_at);
+  }
 
   /* output results */
   nb_results = (limit < nb_matches) ? limit : nb_matches;
@@ -572,51 +1573,658 @@ int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t lim
     LOG("match %d: reference %d, matchiness %d, weight %d\n", k, matches[k].reference, matches[k].matches, matches[k].weight);
   }
 
+  if (haystack->cache && cacheable && !truncated) {
+    blurrily_cache_put(haystack->cache, haystack->generation, trigrams, nb_trigrams, limit, results, nb_results);
+  }
+
 cleanup:
+  if (options) options->truncated = truncated;
+  if (truncated) blurrily_metrics_truncated(haystack->metrics);
   free_if(entries);
   free_if(matches);
+  free_if(lists);
+  (void) record_phase(haystack, options, BLURRILY_PHASE_FIND, started_at);
+  return nb_results;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_find_with(trigram_map haystack, const char* needle, uint16_t limit, trigram_find_options_t* options, trigram_match results)
+{
+  uint64_t   started_at  = blurrily_metrics_now();
+  trigram_t* trigrams    = SMALLOC(strlen(needle)+1, trigram_t);
+  int        nb_start    = 0;
+  int        nb_trigrams = -1;
+  int        nb_results  = 0;
+
+  if (trigrams == NULL) return -1;
+  if (options && options->explain) memset(options->explain, 0, sizeof(blurrily_explain_t));
+  if (options && options->prefix) {
+    nb_trigrams = parse_prefix(needle, trigrams, &nb_start);
+  } else {
+    nb_trigrams = blurrily_tokeniser_parse_string(needle, trigrams);
+  }
+  (void) record_phase(haystack, options, BLURRILY_PHASE_TOKENISE, started_at);
+  nb_results = find_trigrams(haystack, needle, trigrams, nb_trigrams, nb_start, limit, options, results, started_at);
   free_if(trigrams);
   return nb_results;
 }
 
 /******************************************************************************/
 
-int blurrily_storage_delete(trigram_map haystack, uint32_t reference)
+/* the find one map runs for <find_across> */
+typedef struct find_job_t {
+  trigram_map            haystack;
+  const char*            needle;
+  const trigram_t*       trigrams;
+  int                    nb_trigrams;
+  int                    nb_start;
+  uint16_t               limit;
+  trigram_find_options_t options;
+  trigram_match_t*       results;
+  int                    nb_results;
+} find_job_t;
+
+/* a result of <find_across>, with the index of its map */
+typedef struct tagged_match_t {
+  trigram_match_t match;
+  int             source;
+} tagged_match_t;
+
+static void* run_find_job(void* job_p)
 {
-  int trigrams_deleted = 0;
+  find_job_t* job = (find_job_t*)job_p;
 
-  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
-    trigram_entries_t* map       = haystack->map + k;
-    trigram_entry_t*   entry     = NULL;
+  job->nb_results = find_trigrams(job->haystack, job->needle, job->trigrams, job->nb_trigrams, job->nb_start, job->limit, &job->options, job->results, blurrily_metrics_now());
+  return NULL;
+}
 
-    for (unsigned int j = 0; j < map->used; ++j) {
-      entry = map->entries + j;
-      if (entry->reference != reference) continue;
+static int compare_tagged_matches(const void* left_p, const void* right_p)
+{
+  tagged_match_t* left  = (tagged_match_t*)left_p;
+  tagged_match_t* right = (tagged_match_t*)right_p;
+  int             delta = compare_matches(&left->match, &right->match);
 
-      /* swap with the last entry */
-      *entry = map->entries[map->used - 1];
-      memset(map->entries + map->used - 1, 0xFF, sizeof(trigram_entry_t));
+  return (delta != 0) ? delta : left->source - right->source;
+}
 
-      map->used -= 1;
+static int compare_tagged_distances(const void* left_p, const void* right_p)
+{
+  tagged_match_t* left  = (tagged_match_t*)left_p;
+  tagged_match_t* right = (tagged_match_t*)right_p;
+  int             delta = compare_distances(&left->match, &right->match);
 
-      ++trigrams_deleted;
-      --j;
+  return (delta != 0) ? delta : left->source - right->source;
+}
+
+/* whether the finds are worth running in threads: enough entries to read, */
+/* and no map listed twice */
+static int worth_threads(trigram_map* haystacks, int nb_haystacks, const trigram_t* trigrams, int nb_trigrams)
+{
+  uint64_t nb_entries = 0;
+
+  for (int k = 0; k < nb_haystacks; ++k) {
+    for (int j = 0; j < k; ++j) {
+      if (haystacks[j] == haystacks[k]) return 0;
     }
+    for (int t = 0; t < nb_trigrams; ++t) nb_entries += haystacks[k]->map[trigrams[t]].used;
+  }
+  return nb_entries >= FIND_ACROSS_MIN_ENTRIES;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_find_across(trigram_map* haystacks, int nb_haystacks, const char* needle, uint16_t limit, trigram_find_options_t* options, trigram_match results, int* sources)
+{
+  int              nb_trigrams = -1;
+  int              nb_start    = 0;
+  trigram_t*       trigrams    = (trigram_t*)NULL;
+  find_job_t*      jobs        = NULL;
+  pthread_t*       threads     = NULL;
+  uint8_t*         started     = NULL;
+  trigram_match_t* buffers     = NULL;
+  tagged_match_t*  merged      = NULL;
+  int              nb_merged   = 0;
+  int              nb_results  = -1;
+  int              parallel    = 0;
+  uint16_t         rerank      = options ? options->rerank : 0;
+
+  if (nb_haystacks <= 0) return 0;
+
+  trigrams = SMALLOC(strlen(needle)+1, trigram_t);
+  jobs     = SMALLOC(nb_haystacks, find_job_t);
+  threads  = SMALLOC(nb_haystacks, pthread_t);
+  started  = SMALLOC(nb_haystacks, uint8_t);
+  buffers  = SMALLOC((size_t)nb_haystacks * limit, trigram_match_t);
+  merged   = SMALLOC((size_t)nb_haystacks * limit, tagged_match_t);
+  if (!trigrams || !jobs || !threads || !started || !buffers || !merged) goto cleanup;
+
+  /* tokenise once for all maps */
+  if (options && options->prefix) {
+    nb_trigrams = parse_prefix(needle, trigrams, &nb_start);
+  } else {
+    nb_trigrams = blurrily_tokeniser_parse_string(needle, trigrams);
+  }
+  parallel = nb_haystacks > 1 && worth_threads(haystacks, nb_haystacks, trigrams, nb_trigrams);
+
+  for (int k = 0; k < nb_haystacks; ++k) {
+    find_job_t* job = jobs + k;
+
+    job->haystack    = haystacks[k];
+    job->needle      = needle;
+    job->trigrams    = trigrams;
+    job->nb_trigrams = nb_trigrams;
+    job->nb_start    = nb_start;
+    job->limit       = limit;
+    job->results     = buffers + (size_t)k * limit;
+    job->nb_results  = 0;
+    if (options) job->options = *options;
+    else memset(&job->options, 0, sizeof(job->options));
+    job->options.explain = NULL;
+  }
+
+  /* the calling thread runs the first find, and any a thread could not */
+  /* be started for */
+  for (int k = 1; k < nb_haystacks; ++k) {
+    started[k] = parallel && pthread_create(threads + k, NULL, run_find_job, jobs + k) == 0;
+  }
+  (void) run_find_job(jobs);
+  for (int k = 1; k < nb_haystacks; ++k) {
+    if (started[k]) (void) pthread_join(threads[k], NULL);
+    else (void) run_find_job(jobs + k);
+  }
+
+  /* merge the best of each map */
+  if (options) options->truncated = 0;
+  for (int k = 0; k < nb_haystacks; ++k) {
+    for (int j = 0; j < jobs[k].nb_results; ++j) {
+      merged[nb_merged].match  = jobs[k].results[j];
+      merged[nb_merged].source = k;
+      ++nb_merged;
+    }
+    if (options && jobs[k].options.truncated) options->truncated = 1;
+  }
+  qsort(merged, nb_merged, sizeof(tagged_match_t), rerank > 0 ? &compare_tagged_distances : &compare_tagged_matches);
+
+  nb_results = (limit < nb_merged) ? limit : nb_merged;
+  for (int k = 0; k < nb_results; ++k) {
+    results[k] = merged[k].match;
+    sources[k] = merged[k].source;
+  }
+
+cleanup:
+  free_if(merged);
+  free_if(buffers);
+  free_if(started);
+  free_if(threads);
+  free_if(jobs);
+  free_if(trigrams);
+  return nb_results;
+}
+
+/******************************************************************************/
+
+/* removes the entries of <reference> (or of <doomed> references, adding */
+/* them to <found> if not NULL) from <map>, and returns how many */
+static uint32_t remove_entries(trigram_entries_t* map, uint32_t reference, blurrily_refs_t* doomed, blurrily_refs_t* found, uint32_t* nb_found)
+{
+  uint32_t kept    = 0;
+  uint32_t removed = 0;
+  uint32_t deleted = 0;
+
+  /* compact in place, preserving order (and so the sorted body) */
+  for (uint32_t j = 0; j < map->used; ++j) {
+    uint32_t ref = map->entries[j].reference;
+
+    if (doomed ? blurrily_refs_test(doomed, ref) : ref == reference) {
+      if (j < map->sorted) ++removed;
+      if (found && !blurrily_refs_test(found, ref)) {
+        blurrily_refs_add(found, ref);
+        ++*nb_found;
+      }
+      continue;
+    }
+    if (kept != j) map->entries[kept] = map->entries[j];
+    ++kept;
+  }
+  if (kept == map->used) return 0;
+
+  memset(map->entries + kept, 0xFF, (map->used - kept) * sizeof(trigram_entry_t));
+  deleted      = map->used - kept;
+  map->sorted -= removed;
+  map->used    = kept;
+  return deleted;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_delete(trigram_map haystack, uint32_t reference)
+{
+  int      trigrams_deleted = 0;
+  uint64_t started_at       = blurrily_metrics_now();
+
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigrams_deleted += remove_entries(haystack->map + k, reference, NULL, NULL, NULL);
+    if (haystack->prefixes) (void) remove_entries(haystack->prefixes + k, reference, NULL, NULL, NULL);
   }
   haystack->total_trigrams -= trigrams_deleted;
-  if (trigrams_deleted > 0) haystack->total_references -= 1;
+  if (trigrams_deleted > 0) {
+    haystack->total_references -= 1;
+    haystack->generation       += 1;
+  }
 
   if (haystack->refs) blurrily_refs_remove(haystack->refs, reference); 
-  
+  blurrily_needles_delete(&haystack->needles, reference);
+  blurrily_counts_delete(&haystack->counts, reference);
+
+  (void) blurrily_metrics_record(haystack->metrics, BLURRILY_PHASE_DELETE, started_at);
   return trigrams_deleted;
 }
 
 /******************************************************************************/
 
+int blurrily_storage_delete_batch(trigram_map haystack, const uint32_t* references, int nb_references)
+{
+  blurrily_refs_t* doomed           = NULL;
+  blurrily_refs_t* found            = NULL;
+  uint32_t         nb_found         = 0;
+  int              trigrams_deleted = 0;
+  uint64_t         started_at       = blurrily_metrics_now();
+
+  if (blurrily_refs_new(&doomed) < 0 || blurrily_refs_new(&found) < 0) {
+    trigrams_deleted = -1;
+    goto cleanup;
+  }
+  for (int k = 0; k < nb_references; ++k) blurrily_refs_add(doomed, references[k]);
+
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigrams_deleted += remove_entries(haystack->map + k, 0, doomed, found, &nb_found);
+    if (haystack->prefixes) (void) remove_entries(haystack->prefixes + k, 0, doomed, NULL, NULL);
+  }
+  haystack->total_trigrams   -= trigrams_deleted;
+  haystack->total_references -= nb_found;
+  if (trigrams_deleted > 0) haystack->generation += 1;
+
+  for (int k = 0; k < nb_references; ++k) {
+    if (haystack->refs) blurrily_refs_remove(haystack->refs, references[k]);
+    blurrily_needles_delete(&haystack->needles, references[k]);
+    blurrily_counts_delete(&haystack->counts, references[k]);
+  }
+
+cleanup:
+  if (doomed) blurrily_refs_free(&doomed);
+  if (found)  blurrily_refs_free(&found);
+  (void) blurrily_metrics_record(haystack->metrics, BLURRILY_PHASE_DELETE, started_at);
+  return trigrams_deleted;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_merge(trigram_map haystack, trigram_map source)
+{
+  blurrily_refs_t* added         = NULL;
+  uint32_t         nb_references = 0;
+  uint32_t         nb_trigrams   = 0;
+  int              res           = -1;
+
+  if (haystack == source) return 0;
+  if (!haystack->refs) {
+    blurrily_refs_t* refs = NULL;
+
+    if (blurrily_refs_new(&refs) < 0) return -1;
+    haystack->refs = refs;
+    add_all_refs(haystack);
+  }
+
+  /* references from <source> that <haystack> lacks */
+  res = blurrily_refs_new(&added);
+  if (res < 0) goto cleanup;
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map = source->map + k;
+
+    for (uint32_t j = 0; j < map->used; ++j) {
+      uint32_t ref = map->entries[j].reference;
+      if (blurrily_refs_test(haystack->refs, ref) || blurrily_refs_test(added, ref)) continue;
+      blurrily_refs_add(added, ref);
+      ++nb_references;
+      res = blurrily_counts_put(&haystack->counts, ref, blurrily_counts_get(&source->counts, ref));
+      if (res < 0) goto cleanup;
+    }
+  }
+
+  /* append their entries to each list, then merge the sorted runs */
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map    = haystack->map + k;
+    trigram_entries_t* other  = source->map + k;
+
+    if (other->used == 0) continue;
+
+    res = reserve_entries(map, other->used);
+    if (res < 0) goto cleanup;
+
+    for (uint32_t j = 0; j < other->used; ++j) {
+      trigram_entry_t entry = other->entries[j];
+      if (!blurrily_refs_test(added, entry.reference)) continue;
+      map->entries[map->used] = entry;
+      map->used += 1;
+      ++nb_trigrams;
+      blurrily_refs_add(haystack->refs, entry.reference);
+    }
+    sort_map_if_dirty(map);
+  }
+
+  /* and to the prefix index, when both have one; references the source */
+  /* did not index leave ours incomplete */
+  if (haystack->prefixes && nb_references > 0 && !(source->prefixes && source->prefixes_complete)) {
+    haystack->prefixes_complete = 0;
+  }
+  for (int k = 0; haystack->prefixes && source->prefixes && k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map   = haystack->prefixes + k;
+    trigram_entries_t* other = source->prefixes + k;
+
+    if (other->used == 0) continue;
+
+    res = reserve_entries(map, other->used);
+    if (res < 0) goto cleanup;
+
+    for (uint32_t j = 0; j < other->used; ++j) {
+      if (blurrily_refs_test(added, other->entries[j].reference)) append_entry(map, other->entries[j]);
+    }
+    sort_map_if_dirty(map);
+  }
+
+  /* carry over kept needles */
+  for (uint32_t k = 0; haystack->needles.enabled && k < source->needles.nb_slots; ++k) {
+    needle_slot_t  slot   = source->needles.slots[k];
+    const uint8_t* stored = NULL;
+    uint16_t       length = 0;
+
+    if (slot.offset == NEEDLES_EMPTY || !blurrily_refs_test(added, slot.reference)) continue;
+    (void) blurrily_needles_get(&source->needles, slot.reference, &stored, &length);
+    res = blurrily_needles_put(&haystack->needles, slot.reference, (const char*) stored, length);
+    if (res < 0) goto cleanup;
+  }
+
+  haystack->total_trigrams   += nb_trigrams;
+  haystack->total_references += nb_references;
+  haystack->generation       += 1;
+  res = nb_references;
+
+cleanup:
+  if (added) blurrily_refs_free(&added);
+  return res;
+}
+
+/******************************************************************************/
+
+/* indexes the references already in the map from their kept needles, */
+/* taking their weight from their first posting entry; the index stays */
+/* incomplete if any has no needle */
+static int index_existing(trigram_map haystack)
+{
+  blurrily_refs_t* indexed  = NULL;
+  trigram_t*       trigrams = NULL;
+  char*            needle   = NULL;
+  int              complete = 1;
+  int              res      = -1;
+
+  if (blurrily_refs_new(&indexed) < 0) goto cleanup;
+  trigrams = SMALLOC(UINT16_MAX + 1, trigram_t);
+  needle   = SMALLOC(UINT16_MAX + 1, char);
+  if (!trigrams || !needle) goto cleanup;
+
+  for (int k = 0; k < TRIGRAM_COUNT && complete; ++k) {
+    trigram_entries_t* map = haystack->map + k;
+
+    for (uint32_t j = 0; j < map->used; ++j) {
+      trigram_entry_t entry  = map->entries[j];
+      const uint8_t*  stored = NULL;
+      uint16_t        length = 0;
+
+      if (blurrily_refs_test(indexed, entry.reference)) continue;
+      if (blurrily_needles_get(&haystack->needles, entry.reference, &stored, &length) < 0) {
+        complete = 0;
+        break;
+      }
+      memcpy(needle, stored, length);
+      needle[length] = 0;
+      if (put_prefixes(haystack, needle, entry, trigrams) < 0) goto cleanup;
+      blurrily_refs_add(indexed, entry.reference);
+    }
+  }
+  haystack->prefixes_complete = complete;
+  res = 0;
+
+cleanup:
+  if (indexed) blurrily_refs_free(&indexed);
+  free_if(trigrams);
+  free_if(needle);
+  return res;
+}
+
+int blurrily_storage_index_prefixes(trigram_map haystack, int enabled)
+{
+  trigram_entries_t* prefixes = NULL;
+
+  if (!enabled) {
+    drop_prefixes(haystack);
+    return 0;
+  }
+  if (haystack->prefixes && haystack->prefixes_complete) return 0;
+
+  /* start over, so no reference is indexed twice */
+  drop_prefixes(haystack);
+  prefixes = (trigram_entries_t*) calloc(TRIGRAM_COUNT, sizeof(trigram_entries_t));
+  if (prefixes == NULL) return -1;
+  haystack->prefixes          = prefixes;
+  haystack->prefixes_offset   = 0;
+  haystack->prefixes_complete = (haystack->total_references == 0);
+  if (haystack->prefixes_complete || !haystack->needles.enabled) return 0;
+  return index_existing(haystack);
+}
+
+/******************************************************************************/
+
+int blurrily_storage_order_by_weight(trigram_map haystack, int enabled)
+{
+  trigram_entries_t* by_weight = NULL;
+
+  if (!enabled) {
+    drop_by_weight(haystack);
+    return 0;
+  }
+  if (haystack->by_weight) return 0;
+
+  by_weight = (trigram_entries_t*) calloc(TRIGRAM_COUNT, sizeof(trigram_entries_t));
+  if (by_weight == NULL) return -1;
+  haystack->by_weight            = by_weight;
+  haystack->by_weight_offset     = 0;
+  haystack->by_weight_generation = haystack->generation - 1;
+  return order_by_weight(haystack);
+}
+
+/******************************************************************************/
+
+int blurrily_storage_keep_needles(trigram_map haystack, int enabled)
+{
+  if (enabled) {
+    haystack->needles.enabled = 1;
+  } else {
+    blurrily_needles_free(&haystack->needles);
+    blurrily_needles_init(&haystack->needles);
+  }
+  return 0;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_cache(trigram_map haystack, size_t max_bytes)
+{
+  blurrily_cache_t* cache = NULL;
+  int               res   = 0;
+
+  drop_cache(haystack);
+  if (max_bytes == 0) return 0;
+
+  res = blurrily_cache_new(&cache, max_bytes);
+  haystack->cache = cache;
+  return res;
+}
+
+/******************************************************************************/
+
 int blurrily_storage_stats(trigram_map haystack, trigram_stat_t* stats)
 {
+  blurrily_cache_stat_t cache_stats;
+
   stats->references = haystack->total_references;
   stats->trigrams   = haystack->total_trigrams;
+
+  memset(&cache_stats, 0, sizeof(cache_stats));
+  if (haystack->cache) blurrily_cache_stats(haystack->cache, &cache_stats);
+  stats->cache_hits      = cache_stats.hits;
+  stats->cache_misses    = cache_stats.misses;
+  stats->cache_entries   = cache_stats.entries;
+  stats->cache_bytes     = cache_stats.bytes;
+  stats->cache_max_bytes = cache_stats.max_bytes;
+
+  stats->needles_kept = haystack->needles.enabled;
+  stats->needles      = haystack->needles.count;
+  stats->truncated    = blurrily_metrics_truncations(haystack->metrics);
+
+  /* posting list shapes */
+  stats->lists       = 0;
+  stats->dirty_lists = 0;
+  stats->buckets     = 0;
+  stats->slack       = 0;
+  memset(stats->list_lengths, 0, sizeof(stats->list_lengths));
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map    = haystack->map + k;
+    uint32_t           used   = map->used;
+    int                bucket = 0;
+
+    stats->buckets += map->buckets;
+    stats->slack   += map->buckets - map->used;
+    if (used == 0) continue;
+
+    stats->lists += 1;
+    if (map->sorted < map->used) stats->dirty_lists += 1;
+    while (used > 1 && bucket < BLURRILY_LIST_BUCKETS - 1) {
+      used >>= 1;
+      ++bucket;
+    }
+    stats->list_lengths[bucket] += 1;
+  }
+  return 0;
+}
+
+/******************************************************************************/
+
+/* bytes of a table of <lists>, adding what is not on disk to <heap> */
+static size_t get_lists_memsize(const trigram_entries_t* lists, off_t offset, size_t* heap)
+{
+  size_t size = TRIGRAM_COUNT * sizeof(trigram_entries_t);
+
+  if (lists == NULL) return 0;
+  if (offset == 0) *heap += size;
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    size_t list_size = get_list_size(lists + k);
+
+    size += list_size;
+    if (lists[k].entries_offset == 0) *heap += list_size;
+  }
+  return size;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_memsize(trigram_map haystack, trigram_memsize_t* memsize)
+{
+  memset(memsize, 0, sizeof(trigram_memsize_t));
+
+  memsize->header = sizeof(trigram_map_t);
+  if (haystack->mapped_size) {
+    memsize->mapped = haystack->mapped_size;
+  } else {
+    memsize->heap  += sizeof(trigram_map_t);
+  }
+
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    trigram_entries_t* map = haystack->map + k;
+
+    memsize->postings += map->used * sizeof(trigram_entry_t);
+    memsize->slack    += (map->buckets - map->used) * sizeof(trigram_entry_t);
+    if (map->entries_offset == 0) memsize->heap += get_map_size(haystack, k);
+  }
+
+  if (haystack->refs) memsize->refs = blurrily_refs_memsize(haystack->refs);
+  memsize->needles = blurrily_needles_memsize(&haystack->needles);
+  if (haystack->needles.slots_offset == 0) memsize->heap += haystack->needles.nb_slots * sizeof(needle_slot_t);
+  if (haystack->needles.arena_offset == 0) memsize->heap += haystack->needles.arena_size;
+  memsize->counts = blurrily_counts_memsize(&haystack->counts);
+  if (haystack->counts.slots_offset == 0) memsize->heap += memsize->counts;
+  memsize->prefixes  = get_lists_memsize(haystack->prefixes, haystack->prefixes_offset, &memsize->heap);
+  memsize->by_weight = get_lists_memsize(haystack->by_weight, haystack->by_weight_offset, &memsize->heap);
+  memsize->other = sizeof(blurrily_metrics_t);
+  if (haystack->cache) {
+    blurrily_cache_stat_t cache_stats;
+    blurrily_cache_stats(haystack->cache, &cache_stats);
+    memsize->other += cache_stats.bytes;
+  }
+  memsize->heap += memsize->refs + memsize->other;
+  return 0;
+}
+
+/******************************************************************************/
+
+/* releases the slack of <map>; returns negative on failure */
+static int shrink_list(trigram_entries_t* map, size_t page_size)
+{
+  if (map->used == map->buckets) return 0;
+
+  if (map->entries_offset) {
+    /* mapped from disk: hand back whole pages past the used entries */
+    /* (advisory, so failures are ignored) */
+    size_t start = (size_t) (map->entries + map->used);
+    size_t end   = (size_t) (map->entries + map->buckets) / page_size * page_size;
+    size_t page  = (start + page_size - 1) / page_size * page_size;
+
+    if (page < end) (void) madvise((void*) page, end - page, MADV_DONTNEED);
+  } else if (map->used == 0) {
+    free(map->entries);
+    map->entries = NULL;
+    map->buckets = 0;
+    map->sorted  = 0;
+  } else {
+    trigram_entry_t* entries = (trigram_entry_t*) realloc(map->entries, map->used * sizeof(trigram_entry_t));
+    if (entries == NULL) return -1;
+    map->entries = entries;
+    map->buckets = map->used;
+  }
+  return 0;
+}
+
+int blurrily_storage_shrink(trigram_map haystack)
+{
+  int    res       = 0;
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+  if (order_by_weight(haystack) < 0) res = -1;
+  for (int k = 0; k < TRIGRAM_COUNT; ++k) {
+    if (shrink_list(haystack->map + k, page_size) < 0) res = -1;
+    if (haystack->prefixes && shrink_list(haystack->prefixes + k, page_size) < 0) res = -1;
+    if (haystack->by_weight && shrink_list(haystack->by_weight + k, page_size) < 0) res = -1;
+  }
+  blurrily_needles_shrink(&haystack->needles);
+  return res;
+}
+
+/******************************************************************************/
+
+int blurrily_storage_timing(trigram_map haystack, blurrily_phase_t phase, blurrily_timing_t* timing)
+{
+  if (phase >= BLURRILY_PHASE_COUNT) return -1;
+  blurrily_metrics_get(haystack->metrics, phase, timing);
   return 0;
 }
 
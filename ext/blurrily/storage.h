@@ -10,8 +10,13 @@
 
 #include <inttypes.h>
 #include "tokeniser.h"
+#include "metrics.h"
+#include "filter.h"
 #include "blurrily.h"
 
+/* list_lengths[k] counts posting lists with [2^k, 2^(k+1)) entries */
+#define BLURRILY_LIST_BUCKETS 32
+
 struct trigram_map_t;
 typedef struct trigram_map_t* trigram_map;
 
@@ -19,16 +24,120 @@ struct BR_PACKED_STRUCT trigram_match_t {
   uint32_t reference;
   uint32_t matches;
   uint32_t weight;
+  uint32_t distance;  /* edit distance to the needle, when re-ranked */
+  uint32_t score;     /* similarity to the needle, in BLURRILY_SCORE_SCALE units */
 };
 typedef struct trigram_match_t trigram_match_t;
 typedef struct trigram_match_t* trigram_match;
 
+/* edit distance of matches that were not re-ranked */
+#define BLURRILY_NO_DISTANCE ((uint32_t)-1)
+
+/* score of a perfect match */
+#define BLURRILY_SCORE_SCALE 1000000
+
+/* how <find> ranks matches, from the N trigrams of the needle, the R of a */
+/* reference, and the M they share */
+typedef enum blurrily_similarity_t {
+  BLURRILY_SIMILARITY_MATCHES = 0,  /* M, unscored */
+  BLURRILY_SIMILARITY_DICE,         /* 2M / (N + R) */
+  BLURRILY_SIMILARITY_JACCARD,      /* M / (N + R - M) */
+  BLURRILY_SIMILARITY_COSINE,       /* M / sqrt(N * R) */
+  BLURRILY_SIMILARITIES
+} blurrily_similarity_t;
+
+/* one write of a <put_batch> */
+typedef struct trigram_put_t {
+  const char* needle;
+  uint32_t    reference;
+  uint32_t    weight;
+} trigram_put_t;
+
+/* trigrams of a needle an explained <find> reports the lists of */
+#define BLURRILY_EXPLAIN_TRIGRAMS 64
+
+/* how a <find> went, filled in when its options ask for it */
+typedef struct blurrily_explain_t {
+  uint32_t  nb_trigrams;    /* in the needle; only the first few are listed */
+  trigram_t trigrams[BLURRILY_EXPLAIN_TRIGRAMS];
+  uint32_t  list_lengths[BLURRILY_EXPLAIN_TRIGRAMS];  /* posting entries of each */
+  uint64_t  entries;        /* posting entries read */
+  uint32_t  candidates;     /* distinct references among them */
+  uint32_t  sorted_lists;   /* lists whose unsorted tail was merged first */
+  uint8_t   cached;         /* served from the cache */
+  uint8_t   by_weight;      /* read from the weight-ordered lists */
+  uint64_t  phase_ns[BLURRILY_PHASE_COUNT];
+} blurrily_explain_t;
+
+/* optional behaviour of <find> */
+typedef struct trigram_find_options_t {
+  uint16_t rerank;       /* best candidates to re-rank by edit distance, 0 for none */
+  uint32_t max_entries;  /* posting entries to read at most, 0 for no limit */
+  uint64_t timeout_ns;   /* time after which to stop reading posting lists, 0 for none */
+
+  const blurrily_filter_t* filter;  /* references that may match, NULL for all */
+  uint32_t min_weight;   /* weights that may match, inclusive */
+  uint32_t max_weight;   /* 0 for no upper bound */
+
+  blurrily_similarity_t similarity;  /* ranking of matches */
+  uint8_t  prefix;       /* whether the needle is the start of the strings sought */
+
+  blurrily_explain_t* explain;  /* filled in by <find_with> if not NULL */
+
+  uint8_t  truncated;    /* set by <find> when it ran out of either */
+} trigram_find_options_t;
+
 typedef struct trigram_stat_t {
   uint32_t references;
   uint32_t trigrams;
 
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint32_t cache_entries;
+  size_t   cache_bytes;
+  size_t   cache_max_bytes;
+
+  uint8_t  needles_kept;
+  uint32_t needles;      /* references with a kept needle */
+
+  uint64_t truncated;    /* finds cut short by their budget */
+
+  uint32_t lists;        /* non-empty posting lists */
+  uint32_t dirty_lists;  /* lists with an unsorted tail to merge on the next find */
+  uint64_t buckets;      /* entries allocated, over all lists */
+  uint64_t slack;        /* entries allocated but unused */
+  uint32_t list_lengths[BLURRILY_LIST_BUCKETS];
 } trigram_stat_t;
 
+/* bytes of memory used by a map */
+typedef struct trigram_memsize_t {
+  /* by purpose */
+  size_t header;    /* fixed-size table of posting lists */
+  size_t postings;  /* entries in use */
+  size_t slack;     /* entries allocated but unused */
+  size_t refs;      /* set of references, built by the first put */
+  size_t needles;   /* needles kept for re-ranking */
+  size_t counts;    /* trigrams of each reference, for scoring */
+  size_t prefixes;  /* optional index of start trigrams */
+  size_t by_weight; /* optional copies of posting lists in weight order */
+  size_t other;     /* timings and cached results */
+
+  /* by origin */
+  size_t mapped;    /* mapped from disk (the whole file) */
+  size_t heap;      /* allocated in memory */
+} trigram_memsize_t;
+
+/* how pages of a map file are brought into memory by <load> */
+typedef enum blurrily_load_mode_t {
+  BLURRILY_LOAD_LAZY = 0,   /* faulted in by the queries needing them */
+  BLURRILY_LOAD_POPULATE,   /* all read before <load> returns */
+  BLURRILY_LOAD_WILLNEED,   /* read ahead by the kernel, in the background */
+  BLURRILY_LOAD_RANDOM,     /* faulted in one at a time, without readahead */
+  BLURRILY_LOAD_LOCK,       /* all read, and locked in memory */
+  BLURRILY_LOAD_HUGEPAGES,  /* transparent huge pages for posting lists */
+  BLURRILY_LOAD_MODES
+} blurrily_load_mode_t;
+
 
 /* 
   Create a new trigram map, resident in memory.
@@ -36,9 +145,12 @@ typedef struct trigram_stat_t {
 int blurrily_storage_new(trigram_map* haystack);
 
 /* 
-  Load an existing trigram map from disk.
+  Load an existing trigram map from disk, paging it in as per <mode>.
+
+  Hints the system may not support are ignored; failing to lock pages in
+  memory is an error.
 */
-int blurrily_storage_load(trigram_map* haystack, const char* path);
+int blurrily_storage_load(trigram_map* haystack, const char* path, blurrily_load_mode_t mode);
 
 /* 
   Release resources claimed by <new> or <open>.
@@ -69,6 +181,16 @@ int blurrily_storage_save(trigram_map haystack, const char* path);
 */
 int blurrily_storage_put(trigram_map haystack, const char* needle, uint32_t reference, uint32_t weight);
 
+/*
+  Like <put> for each of the <nb_puts> <puts>, but tokenises them all first,
+  then groups the new entries by trigram so each posting list is grown and
+  appended to once; the next <find> reading a list merges its new entries
+  in one go.
+
+  Returns the number of trigrams added, negative on failure.
+*/
+int blurrily_storage_put_batch(trigram_map haystack, const trigram_put_t* puts, int nb_puts);
+
 /*
   Check the map for an existing <reference>.
 
@@ -95,6 +217,22 @@ int blurrily_storage_put(trigram_map haystack, const char* needle, uint32_t refe
 */
 int blurrily_storage_delete(trigram_map haystack, uint32_t reference);
 
+/*
+  Like <delete> for each of the <nb_references> <references>, in a single
+  pass over the map.
+
+  Returns the number of trigrams deleted, negative on failure.
+*/
+int blurrily_storage_delete_batch(trigram_map haystack, const uint32_t* references, int nb_references);
+
+/*
+  Add the entries of <source> to <haystack>. References <haystack> already
+  has are skipped, as with <put>. Posting lists are merged, not re-sorted.
+
+  Returns the number of references added on success, negative on failure.
+*/
+int blurrily_storage_merge(trigram_map haystack, trigram_map source);
+
 /*
   Return at most <limit> entries matching <needle> from the <haystack>.
 
@@ -109,6 +247,98 @@ int blurrily_storage_delete(trigram_map haystack, uint32_t reference);
 */
 int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t limit, trigram_match results);
 
+/*
+  Like <find>, with <options> (which may be NULL).
+
+  When <options> asks to re-rank, the best <rerank> candidates by trigrams
+  are ordered by edit distance between their needle and <needle>, then as
+  usual; their <distance> is set. Candidates without a kept needle come
+  last. The needles of references must have been kept (see
+  <keep_needles>).
+
+  With a budget of <max_entries> or <timeout_ns>, posting lists are read
+  shortest first and reading stops before the list that would exceed it;
+  the results then only count the lists read, and <truncated> is set. If
+  even the shortest list exceeds <max_entries>, only its start is read:
+  its lightest entries when the weight-ordered copies are current (see
+  <order_by_weight>), else those of the lowest references.
+
+  Entries whose reference is not in <filter>, or whose weight is out of
+  [<min_weight>, <max_weight>], are dropped as posting lists are read, so
+  <limit> only counts matches that pass. Filtered results are not cached.
+
+  With a <similarity> other than BLURRILY_SIMILARITY_MATCHES, each match
+  is scored from the trigrams it shares with the needle and the trigram
+  counts of both, and matches are ranked by <score>, then as usual. Scored
+  results are not cached.
+
+  With <prefix>, the needle is taken as the start of the strings sought:
+  the end-of-word anchor of its last word is left out, and its trigrams
+  at the first few positions are read from the prefix index, when the map
+  has one (see <index_prefixes>), so only references starting the same
+  way match them. Prefix results are not cached.
+
+  With <explain>, the trigrams of the needle and the lengths of their
+  lists, the entries read, the candidates counted, the lists sorted on
+  demand and the time spent in each phase are reported there.
+*/
+int blurrily_storage_find_with(trigram_map haystack, const char* needle, uint16_t limit, trigram_find_options_t* options, trigram_match results);
+
+/*
+  Like <find_with> on each of the <nb_haystacks> <haystacks>, returning the
+  best <limit> matches overall. The needle is tokenised once, and maps are
+  searched in parallel threads when they hold enough entries to make it
+  worthwhile. <sources> receives the index in <haystacks> of each result's
+  map, and <truncated> is set if any map ran out of budget. <explain> is
+  ignored.
+
+  The maps must not change while this runs.
+
+  Returns number of matches on success, negative on failure.
+*/
+int blurrily_storage_find_across(trigram_map* haystacks, int nb_haystacks, const char* needle, uint16_t limit, trigram_find_options_t* options, trigram_match results, int* sources);
+
+/*
+  Start (or stop, if <enabled> is 0) keeping the needle of each reference
+  put from now on. Stopping discards needles kept so far.
+*/
+int blurrily_storage_keep_needles(trigram_map haystack, int enabled);
+
+/*
+  Start (or stop, if <enabled> is 0) indexing the trigrams at the first
+  few positions of each reference, for <prefix> finds. Stopping discards
+  the index.
+
+  References already in the map are indexed from their kept needles (see
+  <keep_needles>). Until every reference is indexed, which needs all of
+  them to have a needle (or the map to be empty when this is called),
+  prefix finds read the start trigrams from the whole posting lists
+  instead; so do they after merging references the source map did not
+  index. Enabling the index again retries.
+*/
+int blurrily_storage_index_prefixes(trigram_map haystack, int enabled);
+
+/*
+  Start (or stop, if <enabled> is 0) keeping a copy of each posting list
+  sorted by weight. The copies are made now, then again on <save> or
+  <shrink> if the map changed since. While they are current, finds with a
+  small <limit> (and no options besides) read lists lightest first and
+  stop as soon as no other reference can make the results.
+
+  Returns 0 on success, negative on failure.
+*/
+int blurrily_storage_order_by_weight(trigram_map haystack, int enabled);
+
+/*
+  Enable caching of <find> results, using at most <max_bytes> of memory.
+  The cache is emptied whenever the map changes.
+
+  Passing zero disables (and frees) the cache.
+
+  Returns positive on success, negative on failure.
+*/
+int blurrily_storage_cache(trigram_map haystack, size_t max_bytes);
+
 /*
   Copies metadata into <stats>
 
@@ -116,4 +346,27 @@ int blurrily_storage_find(trigram_map haystack, const char* needle, uint16_t lim
 */
 int blurrily_storage_stats(trigram_map haystack, trigram_stat_t* stats);
 
+/*
+  Copies a breakdown of memory usage into <memsize>.
+
+  Returns positive on success, negative on failure.
+*/
+int blurrily_storage_memsize(trigram_map haystack, trigram_memsize_t* memsize);
+
+/*
+  Releases the slack of all posting lists: lists in memory are reallocated
+  to their exact size, whole unused pages of lists mapped from disk are
+  handed back to the system.
+
+  Returns positive on success, negative on failure.
+*/
+int blurrily_storage_shrink(trigram_map haystack);
+
+/*
+  Copies the latency histogram of <phase> into <timing>.
+
+  Returns positive on success, negative on failure.
+*/
+int blurrily_storage_timing(trigram_map haystack, blurrily_phase_t phase, blurrily_timing_t* timing);
+
 #endif
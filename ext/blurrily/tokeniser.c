@@ -6,42 +6,43 @@
 #include "blurrily.h"
 
 
-/******************************************************************************/
-
-static int ipow(int a, int b)
-{
-  int result = 1;
-  
-  while (b-- > 0) result = result * a;
-  return result;
-}
+/* all trigram codes must fit below TRIGRAM_NONE */
+typedef char trigram_codes_fit[(TRIGRAM_BASE * TRIGRAM_BASE * TRIGRAM_BASE <= TRIGRAM_NONE) ? 1 : -1];
+
+/* code of each character; anything outside the alphabet is epsilon (0) */
+static const uint8_t symbol_codes[256] = {
+  ['a'] =  1, ['b'] =  2, ['c'] =  3, ['d'] =  4, ['e'] =  5, ['f'] =  6,
+  ['g'] =  7, ['h'] =  8, ['i'] =  9, ['j'] = 10, ['k'] = 11, ['l'] = 12,
+  ['m'] = 13, ['n'] = 14, ['o'] = 15, ['p'] = 16, ['q'] = 17, ['r'] = 18,
+  ['s'] = 19, ['t'] = 20, ['u'] = 21, ['v'] = 22, ['w'] = 23, ['x'] = 24,
+  ['y'] = 25, ['z'] = 26,
+#ifdef BLURRILY_ALPHABET_ALNUM
+  ['0'] = 27, ['1'] = 28, ['2'] = 29, ['3'] = 30, ['4'] = 31, ['5'] = 32,
+  ['6'] = 33, ['7'] = 34, ['8'] = 35, ['9'] = 36,
+#endif
+};
+
+/* characters of each code, for logging and <blurrily_tokeniser_trigram> */
+static const char code_symbols[TRIGRAM_BASE + 1] = "*" TRIGRAM_ALPHABET;
 
 /******************************************************************************/
 
 static void string_to_code(const char* input, trigram_t *output)
 {
-  trigram_t result = 0;
+  const uint8_t* symbols = (const uint8_t*)input;
 
-  for (int k = 0 ; k < 3; ++k) {
-    if (input[k] == '*' || input[k] < 'a' || input[k] > 'z') continue;
-    result += ipow(TRIGRAM_BASE, k) * (input[k] - 'a' + 1);
-  }
-
-  *output = result;
+  *output = symbol_codes[symbols[0]]
+          + symbol_codes[symbols[1]] * TRIGRAM_BASE
+          + symbol_codes[symbols[2]] * TRIGRAM_BASE * TRIGRAM_BASE;
 }
 
 /******************************************************************************/
 
 static void code_to_string(trigram_t input, char* output)
 {
-  for (int k = 0 ; k < 3; ++k) {
-    uint16_t elem = input / ipow(TRIGRAM_BASE, k) % TRIGRAM_BASE;
-    if (elem == 0) {
-      output[k] = '*';
-    } else {
-      output[k] = ('a' + elem - 1);
-    }
-  }
+  output[0] = code_symbols[input % TRIGRAM_BASE];
+  output[1] = code_symbols[input / TRIGRAM_BASE % TRIGRAM_BASE];
+  output[2] = code_symbols[input / (TRIGRAM_BASE * TRIGRAM_BASE)];
   output[3] = 0;
 }
 
@@ -57,10 +58,26 @@ static int blurrily_compare_trigrams(const void* left_p, const void* right_p)
 /******************************************************************************/
 
 int blurrily_tokeniser_parse_string(const char* input, trigram_t* output)
+{
+  return blurrily_tokeniser_parse_range(input, output, 0, (size_t)-1, 1);
+}
+
+/******************************************************************************/
+
+int blurrily_tokeniser_parse_range(const char* input, trigram_t* output, size_t from, size_t to, int anchored)
 {
   size_t length     = strlen(input);
   char*  normalized = (char*) malloc(length+5);
   size_t duplicates = 0;
+  size_t positions  = anchored ? length+1 : length;
+  size_t last       = 0;  /* index of the last trigram */
+
+  if (normalized == NULL) return -1;
+  if (to > positions) to = positions;
+  if (from >= to) {
+    free((void*)normalized);
+    return 0;
+  }
 
   snprintf(normalized, length+4, "**%s*", input);
 
@@ -70,57 +87,60 @@ int blurrily_tokeniser_parse_string(const char* input, trigram_t* output)
   }
 
   /* compute trigrams */
-  for (size_t k = 0; k <= length; ++k) {
-    string_to_code(normalized+k, output+k);
+  last = to - from - 1;
+  for (size_t k = 0; k <= last; ++k) {
+    string_to_code(normalized+from+k, output+k);
   }
 
   /* print results */
   LOG("-- normalization\n");
   LOG("%s -> %s\n", input, normalized);
   LOG("-- tokenisation\n");
-  for (size_t k = 0; k <= length; ++k) {
+  for (size_t k = 0; k <= last; ++k) {
     char res[4];
 
     code_to_string(output[k], res);
 
     LOG("%c%c%c -> %d -> %s\n",
-      normalized[k], normalized[k+1], normalized[k+2],
+      normalized[from+k], normalized[from+k+1], normalized[from+k+2],
       output[k], res
     );
   }
 
   /* sort */
-  qsort((void*)output, length+1, sizeof(trigram_t), &blurrily_compare_trigrams);
+  qsort((void*)output, last+1, sizeof(trigram_t), &blurrily_compare_trigrams);
 
   /* remove duplicates */
-  for (size_t k = 1; k <= length; ++k) {
+  for (size_t k = 1; k <= last; ++k) {
     trigram_t* previous = output + k - 1;
     trigram_t* current  = output + k;
 
     if (*previous == *current) {
-      *previous = 32768;
+      *previous = TRIGRAM_NONE;
       ++duplicates;
     }
   }
 
   /* compact */
-  qsort((void*)output, length+1, sizeof(trigram_t), &blurrily_compare_trigrams);
+  qsort((void*)output, last+1, sizeof(trigram_t), &blurrily_compare_trigrams);
 
   /* print again */
   LOG("-- after sort/compact\n");
-  for (size_t k = 0; k <= length-duplicates; ++k) {
+  for (size_t k = 0; k <= last-duplicates; ++k) {
     char res[4];
     code_to_string(output[k], res);
     LOG("%d -> %s\n", output[k], res);
   }
 
   free((void*)normalized);
-  return (int) (length + 1 - duplicates);
+  return (int) (last + 1 - duplicates);
 }
 
 /******************************************************************************/
 
-int blurrily_tokeniser_trigram(trigram_t UNUSED(input), char* UNUSED(output))
+int blurrily_tokeniser_trigram(trigram_t input, char* output)
 {
-  return 0;
+  if (input >= TRIGRAM_BASE * TRIGRAM_BASE * TRIGRAM_BASE) return -1;
+  code_to_string(input, output);
+  return 1;
 }
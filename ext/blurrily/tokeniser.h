@@ -4,12 +4,12 @@
 
   Split a string into an array of trigrams.
 
-  The input string should be only lowercase latin letters and spaces
-  (convert using iconv).
+  The input string should be only lowercase latin letters (and digits, if
+  compiled with BLURRILY_ALPHABET_ALNUM) and spaces (convert using iconv).
 
-  Each trigram is a three-symbol tuple consisting of latters and the
-  "epsilon" character used to represent spaces and beginning-of-word/end-of-
-  word anchors.
+  Each trigram is a three-symbol tuple consisting of letters and the
+  "epsilon" character used to represent spaces, beginning-of-word/end-of-
+  word anchors, and any character outside the alphabet.
 
   Each trigram is represented by a 16-bit integer.
 
@@ -17,12 +17,23 @@
 #ifndef __TOKENISER_H__
 #define __TOKENISER_H__
 
+#include <stddef.h>
 #include <inttypes.h>
 
-#define TRIGRAM_BASE 28
+/* symbols of trigrams besides epsilon, picked at compile time */
+#ifdef BLURRILY_ALPHABET_ALNUM
+  #define TRIGRAM_ALPHABET "abcdefghijklmnopqrstuvwxyz0123456789"
+  #define TRIGRAM_BASE     38
+#else
+  #define TRIGRAM_ALPHABET "abcdefghijklmnopqrstuvwxyz"
+  #define TRIGRAM_BASE     28
+#endif
 
 typedef uint16_t trigram_t;
 
+/* never a trigram code, whatever the alphabet */
+#define TRIGRAM_NONE ((trigram_t)0xFFFF)
+
 /* 
   Parse the <input> string and store the result in <ouput>.
   <output> must be allocated by the caller and provide at least as many slots
@@ -33,6 +44,17 @@ typedef uint16_t trigram_t;
 */
 int blurrily_tokeniser_parse_string(const char* input, trigram_t* output);
 
+/*
+  Like <parse_string>, but only the trigrams starting at positions [<from>,
+  <to>) of the anchored <input>: position 0 is the trigram of the
+  beginning-of-word anchor and first letter. Without <anchored>, the
+  end-of-word anchor of the last word is left out, as when the input is
+  the start of a longer string.
+
+  Returns the number of trigrams on success, a negative number on failure.
+*/
+int blurrily_tokeniser_parse_range(const char* input, trigram_t* output, size_t from, size_t to, int anchored);
+
 
 /*
   Given an <input> returns a string representation of the trigram in <output>.
@@ -0,0 +1,92 @@
+require 'tmpdir'
+require 'blurrily/map'
+
+module Blurrily
+  # Builds maps offline, from lines of tab-separated reference, needle and
+  # optional weight, using several processes.
+  class Builder
+
+    # @param options :jobs, number of processes building partial maps
+    #          (default: one per processor).
+    def initialize(options = {})
+      @jobs = options.fetch(:jobs, self.class.processors)
+    end
+
+    # Reads every line of every IO in <inputs>.
+    # @return [Map] a map of all references.
+    def build(inputs)
+      return build_alone(inputs) if @jobs <= 1 || !Process.respond_to?(:fork)
+
+      Dir.mktmpdir('blurrily') do |dir|
+        paths = (0...@jobs).map { |job| File.join(dir, "#{job}.trigrams") }
+        pipes = []
+        pids  = paths.map do |path|
+          reader, writer = IO.pipe
+          pid = Process.fork do
+            pipes.each { |pipe| pipe.close }
+            writer.close
+            begin
+              build_alone([reader]).save(path)
+              exit!(0)
+            rescue Exception
+              exit!(1)
+            end
+          end
+          reader.close
+          pipes << writer
+          pid
+        end
+
+        begin
+          # partition by reference, so partial maps never share one
+          each_entry(inputs) do |line, reference|
+            pipes[reference % @jobs].write(line)
+          end
+        ensure
+          pipes.each(&:close)
+          statuses = pids.map { |pid| Process.wait2(pid).last }
+        end
+        raise 'failed to build partial map' unless statuses.all?(&:success?)
+        self.class.merge(paths)
+      end
+    end
+
+    # Merges map files; references in several are taken from the first.
+    # @return [Map]
+    def self.merge(paths)
+      paths.drop(1).inject(Map.load(paths.first)) do |map, path|
+        other = Map.load(path)
+        map.merge(other)
+        other.close
+        map
+      end
+    end
+
+    def self.processors
+      require 'etc'
+      Etc.respond_to?(:nprocessors) ? Etc.nprocessors : 1
+    end
+
+    private
+
+    def build_alone(inputs)
+      map = Map.new
+      each_entry(inputs) do |line, reference|
+        _, needle, weight = line.chomp.split("\t")
+        map.put(needle, reference, weight.to_i)
+      end
+      map
+    end
+
+    def each_entry(inputs)
+      inputs.each do |io|
+        io.each_line do |line|
+          next if line.strip.empty?
+          reference = line[/\A\d+\t/] or raise ArgumentError, "invalid line: #{line.inspect}"
+          line += "\n" unless line.end_with?("\n")
+          yield line, reference.to_i
+        end
+      end
+    end
+  end
+end
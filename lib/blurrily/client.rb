@@ -3,6 +3,7 @@
 require 'socket'
 require 'ipaddr'
 require 'blurrily/defaults'
+require 'blurrily/connection_pool'
 
 module Blurrily
   class Client
@@ -16,6 +17,14 @@ module Blurrily
     #           Defaults to Blurrily::DEFAULT_PORT.
     # @param db_name Name of the data store being targeted.
     #           Defaults to Blurrily::DEFAULT_DATABASE.
+    # @param hosts Array of "host:port" strings, to spread connections
+    #           round-robin over several servers instead of host and port.
+    # @param pool_size Connections kept open, shared by all threads.
+    #           Defaults to 5.
+    # @param pool_timeout Seconds a thread waits for a free connection.
+    #           Defaults to 5.
+    # @param connect_timeout, read_timeout Seconds before giving up on
+    #           connecting, and on a reply. Default to none.
     #
     # Examples
     #
@@ -29,6 +38,17 @@ module Blurrily
       @host    = options.fetch(:host,     DEFAULT_HOST)
       @port    = options.fetch(:port,     DEFAULT_PORT)
       @db_name = options.fetch(:db_name,  DEFAULT_DATABASE)
+      @read_timeout = options[:read_timeout]
+      @truncated_key = :"blurrily_truncated_#{object_id}"
+
+      addresses = options.fetch(:hosts, ["#{@host}:#{@port}"]).map do |address|
+        host, port = address.to_s.split(':', 2)
+        [host, port ? port.to_i : DEFAULT_PORT]
+      end
+      @pool = ConnectionPool.new(addresses,
+        :size            => options.fetch(:pool_size, 5),
+        :timeout         => options.fetch(:pool_timeout, 5),
+        :connect_timeout => options[:connect_timeout])
     end
 
     # Find record references based on a given string (needle)
@@ -39,6 +59,15 @@ module Blurrily
     # @param limit  Limit the number of results retruned (default: 10).
     #          Must be numeric.
     #          Optional
+    # @param rerank Number of best candidates the server re-orders by edit
+    #          distance to the needle (requires a server started with
+    #          `--needles`). Each result then gains a fourth element, the
+    #          distance, or nil if unknown.
+    #          Optional
+    # @param budget Number of posting entries the server may read at most.
+    #          When it runs out, results only cover part of the needle and
+    #          #truncated? is true.
+    #          Optional
     #
     # Examples
     #
@@ -49,13 +78,60 @@ module Blurrily
     #
     # @returns an Array of matching [`ref`,`score`,`weight`] ordered by score. `ref` is the identifying value of the original record.
     # Note that unless modified, `weight` is simply the string length.
-    def find(needle, limit = nil)
+    def find(needle, limit = nil, rerank = nil, budget = nil)
       limit ||= LIMIT_DEFAULT
       check_valid_needle(needle)
       raise(ArgumentError, "LIMIT value must be in #{LIMIT_RANGE}") unless LIMIT_RANGE.include?(limit)
+      raise(ArgumentError, "RERANK value must be in #{LIMIT_RANGE}") unless rerank.nil? || LIMIT_RANGE.include?(rerank)
+      raise(ArgumentError, "BUDGET value must be a positive integer") unless budget.nil? || (budget.kind_of?(Integer) && budget > 0)
 
       cmd = ["FIND", @db_name, needle, limit]
-      send_cmd_and_get_results(cmd).map(&:to_i).each_slice(3).to_a
+      cmd << rerank if rerank || budget
+      cmd << budget if budget
+      results = send_cmd_and_get_results(cmd)
+      return results.map(&:to_i).each_slice(3).to_a unless rerank
+      results.map { |field| field.empty? ? nil : field.to_i }.each_slice(4).to_a
+    end
+
+    # Same as #find for records starting with <needle>, as users type it
+    # (faster on a server started with `--prefixes`).
+    #
+    # @returns an Array of [`ref`,`score`,`weight`], as #find.
+    def find_prefix(needle, limit = nil)
+      limit ||= LIMIT_DEFAULT
+      check_valid_needle(needle)
+      raise(ArgumentError, "LIMIT value must be in #{LIMIT_RANGE}") unless LIMIT_RANGE.include?(limit)
+
+      send_cmd_and_get_results(["PREFIX", @db_name, needle, limit]).map(&:to_i).each_slice(3).to_a
+    end
+
+    # Same as #find over several data stores at once, in one round trip.
+    #
+    # @param db_names Array of data store names.
+    #
+    # @returns an Array of [`ref`,`score`,`weight`,`db_name`] (with the
+    # distance before `db_name` when re-ranking), best first across all
+    # data stores.
+    def find_across(db_names, needle, limit = nil, rerank = nil, budget = nil)
+      limit ||= LIMIT_DEFAULT
+      check_valid_needle(needle)
+      raise(ArgumentError, "bad data store names") if db_names.empty? || db_names.any? { |name| name.to_s !~ /^[a-z_]+$/ }
+      raise(ArgumentError, "LIMIT value must be in #{LIMIT_RANGE}") unless LIMIT_RANGE.include?(limit)
+      raise(ArgumentError, "RERANK value must be in #{LIMIT_RANGE}") unless rerank.nil? || LIMIT_RANGE.include?(rerank)
+      raise(ArgumentError, "BUDGET value must be a positive integer") unless budget.nil? || (budget.kind_of?(Integer) && budget > 0)
+
+      cmd = ["FINDM", db_names.join(','), needle, limit]
+      cmd << rerank if rerank || budget
+      cmd << budget if budget
+      send_cmd_and_get_results(cmd).each_slice(rerank ? 5 : 4).map do |*fields, db_name|
+        fields.map { |field| field.empty? ? nil : field.to_i } << db_name
+      end
+    end
+
+    # Whether the server cut the last #find of this thread short because of
+    # its budget.
+    def truncated?
+      !!Thread.current[@truncated_key]
     end
 
     # Index a given record.
@@ -95,6 +171,29 @@ module Blurrily
       return
     end
 
+    # Server-side statistics for the data store: sizes, posting list shapes,
+    # and per-phase latencies (`find_count`, `find_p99_ns`, ...).
+    #
+    # @returns a Hash of Symbol names to Integer values.
+    def stats
+      pairs = send_cmd_and_get_results(['STATS', @db_name]).each_slice(2)
+      Hash[pairs.map { |name, value| [name.to_sym, value.to_i] }]
+    end
+
+    # Client-side statistics of the connection pool: connections in use,
+    # time spent waiting for one, and request latencies (see
+    # {Blurrily::ConnectionPool#stats}), plus :reconnects and :timeouts.
+    #
+    # @returns a Hash of Symbol names to Integer values.
+    def pool_stats
+      { :reconnects => 0, :timeouts => 0 }.merge(@pool.stats)
+    end
+
+    # Closes idle connections.
+    def close
+      @pool.shutdown
+    end
+
 
     private
 
@@ -110,23 +209,48 @@ module Blurrily
     end
 
 
-    def connection
-      @connection ||= TCPSocket.new(@host, @port)
+    Disconnected = Class.new(Error)
+
+    # Sends <line> and reads the reply on a pooled connection. When the
+    # server closed it (say, because it restarted), idle connections opened
+    # before are just as dead: they are dropped, and the request sent again
+    # once on a fresh connection; all commands are safe to repeat.
+    def request(line)
+      retried = false
+      begin
+        @pool.with do |connection|
+          connection.puts line
+          read_reply(connection) or raise Disconnected, 'Server disconnected'
+        end
+      rescue Disconnected, SystemCallError, IOError => error
+        raise Error, error.message if retried
+        retried = true
+        @pool.discard_idle(Time.now)
+        @pool.count(:reconnects)
+        retry
+      rescue ConnectionPool::Error => error
+        raise Error, error.message
+      end
+    end
+
+    def read_reply(connection)
+      return connection.gets unless @read_timeout
+      Timeout.timeout(@read_timeout) { connection.gets }
+    rescue Timeout::Error
+      @pool.count(:timeouts)
+      raise Error, 'Timed out waiting for the server'
     end
 
     def send_cmd_and_get_results(argv)
-      output = argv.join("\t")
-      connection.puts output
-      input = connection.gets
+      input = request(argv.join("\t"))
+      Thread.current[@truncated_key] = input.start_with?("PARTIAL")
       case input
-      when "OK\n"
+      when "OK\n", "PARTIAL\n"
         return []
-      when /^OK\t(.*)\n/
-        return $1.split("\t")
+      when /^(?:OK|PARTIAL)\t(.*)\n/
+        return $1.split("\t", -1)
       when /^ERROR\t(.*)\n/
         raise Error, $1
-      when nil
-        raise Error, 'Server disconnected'
       else
         raise Error, 'Server did not respect protocol'
       end
@@ -5,49 +5,209 @@ module Blurrily
   class CommandProcessor
     ProtocolError = Class.new(StandardError)
 
-    def initialize(map_group)
-      @map_group = map_group
+    # @param options :budget, posting entries each FIND may read at most, and
+    #          :timeout, seconds after which it stops reading posting lists
+    #          (see Map#find).
+    #        :read_only, whether to refuse PUT, DELETE and CLEAR.
+    #        :replication, a Replication::Primary or Follower whose stats
+    #          STATS reports.
+    #        :metrics, a Metrics recording each command and its latency.
+    #        :slow_query, seconds past which a command is written to the
+    #          :slow_log IO (default $stderr), with how its find went when it
+    #          is a FIND or PREFIX (see Map#find's :explain).
+    def initialize(map_group, options = {})
+      @map_group    = map_group
+      @read_only    = options.fetch(:read_only, false)
+      @replication  = options[:replication]
+      @metrics      = options[:metrics]
+      @slow_ns      = options[:slow_query] && (options[:slow_query] * 1e9).to_i
+      @slow_log     = options.fetch(:slow_log, $stderr)
+      @find_options = {}
+      @find_options[:budget]  = options[:budget]  if options[:budget]
+      @find_options[:timeout] = options[:timeout] if options[:timeout]
+      @last_writes = Hash.new { |hash, client| hash[client] = Hash.new(0) }
     end
 
-    def process_command(line)
+    # @param client identifies the connection <line> came from. Writes may
+    #   be queued (see MapGroup#put), but a client always reads its own
+    #   writes: FIND and STATS first apply the queue of a map the client
+    #   wrote to since it was last applied.
+    def process_command(line, client = nil)
+      started_at = now_ns if @metrics || @slow_ns
+      @explained = nil
+      valid_name = nil
+      error = true
       command, map_name, *args = line.split(/\t/)
       raise ProtocolError, 'Unknown command' unless COMMANDS.include? command
-      raise ProtocolError, 'Invalid database name' unless map_name =~ /^[a-z_]+$/
+      raise ProtocolError, 'Invalid database name' unless map_name =~ (command == 'FINDM' ? /^[a-z_]+(,[a-z_]+)*$/ : /^[a-z_]+$/)
+      valid_name = map_name
+      raise ProtocolError, 'Read-only replica' if @read_only && WRITE_COMMANDS.include?(command)
+      @status = 'OK'
+      @client = client
       result = send("on_#{command}", map_name, *args)
-      ['OK', *result].compact.join("\t")
+      error = false
+      [@status, *result].compact.join("\t")
     rescue ArgumentError, ProtocolError => e
       ['ERROR', e.message].join("\t")
+    ensure
+      elapsed = now_ns - started_at if started_at
+      record(command, valid_name, elapsed, error) if @metrics
+      log_slow(line, elapsed) if @slow_ns && elapsed >= @slow_ns
+    end
+
+    # Forgets a disconnected client.
+    def forget(client)
+      @last_writes.delete(client)
     end
 
     private
 
-    COMMANDS = %w(FIND PUT DELETE CLEAR)
+    COMMANDS = %w(FIND FINDM PREFIX PUT DELETE CLEAR STATS)
+    WRITE_COMMANDS = %w(PUT DELETE CLEAR)
 
     def on_PUT(map_name, needle, ref, weight = nil)
       raise ProtocolError, 'Invalid reference' unless ref =~ /^\d+$/ && REF_RANGE.include?(ref.to_i)
       raise ProtocolError, 'Invalid weight'    unless weight.nil? || (weight =~ /^\d+$/ && WEIGHT_RANGE.include?(weight.to_i))
 
-      @map_group.map(map_name).put(*[needle, ref.to_i, weight.to_i].compact)
+      @last_writes[@client][map_name] = @map_group.put(map_name, needle, ref.to_i, weight && weight.to_i)
       return
     end
 
     def on_DELETE(map_name, ref)
       raise ProtocolError, 'Invalid reference' unless ref =~ /^\d+$/ && REF_RANGE.include?(ref.to_i)
 
-      @map_group.map(map_name).delete(ref.to_i)
+      @last_writes[@client][map_name] = @map_group.delete(map_name, ref.to_i)
       return
     end
 
-    def on_FIND(map_name, needle, limit = nil)
+    # Replies PARTIAL instead of OK when given a budget that ran out.
+    def on_FIND(map_name, needle, limit = nil, rerank = nil, budget = nil)
+      options = find_options(limit, rerank, budget)
+      map     = read_your_writes(map_name)
+
+      results = explain(map.find(needle, (limit || LIMIT_DEFAULT).to_i, options)).flatten
+      @status = 'PARTIAL' if budget && map.truncated?
+      return results unless options[:rerank]
+
+      # unknown distances are sent as empty fields
+      results.map(&:to_s)
+    end
+
+    # Same as FIND over several comma-separated maps; each result is
+    # followed by the name of its map.
+    def on_FINDM(map_names, needle, limit = nil, rerank = nil, budget = nil)
+      options = find_options(limit, rerank, budget)
+      names   = map_names.split(',')
+      names.each { |name| read_your_writes(name) }
+
+      results = @map_group.find_across(names, needle, (limit || LIMIT_DEFAULT).to_i, options).flatten
+      @status = 'PARTIAL' if budget && @map_group.truncated?
+      results.map(&:to_s)
+    end
+
+    # Same as FIND for strings starting with the needle, as users type it.
+    def on_PREFIX(map_name, needle, limit = nil)
+      options = find_options(limit, nil, nil).merge(:prefix => true)
+      explain(read_your_writes(map_name).find(needle, (limit || LIMIT_DEFAULT).to_i, options)).flatten
+    end
+
+    def find_options(limit, rerank, budget)
+      rerank = nil if rerank && rerank.empty?
       raise ProtocolError, 'Limit must be a number' if limit && !LIMIT_RANGE.include?(limit.to_i)
+      raise ProtocolError, 'Rerank must be a number' if rerank && !LIMIT_RANGE.include?(rerank.to_i)
+      raise ProtocolError, 'Budget must be a number' if budget && budget !~ /^\d+$/
+
+      options = @find_options.dup
+      options[:rerank] = rerank.to_i if rerank
+      options[:budget] = budget.to_i if budget
+      options[:explain] = true if @slow_ns
+      options
+    end
 
-      results = @map_group.map(map_name).find(*[needle, limit && limit.to_i].compact)
-      return results.flatten
+    # Keeps how an explained find went for the slow query log, and returns
+    # its results.
+    def explain(found)
+      return found unless found.kind_of?(Hash)
+      @explained = found
+      found[:results]
+    end
+
+    # Writes one line: the time, duration and <line> of a slow command,
+    # followed by how its find went if explained.
+    def log_slow(line, nanoseconds)
+      fields = [Time.now.utc.strftime('%Y-%m-%dT%H:%M:%S.%LZ'), format('%.3fms', nanoseconds / 1e6), line.inspect]
+      if @explained
+        fields << "needle=#{@explained[:needle].inspect}"
+        fields << "trigrams=#{@explained[:trigrams].map { |trigram, length| "#{trigram}:#{length}" }.join(',')}"
+        [:entries, :candidates, :sorted_lists].each { |name| fields << "#{name}=#{@explained[name]}" }
+        [:cached, :by_weight].each { |name| fields << "#{name}=#{@explained[name] ? 1 : 0}" }
+        @explained[:phases].each { |name, ns| fields << "#{name}_ns=#{ns}" unless ns.zero? }
+      end
+      @slow_log.puts(fields.join(' '))
     end
 
     def on_CLEAR(map_name)
       @map_group.clear(map_name)
       return
     end
+
+    # Replies with tab-separated name/value pairs.
+    def on_STATS(map_name)
+      stats  = read_your_writes(map_name).stats(true)
+      lists  = stats.delete(:lists)
+      phases = stats.delete(:phases)
+
+      result = stats.to_a
+      result << ['lists', lists[:count]] << ['dirty_lists', lists[:dirty]]
+      result << ['list_buckets', lists[:buckets]] << ['list_slack', lists[:slack]]
+      lists[:lengths].each_with_index do |count, power|
+        result << ["lists_#{1 << power}", count] unless count.zero?
+      end
+      phases.each do |name, timing|
+        result << ["#{name}_count", timing[:count]] << ["#{name}_ns", timing[:total_ns]]
+        result << ["#{name}_p50_ns", percentile(timing[:histogram], 0.50)]
+        result << ["#{name}_p99_ns", percentile(timing[:histogram], 0.99)]
+      end
+      saves = @map_group.save_stats(map_name)
+      result << ['saves', saves[:saves]] << ['save_failures', saves[:failures]]
+      result << ['save_ns', saves[:save_ns]] << ['save_stall_ns', saves[:stall_ns]]
+      @map_group.stats.each do |name, value|
+        result << ["group_#{name}", value]
+      end
+      (@replication ? @replication.stats : {}).each do |name, value|
+        result << ["replication_#{name}", value]
+      end
+      result.flatten
+    end
+
+    def record(command, map_name, nanoseconds, error)
+      if command == 'FINDM' && map_name
+        @metrics.request(command, nil, nanoseconds, error)
+        map_name.split(',').each { |name| @metrics.map_request(command, name) }
+      else
+        @metrics.request(command, map_name, nanoseconds, error)
+      end
+    end
+
+    def now_ns
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    end
+
+    def read_your_writes(map_name)
+      written = @last_writes.key?(@client) ? @last_writes[@client][map_name] : 0
+      @map_group.flush(map_name) if written > @map_group.applied(map_name)
+      @map_group.map(map_name)
+    end
+
+    # Upper bound of the log2 histogram bucket holding the <ratio> percentile.
+    def percentile(histogram, ratio)
+      total = histogram.inject(0, :+)
+      return 0 if total.zero?
+      seen = 0
+      histogram.each_with_index do |count, power|
+        seen += count
+        return 1 << (power + 1) if seen >= ratio * total
+      end
+    end
   end
 end
@@ -0,0 +1,182 @@
+# encoding: utf-8
+
+require 'socket'
+require 'thread'
+require 'timeout'
+
+module Blurrily
+  # A thread-safe pool of persistent connections to one or more servers.
+  #
+  # Connections are opened lazily, up to `:size` of them, each to the next
+  # address in turn. Threads wait for a connection to be returned when all
+  # are busy.
+  class ConnectionPool
+    Error = Class.new(RuntimeError)
+
+    COUNTERS = [:checkouts, :busy_ns, :busy_max_ns, :waits, :wait_ns, :connects, :connect_failures]
+
+    # @param addresses Array of [host, port] pairs.
+    # @param options :size (connections, default 5), :timeout (seconds to
+    #          wait for a free connection, default 5), :connect_timeout
+    #          (seconds, default none).
+    def initialize(addresses, options = {})
+      raise ArgumentError, 'no server address' if addresses.empty?
+      @addresses       = addresses
+      @size            = options.fetch(:size, 5)
+      @timeout         = options.fetch(:timeout, 5)
+      @connect_timeout = options[:connect_timeout]
+      @idle            = []
+      @opened_at       = {}.compare_by_identity
+      @created         = 0
+      @next_address    = 0
+      @mutex           = Mutex.new
+      @available       = ConditionVariable.new
+      @counters        = Hash.new(0)
+    end
+
+    # Yields a connection, which goes back to the pool afterwards. If the
+    # block raises, the connection is closed instead, as it may be left
+    # half-way through a reply.
+    def with
+      connection = checkout
+      started = Time.now
+      begin
+        result = yield connection
+      rescue Exception
+        discard(connection)
+        raise
+      ensure
+        busy((Time.now - started) * 1e9)
+      end
+      checkin(connection)
+      result
+    end
+
+    # Closes idle connections. Busy ones stay open.
+    def shutdown
+      discard_idle
+    end
+
+    # Closes idle connections opened before <time> (all by default), say
+    # because the server restarted since and they are all dead.
+    def discard_idle(time = nil)
+      @mutex.synchronize do
+        stale, @idle = @idle.partition { |connection| time.nil? || @opened_at[connection] < time }
+        stale.each do |connection|
+          connection.close rescue nil
+          @opened_at.delete(connection)
+        end
+        @created -= stale.size
+        @available.signal unless stale.empty?
+      end
+    end
+
+    # Adds <value> to counter <name>.
+    def count(name, value = 1)
+      @mutex.synchronize { @counters[name] += value }
+    end
+
+    # @return Hash of connections in the pool (:size, :busy, :idle), and
+    #   counters: :checkouts, time connections were held (:busy_ns, and
+    #   :busy_max_ns for the longest), :waits and :wait_ns for threads
+    #   that found none free, :connects, :connect_failures, and whatever
+    #   was passed to #count.
+    def stats
+      @mutex.synchronize do
+        counters = Hash[COUNTERS.map { |name| [name, 0] }].merge(@counters)
+        counters.merge(:size => @size, :busy => @created - @idle.size, :idle => @idle.size)
+      end
+    end
+
+
+    private
+
+
+    def checkout
+      started = nil
+      deadline = nil
+      @mutex.synchronize do
+        loop do
+          return @idle.pop unless @idle.empty?
+          break if @created < @size
+
+          started  ||= Time.now
+          deadline ||= started + @timeout
+          remaining = deadline - Time.now
+          raise Error, 'Timed out waiting for a connection' if remaining <= 0
+          @counters[:waits] += 1
+          @available.wait(@mutex, remaining)
+          @counters[:wait_ns] += ((Time.now - started) * 1e9).to_i
+          started = Time.now
+        end
+        @created += 1
+      end
+
+      begin
+        connection = connect
+        @mutex.synchronize { @opened_at[connection] = Time.now }
+        connection
+      rescue Exception
+        @mutex.synchronize do
+          @created -= 1
+          @available.signal
+        end
+        raise
+      end
+    end
+
+    def busy(nanoseconds)
+      nanoseconds = nanoseconds.to_i
+      @mutex.synchronize do
+        @counters[:checkouts] += 1
+        @counters[:busy_ns]   += nanoseconds
+        @counters[:busy_max_ns] = nanoseconds if nanoseconds > @counters[:busy_max_ns]
+      end
+    end
+
+    def checkin(connection)
+      @mutex.synchronize do
+        @idle.push(connection)
+        @available.signal
+      end
+    end
+
+    def discard(connection)
+      connection.close rescue nil
+      @mutex.synchronize do
+        @opened_at.delete(connection)
+        @created -= 1
+        @available.signal
+      end
+    end
+
+    # Tries each address once, starting with the one after the last used.
+    def connect
+      last_error = nil
+      @addresses.size.times do
+        host, port = next_address
+        begin
+          connection = open_socket(host, port)
+          count(:connects)
+          return connection
+        rescue SystemCallError, SocketError, Timeout::Error => last_error
+          count(:connect_failures)
+        end
+      end
+      raise Error, "Cannot connect: #{last_error.message}"
+    end
+
+    def next_address
+      @mutex.synchronize do
+        address = @addresses[@next_address % @addresses.size]
+        @next_address += 1
+        address
+      end
+    end
+
+    def open_socket(host, port)
+      return TCPSocket.new(host, port) unless @connect_timeout
+      Timeout.timeout(@connect_timeout) { TCPSocket.new(host, port) }
+    end
+  end
+end
@@ -0,0 +1,247 @@
+# encoding: utf-8
+
+require 'socket'
+require 'thread'
+require 'blurrily/defaults'
+
+module Blurrily
+  # Drives a Blurrily::Server with many concurrent connections, and reports
+  # throughput and latency percentiles.
+  #
+  # With a target :rate, requests are scheduled open-loop: the i-th request
+  # is due at start + i / rate whether or not earlier ones were answered,
+  # and its latency is counted from when it was due. A stalled server thus
+  # shows up in the percentiles, instead of silently slowing the load down
+  # (coordinated omission). Without a rate, each connection sends its next
+  # request as soon as it has a reply.
+  class LoadGenerator
+    Error = Class.new(RuntimeError)
+
+    # Histogram of nanosecond values with buckets about 1.5% wide, in the
+    # manner of HdrHistogram: each power of two is split in SUB_BUCKETS
+    # linear buckets.
+    class Histogram
+      SUB_BUCKETS = 64
+      MAX_POWER   = 42  # values past 2**48 (three days) share the last bucket
+
+      attr_reader :count, :max
+
+      def initialize
+        @counts = Array.new((MAX_POWER + 1) * SUB_BUCKETS, 0)
+        @count  = 0
+        @max    = 0
+      end
+
+      def record(value)
+        value = 0 if value < 0
+        @counts[index_of(value)] += 1
+        @count += 1
+        @max = value if value > @max
+      end
+
+      def merge(other)
+        other.each_bucket { |index, count| @counts[index] += count }
+        @count += other.count
+        @max = other.max if other.max > @max
+        self
+      end
+
+      # @return the value below which <ratio> of the values fall.
+      def percentile(ratio)
+        return 0 if @count.zero?
+        wanted = (ratio * @count).ceil
+        wanted = 1 if wanted < 1
+        seen = 0
+        @counts.each_with_index do |count, index|
+          seen += count
+          return [highest_of(index), @max].min if seen >= wanted
+        end
+        @max
+      end
+
+      protected
+
+      def each_bucket
+        @counts.each_with_index { |count, index| yield index, count unless count.zero? }
+      end
+
+      private
+
+      # values below 2 * SUB_BUCKETS have their own bucket; above, the
+      # power of two picks a range and the top bits a bucket in it
+      def index_of(value)
+        shift = value.bit_length - 7
+        return value if shift <= 0
+        index = (shift + 1) * SUB_BUCKETS + (value >> shift) - SUB_BUCKETS
+        index < @counts.size ? index : @counts.size - 1
+      end
+
+      def highest_of(index)
+        return index if index < 2 * SUB_BUCKETS
+        shift = index / SUB_BUCKETS - 1
+        ((index % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1
+      end
+    end
+
+
+    # @param options :host and :port of the server.
+    #        :connections, number of concurrent connections (default 16).
+    #        :rate, requests per second to schedule, nil to send as fast as
+    #          the server answers.
+    #        :duration, seconds to run for, or :requests, number to send.
+    #        :source, responds to #next_command(random) with a command line
+    #          (see Mix and Replay).
+    def initialize(options = {})
+      @host        = options.fetch(:host, DEFAULT_HOST)
+      @port        = options.fetch(:port, DEFAULT_PORT)
+      @connections = options.fetch(:connections, 16)
+      @rate        = options[:rate]
+      @duration    = options[:duration]
+      @requests    = options[:requests]
+      @source      = options.fetch(:source)
+      raise ArgumentError, 'needs a :duration or a number of :requests' unless @duration || @requests
+    end
+
+    # Runs the load, and returns a Hash with the :requests sent, :errors
+    # received, :elapsed seconds, :throughput in requests per second, and
+    # a Histogram of latencies in nanoseconds per command (:latencies) and
+    # overall (:latency).
+    def run
+      @mutex   = Mutex.new
+      @next    = 0
+      @started = now_ns
+      @stop_at = @duration && @started + (@duration * 1e9).to_i
+      sockets  = Array.new(@connections) { TCPSocket.new(@host, @port) }
+
+      results = sockets.each_with_index.map do |socket, index|
+        Thread.new { drive(socket, Random.new(index)) }
+      end.map(&:value)
+      elapsed = (now_ns - @started) / 1e9
+
+      latencies = Hash.new { |hash, command| hash[command] = Histogram.new }
+      errors = 0
+      results.each do |result|
+        result[:latencies].each { |command, histogram| latencies[command].merge(histogram) }
+        errors += result[:errors]
+      end
+      latency = latencies.values.inject(Histogram.new) { |total, histogram| total.merge(histogram) }
+
+      { :requests => latency.count, :errors => errors, :elapsed => elapsed,
+        :throughput => elapsed > 0 ? latency.count / elapsed : 0,
+        :latency => latency, :latencies => latencies }
+    ensure
+      (sockets || []).each { |socket| socket.close rescue nil }
+    end
+
+    # Summarises the result of #run in lines of text.
+    def self.report(result)
+      lines = []
+      lines << format('%d requests in %.2fs, %.1f req/s, %d errors',
+        result[:requests], result[:elapsed], result[:throughput], result[:errors])
+      rows = [['all', result[:latency]]] + result[:latencies].sort
+      rows.each do |name, histogram|
+        lines << format('%-7s %8d  p50 %9s  p99 %9s  p99.9 %9s  max %9s', name, histogram.count,
+          *[0.5, 0.99, 0.999].map { |ratio| duration(histogram.percentile(ratio)) }, duration(histogram.max))
+      end
+      lines
+    end
+
+    def self.duration(nanoseconds)
+      return format('%.0fus', nanoseconds / 1e3) if nanoseconds < 1_000_000
+      format('%.2fms', nanoseconds / 1e6)
+    end
+
+
+    # Generates commands from a mix of kinds and a list of needles.
+    class Mix
+      # @param weights Hash of :find, :put and :delete to relative weights.
+      # @param options :db_name, :needles (Array of strings), :references
+      #          (range of references to put and delete), :limit.
+      def initialize(weights, options = {})
+        @kinds = []
+        weights.each { |kind, weight| weight.to_i.times { @kinds << kind.to_sym } }
+        raise ArgumentError, 'empty mix' if @kinds.empty?
+        @db_name    = options.fetch(:db_name, DEFAULT_DATABASE)
+        @needles    = options.fetch(:needles) { self.class.words(1000) }
+        @references = options.fetch(:references, 1..100_000)
+        @limit      = options.fetch(:limit, LIMIT_DEFAULT)
+      end
+
+      def next_command(random)
+        needle = @needles[random.rand(@needles.size)]
+        case @kinds[random.rand(@kinds.size)]
+        when :find   then "FIND\t#{@db_name}\t#{needle}\t#{@limit}"
+        when :put    then "PUT\t#{@db_name}\t#{needle}\t#{random.rand(@references)}"
+        when :delete then "DELETE\t#{@db_name}\t#{random.rand(@references)}"
+        end
+      end
+
+      # <count> pronounceable made-up words, so no dictionary is needed.
+      def self.words(count, random = Random.new(0))
+        consonants, vowels = 'bcdfghjklmnprstvz', 'aeiou'
+        Array.new(count) do
+          Array.new(2 + random.rand(3)) { consonants[random.rand(consonants.size)] + vowels[random.rand(vowels.size)] }.join
+        end
+      end
+    end
+
+
+    # Replays the command lines of a log, in order, looping over it.
+    class Replay
+      def initialize(lines)
+        @lines = lines.map(&:chomp).reject(&:empty?)
+        raise ArgumentError, 'empty log' if @lines.empty?
+        @mutex = Mutex.new
+        @index = 0
+      end
+
+      def next_command(random)
+        @mutex.synchronize do
+          line = @lines[@index % @lines.size]
+          @index += 1
+          line
+        end
+      end
+    end
+
+
+    private
+
+    def drive(socket, random)
+      latencies = Hash.new { |hash, command| hash[command] = Histogram.new }
+      errors = 0
+
+      while (due = next_slot)
+        command = @source.next_command(random)
+        wait_until(due) if @rate
+        sent_at = @rate ? due : now_ns
+        socket.write(command + "\n")
+        reply = socket.gets or raise Error, 'Server disconnected'
+        latencies[command[/\A[A-Z]+/] || 'unknown'].record(now_ns - sent_at)
+        errors += 1 if reply.start_with?('ERROR')
+      end
+      { :latencies => latencies, :errors => errors }
+    end
+
+    # Claims the next request, returning when it is due (in nanoseconds),
+    # or nil when the run is over.
+    def next_slot
+      @mutex.synchronize do
+        return nil if @requests && @next >= @requests
+        due = @rate ? @started + (@next * 1e9 / @rate).to_i : now_ns
+        return nil if @stop_at && due >= @stop_at
+        @next += 1
+        due
+      end
+    end
+
+    def wait_until(due)
+      delay = due - now_ns
+      sleep(delay / 1e9) if delay > 0
+    end
+
+    def now_ns
+      Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+    end
+  end
+end
@@ -4,6 +4,10 @@ require 'active_support/core_ext/string/multibyte' # mb_chars
 
 module Blurrily
   class Map < RawMap
+    # needles made of these need no normalizing; other characters become
+    # spaces (see RawMap::ALPHABET)
+    PLAIN_NEEDLE    = /^[#{ALPHABET} ]+$/
+    NOT_IN_ALPHABET = /[^#{ALPHABET}]/
 
     def put(needle, reference, weight=nil)
       weight ||= 0
@@ -12,9 +16,60 @@ module Blurrily
       super(needle, reference, weight)
     end
 
-    def find(needle, limit=10)
+    # @param options :rerank, number of best candidates to re-order by edit
+    #          distance to the needle, which is then appended to each result
+    #          (needles must have been kept, see #keep_needles=).
+    #          :budget, posting entries to read at most, and :timeout,
+    #          seconds after which to stop reading posting lists; reading
+    #          starts with the shortest lists, and #truncated? tells whether
+    #          the results only cover part of the needle.
+    #          :filter, a Blurrily::Filter (or an Array) of the only
+    #          references to return, and :min_weight and :max_weight, bounds
+    #          of the weights to return. Both apply before the <limit>.
+    #          :similarity, :dice, :jaccard or :cosine to rank results by
+    #          the similarity of their trigrams to the needle's rather than
+    #          by shared trigrams alone; the score, between 0 and 1, is then
+    #          appended to each result.
+    #          :prefix, to find strings starting with the needle, as it is
+    #          typed: its last word is not anchored at its end, and its
+    #          first trigrams only match the start of references once
+    #          #index_prefixes= covers them all (references put before it
+    #          was set are indexed from their kept needles, if any).
+    #          :explain, to return a Hash describing the find instead: the
+    #          :results, the normalized :needle, its :trigrams as pairs of
+    #          trigram ('*' for spaces and anchors) and posting list length,
+    #          the posting :entries read, the distinct :candidates among
+    #          them, the :sorted_lists merged on demand, whether it was
+    #          :cached or read lists :by_weight, and nanoseconds per phase
+    #          (:phases).
+    def find(needle, limit=10, options={})
       needle = normalize_string needle
-      super(needle, limit)
+      super(needle, limit, Map.find_options(options))
+    end
+
+    # Same as #find, but returns the results as one packed binary string
+    # (see RawMap::PACKED_MATCH_SIZE and RawMap.packed_references), which
+    # avoids allocating objects per result. Pass a +buffer+ string to reuse
+    # it across calls.
+    def find_packed(needle, limit=10, options={}, buffer=nil)
+      needle = normalize_string needle
+      super(needle, limit, Map.find_options(options), buffer)
+    end
+
+    # Finds <needle> in each of <maps> at once (see #find for <options>),
+    # tokenising it once and searching large maps in parallel threads.
+    # Returns the best <limit> results overall, each followed by the index
+    # of its map in <maps>.
+    def self.find_across(maps, needle, limit=10, options={})
+      needle = normalize_string needle
+      super(maps, needle, limit, find_options(options))
+    end
+
+    # <options> with an Array :filter turned into a Filter. Build the Filter
+    # once to reuse it across finds.
+    def self.find_options(options)
+      return options unless options && options[:filter].kind_of?(Array)
+      options.merge(:filter => Filter.new(options[:filter]))
     end
 
     def delete(*args)
@@ -22,6 +77,25 @@ module Blurrily
       super(*args)
     end
 
+    # Same as calling #put with each of <puts>, an Array of [needle,
+    # reference, weight] (weight optional), but grows each posting list
+    # only once.
+    def put_batch(puts)
+      @clean_path = nil
+      super(puts.map { |needle, reference, weight| [normalize_string(needle), reference, weight || 0] })
+    end
+
+    # Same as calling #delete with each of <references>, in one pass.
+    def delete_batch(references)
+      @clean_path = nil
+      super(references)
+    end
+
+    def merge(other)
+      @clean_path = nil
+      super(other)
+    end
+
     def save(path)
       return if @clean_path == path
       super(path)
@@ -29,21 +103,55 @@ module Blurrily
       nil
     end
 
-    def self.load(path)
-      super(path).tap do |map|
-        map.instance_variable_set :@clean_path, path
+    # Saves a copy-on-write snapshot of the map from a forked child process.
+    # Returns the child's pid, or nil when the map is already saved to <path>.
+    # Changes made after this call will be saved next time; call
+    # #save_failed if the child does not succeed.
+    def save_in_background(path)
+      return if @clean_path == path
+      pid = Process.fork do
+        begin
+          save(path)
+          exit!(0)
+        rescue Exception
+          exit!(1)
+        end
       end
+      @clean_path = path
+      pid
     end
 
-    private
+    # Whether the map, as it is now, is saved (or being saved) to <path>.
+    def saved?(path)
+      @clean_path == path
+    end
 
-    def normalize_string(needle)
+    def save_failed(path)
+      @clean_path = nil if @clean_path == path
+    end
+
+    # @param options :mode, how the file is paged into memory: :lazy (the
+    #          default), :populate, :willneed, :random, :lock or :hugepages.
+    def self.load(path, options = {})
+      super(path, options).tap do |map|
+        map.instance_variable_set :@clean_path, path
+      end
+    end
+
+    def self.normalize_string(needle)
       result = needle.downcase
-      unless result =~ /^([a-z ])+$/
-        result = ActiveSupport::Multibyte::Chars.new(result).mb_chars.normalize(:kd).gsub(/[^\x00-\x7F]/,'').to_s.gsub(/[^a-z]/,' ')
+      unless result =~ PLAIN_NEEDLE
+        result = ActiveSupport::Multibyte::Chars.new(result).mb_chars.normalize(:kd).gsub(/[^\x00-\x7F]/,'').to_s.gsub(NOT_IN_ALPHABET,' ')
         # result = result.mb_chars.normalize(:kd).gsub(/[^\x00-\x7F]/,'').to_s.gsub(/[^a-z]/,' ')
       end
       result.gsub(/\s+/,' ').strip
     end
+    private_class_method :normalize_string
+
+    private
+
+    def normalize_string(needle)
+      Map.send(:normalize_string, needle)
+    end
   end
 end
@@ -3,37 +3,348 @@ require 'blurrily/map'
 
 module Blurrily
   class MapGroup
+    attr_reader :directory
 
-    def initialize(directory = nil)
-      @directory = Pathname.new(directory || Dir.pwd)
-      @maps = {}
+    # @param directory where maps are loaded from and saved to.
+    # @param options :cache_size, bytes of find results cached per map
+    #          (default 0, no caching).
+    #        :memory_budget, bytes of memory (mapped and heap) maps may use
+    #          before the least recently used ones are saved and closed
+    #          (default 0, no limit).
+    #        :load_mode, how map files are paged into memory (see Map.load).
+    #        :keep_needles, whether maps keep needles for re-ranking
+    #          (default false).
+    #        :index_prefixes, whether maps index the start of needles for
+    #          prefix finds (default false).
+    #        :order_by_weight, whether maps keep their posting lists in
+    #          weight order too, for faster finds (default false).
+    #        :write_batch, number of writes queued by #put and #delete
+    #          before they are applied together (default 0, apply at once).
+    def initialize(directory = nil, options = {})
+      @directory  = Pathname.new(directory || Dir.pwd)
+      @cache_size = options.fetch(:cache_size, 0)
+      @budget     = options.fetch(:memory_budget, 0)
+      @load_mode  = options.fetch(:load_mode, :lazy)
+      @needles    = options.fetch(:keep_needles, false)
+      @prefixes   = options.fetch(:index_prefixes, false)
+      @by_weight  = options.fetch(:order_by_weight, false)
+      @batch      = options.fetch(:write_batch, 0)
+      @maps = {}    # least recently used first
+      @counters = { :hits => 0, :misses => 0, :evictions => 0, :batches => 0 }
+      @saves = {}   # map name => in-flight background save
+      @save_stats = Hash.new { |hash, name| hash[name] = new_save_stats }
+      @queues  = Hash.new { |hash, name| hash[name] = [] }
+      @written = Hash.new(0)  # map name => sequence number of the last write
+      @applied = Hash.new(0)  # map name => sequence number of the last write applied
+      @listeners = []
+      @pinned = []  # names of maps #evict must keep
     end
 
     def map(name)
-      @maps[name] ||= load_map(name) || Map.new
+      map = @maps.delete(name)
+      if map
+        @counters[:hits] += 1
+        return @maps[name] = map
+      end
+
+      @counters[:misses] += 1
+      @maps[name] = configure(load_map(name) || Map.new)
+      evict
+      @maps[name]
+    end
+
+    # Finds <needle> in each of the maps <names> in one go (see Map#find
+    # for <options>), and returns the best <limit> results overall, each
+    # followed by the name of its map. #truncated? tells whether any map
+    # ran out of budget.
+    def find_across(names, needle, limit = 10, options = {})
+      names = names.uniq
+      @pinned = names
+      maps = names.map { |name| map(name) }
+      @truncated = false
+      results = Map.find_across(maps, needle, limit, options)
+      @truncated = maps.first.truncated? unless maps.empty?
+      results.each { |result| result[-1] = names[result[-1]] }
+    ensure
+      @pinned = []
+    end
+
+    # Whether the last #find_across ran out of budget.
+    def truncated?
+      !!@truncated
+    end
+
+    # Queues a put to the map <name>, applied at the latest once
+    # :write_batch writes are queued or on the next #flush.
+    #
+    # @return the sequence number of the write (see #applied).
+    def put(name, needle, reference, weight = nil)
+      write(name, [:put, needle, reference, weight])
+    end
+
+    # Queues a delete, as #put does.
+    def delete(name, reference)
+      write(name, [:delete, reference])
+    end
+
+    # Applies queued writes (to all maps, or to <name>), coalescing
+    # consecutive puts and deletes into batches.
+    def flush(name = nil)
+      (name ? [name] : @queues.keys).each do |key|
+        apply(key, map(key)) if @queues.key?(key)
+      end
+    end
+
+    # Calls <block> with the map name and the operation, as [:put, needle,
+    # reference, weight], [:delete, reference] or [:clear], for each write
+    # as it is applied.
+    def on_apply(&block)
+      @listeners << block
+    end
+
+    # @return Hash of the maps in memory, by name.
+    def open_maps
+      @maps.dup
+    end
+
+    # Names of the maps open or saved in the directory.
+    def names
+      saved = Pathname.glob(@directory.join('*.trigrams')).map { |path| path.basename('.trigrams').to_s }
+      (@maps.keys | saved).sort
+    end
+
+    # Saves the map <name> with its queued writes applied.
+    # @return the Pathname of its file.
+    def snapshot(name)
+      @directory.mkpath
+      map = map(name)
+      apply(name, map)
+      wait(name)
+      save_now(name, map)
+      path_for(name)
+    end
+
+    # Same as #snapshot, but saves from a forked child where possible, and
+    # returns at once; the file is complete once #saving? is false. A save
+    # of the map already under way is reused if the map has not changed
+    # since it started, and waited for otherwise.
+    def snapshot_in_background(name)
+      return snapshot(name) unless Process.respond_to?(:fork)
+      @directory.mkpath
+      map = map(name)
+      apply(name, map)
+      path = path_for(name)
+      return path if @saves.key?(name) && map.saved?(path.to_s)
+      wait(name)
+      save_in_background(name, map)
+      path
+    end
+
+    # Whether the map <name> is being saved in the background.
+    def saving?(name)
+      save = @saves[name] or return false
+      return true if save[:watcher].alive?
+      finish(name, save)
+      false
     end
 
-    def save
+    # Replaces the map <name> by the one saved at <path>, which is moved
+    # into the directory. Queued writes to it are dropped.
+    def install(name, path)
       @directory.mkpath
+      @queues.delete(name)
+      @applied[name] = @written[name]
+      wait(name)
+      File.rename(path.to_s, path_for(name).to_s)
+      map = @maps.delete(name)
+      map.close if map
+      map(name)
+    end
+
+    # @return the sequence number of the last write applied to <name>; a
+    #   write is visible to finds once this reaches its sequence number.
+    def applied(name)
+      @applied[name]
+    end
+
+    # Saves every map to its own file.
+    #
+    # @param options :background, save each map from a forked copy-on-write
+    #          snapshot so the caller only stalls for the fork (default false).
+    #          A map still being saved from a previous call is skipped.
+    def save(options = {})
+      flush
+      @directory.mkpath
+      reap
       @maps.each do |name, map|
-        map.save(path_for(name).to_s)
+        if options[:background] && Process.respond_to?(:fork)
+          save_in_background(name, map) unless @saves.key?(name)
+        else
+          wait(name)
+          save_now(name, map)
+        end
       end
+      evict
+    end
+
+    # Blocks until background saves (of all maps, or of <name>) complete.
+    def wait(name = nil)
+      (name ? [name] : @saves.keys).each do |key|
+        save = @saves[key] or next
+        finish(key, save)
+      end
+    end
+
+    # @return Hash of save metrics for <name>: :saves and :failures counts,
+    #   duration of the last save (:save_ns), and how long the caller was
+    #   blocked by it (:stall_ns).
+    def save_stats(name)
+      reap
+      @save_stats[name].dup
     end
 
     def clear(name)
-      @maps[name] = Map.new
+      @queues.delete(name)
+      @applied[name] = @written[name]
+      wait(name)
+      map = @maps.delete(name)
+      map.close if map
+      @maps[name] = configure(Map.new)
+      notify(name, [:clear])
+      @maps[name]
+    end
+
+    # @return Hash with the number of :maps open, the :bytes they use, the
+    #   :memory_budget, counts of map lookups that found the map open
+    #   (:hits), had to load or create it (:misses), of :evictions and of
+    #   write :batches applied, and the number of writes :queued.
+    def stats
+      queued = @queues.values.inject(0) { |total, queue| total + queue.size }
+      @counters.merge(:maps => @maps.size, :bytes => memory_used, :memory_budget => @budget, :queued => queued)
     end
 
     private
 
+    def configure(map)
+      map.cache_size = @cache_size if @cache_size > 0
+      map.keep_needles = true if @needles
+      map.index_prefixes = true if @prefixes
+      map.order_by_weight = true if @by_weight
+      map
+    end
+
     def load_map(name)
-      Map.load(path_for(name).to_s)
+      Map.load(path_for(name).to_s, :mode => @load_mode)
     rescue Errno::ENOENT
       nil
     end
 
+    def apply(name, map)
+      queue = @queues.delete(name) or return
+      queue.chunk(&:first).each do |kind, writes|
+        if writes.size == 1
+          map.send(kind, *writes.first.drop(1))
+        elsif kind == :put
+          map.put_batch(writes.map { |_, *put| put })
+        else
+          map.delete_batch(writes.map(&:last))
+        end
+        writes.each { |operation| notify(name, operation) }
+      end
+      @applied[name] = @written[name]
+      @counters[:batches] += 1
+    end
+
+    def notify(name, operation)
+      @listeners.each { |listener| listener.call(name, operation) }
+    end
+
+    def write(name, operation)
+      sequence = @written[name] += 1
+      @queues[name] << operation
+      flush(name) if @queues[name].size >= @batch
+      sequence
+    end
+
     def path_for(name)
       @directory.join("#{name}.trigrams")
     end
+
+    # Closes least recently used maps until within budget, saving them first
+    # if changed. The most recently used map is always kept.
+    def evict
+      return if @budget <= 0
+      sizes = Hash[@maps.map { |name, map| [name, map.memsize[:total]] }]
+      total = sizes.values.inject(0, :+)
+
+      (@maps.keys[0...-1] - @pinned).each do |name|
+        break if total <= @budget
+        apply(name, @maps[name])
+        map = @maps.delete(name)
+        wait(name)
+        save_now(name, map)
+        map.close
+        total -= sizes[name]
+        @counters[:evictions] += 1
+      end
+    end
+
+    def memory_used
+      @maps.values.inject(0) { |total, map| total + map.memsize[:total] }
+    end
+
+    def save_now(name, map)
+      started_at = now_ns
+      success    = false
+      map.save(path_for(name).to_s)
+      success    = true
+    ensure
+      duration = now_ns - started_at
+      record_save(name, success, duration, duration)
+    end
+
+    def save_in_background(name, map)
+      started_at = now_ns
+      pid = map.save_in_background(path_for(name).to_s) or return
+      stall = now_ns - started_at
+
+      # the watcher notes the exact time the child exits
+      watcher = Thread.new { [Process.wait2(pid).last, now_ns] }
+      @saves[name] = { :map => map, :watcher => watcher, :started_at => started_at, :stall => stall }
+    end
+
+    # Records background saves that have completed.
+    def reap
+      @saves.to_a.each do |name, save|
+        finish(name, save) unless save[:watcher].alive?
+      end
+    end
+
+    def finish(name, save)
+      status, finished_at = save[:watcher].value
+      @saves.delete(name)
+      save[:map].save_failed(path_for(name).to_s) unless status.success?
+      record_save(name, status.success?, finished_at - save[:started_at], save[:stall])
+    end
+
+    def record_save(name, success, duration, stall)
+      stats = @save_stats[name]
+      stats[:saves]    += 1
+      stats[:failures] += 1 unless success
+      stats[:save_ns]   = duration
+      stats[:stall_ns]  = stall
+    end
+
+    def new_save_stats
+      { :saves => 0, :failures => 0, :save_ns => 0, :stall_ns => 0 }
+    end
+
+    def now_ns
+      if defined?(Process::CLOCK_MONOTONIC)
+        Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      else
+        (Time.now.to_r * 1_000_000_000).to_i
+      end
+    end
   end
-end
\ No newline at end of file
+end
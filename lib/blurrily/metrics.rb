@@ -0,0 +1,186 @@
+module Blurrily
+  # Server-wide counters and latency histograms, rendered in the Prometheus
+  # text exposition format.
+  #
+  # Recording only bumps pre-allocated counters: histograms have fixed
+  # buckets, and per-command and per-map slots are created on first use.
+  class Metrics
+    # upper bounds of the latency buckets, as powers of two nanoseconds
+    # (about 1us, 4us, ... 4.3s)
+    BUCKET_POWERS = (10..32).step(2).to_a
+
+    COMMANDS = %w(FIND FINDM PREFIX PUT DELETE CLEAR STATS)
+
+    def initialize
+      @requests = Hash[COMMANDS.map { |command| [command, new_histogram] }]
+      @errors   = Hash[COMMANDS.map { |command| [command, 0] }]
+      @unknown  = 0
+      @per_map  = Hash.new { |hash, name| hash[name] = Hash[COMMANDS.map { |command| [command, 0] }] }
+      @connections       = 0
+      @connections_total = 0
+      @bytes_in          = 0
+      @bytes_out         = 0
+    end
+
+    # Records a <command> on <map_name> (nil if invalid) that took
+    # <nanoseconds>, and whether it replied with an error.
+    def request(command, map_name, nanoseconds, error)
+      histogram = @requests[command]
+      unless histogram
+        @unknown += 1
+        return
+      end
+
+      bucket = (nanoseconds - 1).bit_length
+      bucket = bucket <= BUCKET_POWERS.first ? 0 : (bucket - BUCKET_POWERS.first + 1) / 2
+      histogram[:buckets][bucket] += 1 if bucket < BUCKET_POWERS.size
+      histogram[:count] += 1
+      histogram[:sum_ns] += nanoseconds
+      @errors[command] += 1 if error
+      map_request(command, map_name) if map_name
+    end
+
+    # Counts a <command> on <map_name> only, for commands spanning maps.
+    def map_request(command, map_name)
+      counts = @per_map[map_name]
+      counts[command] += 1 if counts.key?(command)
+    end
+
+    def connected
+      @connections += 1
+      @connections_total += 1
+    end
+
+    def disconnected
+      @connections -= 1
+    end
+
+    def received(bytes)
+      @bytes_in += bytes
+    end
+
+    def sent(bytes)
+      @bytes_out += bytes
+    end
+
+    # @param map_group whose open maps, queue and saves to describe.
+    # @param replication optional Replication::Primary or Follower.
+    # @return String in the Prometheus text format.
+    def render(map_group, replication = nil)
+      out = []
+
+      family(out, 'requests_total', 'counter', 'Commands processed.')
+      @requests.each { |command, histogram| sample(out, 'requests_total', histogram[:count], :command => command) }
+      sample(out, 'requests_total', @unknown, :command => 'unknown')
+
+      family(out, 'request_errors_total', 'counter', 'Commands that replied with an error.')
+      @errors.each { |command, count| sample(out, 'request_errors_total', count, :command => command) }
+
+      family(out, 'request_duration_seconds', 'histogram', 'Time spent processing commands.')
+      @requests.each do |command, histogram|
+        cumulative = 0
+        BUCKET_POWERS.each_with_index do |power, index|
+          cumulative += histogram[:buckets][index]
+          sample(out, 'request_duration_seconds_bucket', cumulative, :command => command, :le => seconds(1 << power))
+        end
+        sample(out, 'request_duration_seconds_bucket', histogram[:count], :command => command, :le => '+Inf')
+        sample(out, 'request_duration_seconds_sum', seconds(histogram[:sum_ns]), :command => command)
+        sample(out, 'request_duration_seconds_count', histogram[:count], :command => command)
+      end
+
+      family(out, 'map_requests_total', 'counter', 'Commands processed, by map.')
+      @per_map.each do |name, counts|
+        counts.each { |command, count| sample(out, 'map_requests_total', count, :map => name, :command => command) unless count.zero? }
+      end
+
+      gauge(out, 'connections', @connections, 'Open client connections.')
+      counter(out, 'connections_total', @connections_total, 'Client connections accepted.')
+      counter(out, 'received_bytes_total', @bytes_in, 'Bytes read from clients.')
+      counter(out, 'sent_bytes_total', @bytes_out, 'Bytes written to clients.')
+
+      render_group(out, map_group)
+      render_maps(out, map_group)
+      render_replication(out, replication) if replication
+
+      out << ''
+      out.join("\n")
+    end
+
+    private
+
+    def new_histogram
+      { :buckets => Array.new(BUCKET_POWERS.size, 0), :count => 0, :sum_ns => 0 }
+    end
+
+    def render_group(out, map_group)
+      stats = map_group.stats
+      gauge(out, 'open_maps', stats[:maps], 'Maps in memory.')
+      gauge(out, 'open_maps_bytes', stats[:bytes], 'Memory used by open maps.')
+      gauge(out, 'memory_budget_bytes', stats[:memory_budget], 'Memory open maps may use, 0 for no limit.')
+      gauge(out, 'queued_writes', stats[:queued], 'Writes waiting to be applied.')
+      counter(out, 'map_hits_total', stats[:hits], 'Map lookups that found the map open.')
+      counter(out, 'map_misses_total', stats[:misses], 'Map lookups that loaded or created the map.')
+      counter(out, 'map_evictions_total', stats[:evictions], 'Maps closed to stay within the memory budget.')
+      counter(out, 'write_batches_total', stats[:batches], 'Batches of queued writes applied.')
+    end
+
+    def render_maps(out, map_group)
+      maps = map_group.open_maps
+
+      # each map is measured once, as stats and memsize walk its lists
+      stats = Hash[maps.map { |name, map| [name, map.stats.merge(:memsize => map.memsize[:total])] }]
+      family(out, 'map_references', 'gauge', 'References in each open map.')
+      stats.each { |name, map| sample(out, 'map_references', map[:references], :map => name) }
+      family(out, 'map_trigrams', 'gauge', 'Posting entries in each open map.')
+      stats.each { |name, map| sample(out, 'map_trigrams', map[:trigrams], :map => name) }
+      family(out, 'map_bytes', 'gauge', 'Memory used by each open map.')
+      stats.each { |name, map| sample(out, 'map_bytes', map[:memsize], :map => name) }
+      family(out, 'map_cache_hits_total', 'counter', 'FIND results served from the cache.')
+      stats.each { |name, map| sample(out, 'map_cache_hits_total', map.fetch(:cache_hits, 0), :map => name) }
+      family(out, 'map_cache_misses_total', 'counter', 'FIND results not found in the cache.')
+      stats.each { |name, map| sample(out, 'map_cache_misses_total', map.fetch(:cache_misses, 0), :map => name) }
+      family(out, 'map_truncated_total', 'counter', 'FINDs cut short by their budget.')
+      stats.each { |name, map| sample(out, 'map_truncated_total', map.fetch(:truncated, 0), :map => name) }
+
+      saves = Hash[maps.keys.map { |name| [name, map_group.save_stats(name)] }]
+      family(out, 'saves_total', 'counter', 'Saves of each map.')
+      saves.each { |name, stats| sample(out, 'saves_total', stats[:saves], :map => name) }
+      family(out, 'save_failures_total', 'counter', 'Failed saves of each map.')
+      saves.each { |name, stats| sample(out, 'save_failures_total', stats[:failures], :map => name) }
+      family(out, 'save_duration_seconds', 'gauge', 'Duration of the last save of each map.')
+      saves.each { |name, stats| sample(out, 'save_duration_seconds', seconds(stats[:save_ns]), :map => name) }
+      family(out, 'save_stall_seconds', 'gauge', 'Time the last save of each map held up requests.')
+      saves.each { |name, stats| sample(out, 'save_stall_seconds', seconds(stats[:stall_ns]), :map => name) }
+    end
+
+    def render_replication(out, replication)
+      replication.stats.each do |name, value|
+        gauge(out, "replication_#{name}", value, "Replication #{name.to_s.tr('_', ' ')}.")
+      end
+    end
+
+    def family(out, name, type, help)
+      out << "# HELP blurrily_#{name} #{help}"
+      out << "# TYPE blurrily_#{name} #{type}"
+    end
+
+    def gauge(out, name, value, help)
+      family(out, name, 'gauge', help)
+      sample(out, name, value)
+    end
+
+    def counter(out, name, value, help)
+      family(out, name, 'counter', help)
+      sample(out, name, value)
+    end
+
+    def sample(out, name, value, labels = {})
+      pairs = labels.map { |label, text| %(#{label}="#{text.to_s.gsub(/[\\"]/) { |c| "\\#{c}" }.gsub("\n", '\n')}") }
+      out << "blurrily_#{name}#{pairs.empty? ? '' : "{#{pairs.join(',')}}"} #{value}"
+    end
+
+    def seconds(nanoseconds)
+      nanoseconds / 1e9
+    end
+  end
+end
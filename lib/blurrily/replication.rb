@@ -0,0 +1,273 @@
+require 'blurrily/map_group'
+
+module Blurrily
+  # Keeps read-only follower servers in sync with a primary server.
+  #
+  # A follower connects to the primary and sends a `REPLICATE` line. The
+  # primary replies with a snapshot of each of its maps, then streams every
+  # write it applies, in order:
+  #
+  #     SNAPSHOT -> <map> -> <bytes>, followed by the map file itself
+  #     SEQ -> <sequence> -> <time>
+  #     OP -> <sequence> -> <time> -> PUT -> <map> -> <needle> -> <ref> -> [weight]
+  #     OP -> <sequence> -> <time> -> DELETE -> <map> -> <ref>
+  #     OP -> <sequence> -> <time> -> CLEAR -> <map>
+  #
+  # Sequences number the writes of the primary; times are the primary's
+  # clock in milliseconds when it sent the line. A SEQ line ends the
+  # snapshots and is repeated as a heartbeat.
+  module Replication
+
+    # Streams the writes applied to a MapGroup to followers.
+    class Primary
+      # bytes a follower may lag behind before it is dropped (it then
+      # reconnects and starts over from snapshots)
+      MAX_BACKLOG = 64 << 20
+
+      # snapshots are read in chunks, and only while fewer bytes than the
+      # window are queued to the follower
+      SNAPSHOT_CHUNK  = 64 << 10
+      SNAPSHOT_WINDOW = 4 << 20
+
+      def initialize(map_group)
+        @map_group = map_group
+        @followers = []
+        @streams   = {}.compare_by_identity
+        @seq = 0
+        map_group.on_apply { |name, operation| publish(name, operation) }
+      end
+
+      # Sends snapshots of every map to <follower>, then streams writes to it.
+      # Maps are saved from forked children (see
+      # MapGroup#snapshot_in_background), then sent a chunk at a time as the
+      # follower keeps up (see #pump); writes applied meanwhile are held back
+      # until the snapshots are through.
+      # @param follower responds to #send_data, like an EventMachine connection.
+      def attach(follower)
+        paths = @map_group.names.map do |name|
+          [name, @map_group.snapshot_in_background(name)]
+        end
+        @streams[follower] = {
+          :paths => paths, :files => nil, :failures => save_failures(paths),
+          :seq => @seq, :started => false, :held => [], :held_bytes => 0 }
+        @followers << follower
+        pump_stream(follower)
+      end
+
+      def detach(follower)
+        @followers.delete(follower)
+        stream = @streams.delete(follower) or return
+        (stream[:files] || []).each { |name, file| file.close }
+      end
+
+      # Sends more of the snapshots of followers that have room for them.
+      def pump
+        @streams.keys.each { |follower| pump_stream(follower) }
+      end
+
+      # Lets followers know the stream is alive, and how far along it is.
+      def heartbeat
+        broadcast(heartbeat_line)
+      end
+
+      # @return Hash with the sequence number of the last write (:seq), the
+      #   number of :followers, and the most bytes queued for one of them
+      #   (:backlog_bytes).
+      def stats
+        backlog = @followers.map { |follower| backlog_of(follower) }.max || 0
+        { :seq => @seq, :followers => @followers.size, :backlog_bytes => backlog }
+      end
+
+      private
+
+      def publish(name, operation)
+        @seq += 1
+        return if @followers.empty?
+        kind, *args = operation
+        broadcast(['OP', @seq, Replication.now_ms, kind.to_s.upcase, name, *args].join("\t") << "\n")
+      end
+
+      def broadcast(line)
+        @followers.dup.each do |follower|
+          stream = @streams[follower]
+          if backlog_of(follower) > MAX_BACKLOG
+            detach(follower)
+            follower.close_connection
+          elsif stream
+            stream[:held] << line
+            stream[:held_bytes] += line.bytesize
+          else
+            follower.send_data(line)
+          end
+        end
+      end
+
+      def pump_stream(follower)
+        stream = @streams[follower] or return
+        return unless open_snapshots(follower, stream)
+        while outbound_size(follower) < SNAPSHOT_WINDOW
+          name, file = stream[:files].first
+          return finish_stream(follower, stream) unless file
+
+          unless stream[:started]
+            follower.send_data("SNAPSHOT\t#{name}\t#{file.size}\n")
+            stream[:started] = true
+          end
+          chunk = file.read(SNAPSHOT_CHUNK)
+          if chunk
+            follower.send_data(chunk)
+          else
+            file.close
+            stream[:files].shift
+            stream[:started] = false
+          end
+        end
+      end
+
+      # opens the snapshot files once they are all saved; a follower whose
+      # snapshots failed to save is dropped, and starts over
+      def open_snapshots(follower, stream)
+        return true if stream[:files]
+        return false if stream[:paths].any? { |name, path| @map_group.saving?(name) }
+        if save_failures(stream[:paths]) > stream[:failures]
+          detach(follower)
+          follower.close_connection
+          return false
+        end
+        stream[:files] = stream[:paths].map { |name, path| [name, File.open(path.to_s, 'rb')] }
+        true
+      end
+
+      def save_failures(paths)
+        paths.inject(0) { |total, (name, path)| total + @map_group.save_stats(name)[:failures] }
+      end
+
+      # ends the snapshots at the sequence they were taken at, then sends
+      # the writes held back since
+      def finish_stream(follower, stream)
+        @streams.delete(follower)
+        follower.send_data("SEQ\t#{stream[:seq]}\t#{Replication.now_ms}\n")
+        stream[:held].each { |line| follower.send_data(line) }
+      end
+
+      def backlog_of(follower)
+        stream = @streams[follower]
+        outbound_size(follower) + (stream ? stream[:held_bytes] : 0)
+      end
+
+      def heartbeat_line
+        "SEQ\t#{@seq}\t#{Replication.now_ms}\n"
+      end
+
+      def outbound_size(follower)
+        follower.respond_to?(:get_outbound_data_size) ? follower.get_outbound_data_size : 0
+      end
+    end
+
+
+    # Applies the stream of a Primary to a MapGroup.
+    class Follower
+      def initialize(map_group)
+        @map_group = map_group
+        @buffer    = ''.force_encoding(Encoding::BINARY)
+        @snapshot  = nil
+        @connected = false
+        @counters  = { :seq => 0, :snapshots => 0, :lag_ms => 0 }
+        @received_at = nil
+      end
+
+      def connected
+        reset
+        @connected = true
+      end
+
+      def disconnected
+        reset
+        @connected = false
+      end
+
+      def receive_data(data)
+        @buffer << data.force_encoding(Encoding::BINARY)
+        @received_at = Replication.now_ms
+        loop do
+          if @snapshot
+            break unless receive_snapshot
+          else
+            line_end = @buffer.index("\n") or break
+            receive_line(@buffer.slice!(0, line_end + 1).chomp)
+          end
+        end
+      end
+
+      # @return Hash with whether the follower is :connected, the sequence
+      #   number of the last write applied (:seq), the number of maps
+      #   received as :snapshots, how late the last line arrived (:lag_ms),
+      #   and how long ago (:idle_ms).
+      def stats
+        idle = @received_at ? Replication.now_ms - @received_at : 0
+        @counters.merge(:connected => @connected ? 1 : 0, :idle_ms => idle)
+      end
+
+      private
+
+      def receive_line(line)
+        kind, *fields = line.force_encoding(Encoding::UTF_8).split("\t", -1)
+        case kind
+        when 'SNAPSHOT'
+          name, size = fields
+          path = @map_group.directory.join("#{name}.trigrams.replica")
+          path.dirname.mkpath
+          @snapshot = { :name => name, :remaining => size.to_i, :path => path, :file => File.open(path.to_s, 'wb') }
+        when 'SEQ'
+          seq, time = fields
+          @counters[:seq] = seq.to_i
+          @counters[:lag_ms] = [Replication.now_ms - time.to_i, 0].max
+        when 'OP'
+          seq, time, *operation = fields
+          apply(*operation)
+          @counters[:seq] = seq.to_i
+          @counters[:lag_ms] = [Replication.now_ms - time.to_i, 0].max
+        end
+      end
+
+      def apply(kind, name, *args)
+        case kind
+        when 'PUT'
+          needle, ref, weight = args
+          @map_group.put(name, needle, ref.to_i, weight.to_s.empty? ? nil : weight.to_i)
+        when 'DELETE'
+          @map_group.delete(name, args.first.to_i)
+        when 'CLEAR'
+          @map_group.clear(name)
+        end
+      end
+
+      # @return whether the snapshot is complete.
+      def receive_snapshot
+        chunk = @buffer.slice!(0, @snapshot[:remaining])
+        @snapshot[:file].write(chunk)
+        @snapshot[:remaining] -= chunk.bytesize
+        return false if @snapshot[:remaining] > 0
+
+        @snapshot[:file].close
+        @map_group.install(@snapshot[:name], @snapshot[:path])
+        @counters[:snapshots] += 1
+        @snapshot = nil
+        true
+      end
+
+      def reset
+        @buffer.clear
+        return unless @snapshot
+        @snapshot[:file].close
+        File.unlink(@snapshot[:path].to_s) rescue nil
+        @snapshot = nil
+      end
+    end
+
+
+    def self.now_ms
+      (Time.now.to_f * 1000).to_i
+    end
+  end
+end
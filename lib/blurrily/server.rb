@@ -1,7 +1,10 @@
 require 'eventmachine'
+require 'socket'
 require 'blurrily/defaults'
 require 'blurrily/command_processor'
 require 'blurrily/map_group'
+require 'blurrily/replication'
+require 'blurrily/metrics'
 
 module Blurrily
   class Server
@@ -10,9 +13,32 @@ module Blurrily
       @host      = options.fetch(:host,      '0.0.0.0')
       @port      = options.fetch(:port,      Blurrily::DEFAULT_PORT)
       directory  = options.fetch(:directory, Dir.pwd)
+      cache_size = options.fetch(:cache_size, 0)
+      budget     = options.fetch(:memory_budget, 0)
+      load_mode  = options.fetch(:load_mode, :lazy)
+      needles    = options.fetch(:keep_needles, false)
+      prefixes   = options.fetch(:index_prefixes, false)
+      by_weight  = options.fetch(:order_by_weight, false)
+      find_limits = { :budget => options[:find_budget], :timeout => options[:find_timeout] }
+      slow_query  = options[:slow_query]
+      @write_batch    = options.fetch(:write_batch, 0)
+      @write_interval = options.fetch(:write_interval, 0.1)
+      @metrics_port   = options[:metrics_port]
+      @metrics        = Metrics.new
 
-      @map_group = MapGroup.new(directory)
-      @command_processor = CommandProcessor.new(@map_group)
+      @map_group = MapGroup.new(directory,
+        :cache_size => cache_size, :memory_budget => budget,
+        :load_mode => load_mode, :keep_needles => needles, :index_prefixes => prefixes,
+        :order_by_weight => by_weight, :write_batch => @write_batch)
+      @follow    = options[:follow]
+      @replicate = options.fetch(:replicate, false)
+      if @follow
+        @replication = Replication::Follower.new(@map_group)
+      elsif @replicate
+        @replication = Replication::Primary.new(@map_group)
+      end
+      @command_processor = CommandProcessor.new(@map_group, find_limits.merge(
+        :read_only => !!@follow, :replication => @replication, :metrics => @metrics, :slow_query => slow_query))
     end
 
     def start
@@ -21,29 +47,137 @@ module Blurrily
         Signal.trap("INT")  { EventMachine.stop }
         Signal.trap("TERM") { EventMachine.stop }
 
-        saver = proc { @map_group.save }
+        # snapshots are saved from forked children, so clients don't stall
+        saver = proc { @map_group.save(:background => true) }
         EventMachine.add_periodic_timer(60, &saver)
-        EventMachine.add_shutdown_hook(&saver)
-        Signal.trap("USR1", &saver)
+        EventMachine.add_shutdown_hook { @map_group.save }
+        Signal.trap("USR1") { EventMachine.next_tick(&saver) }
+
+        # queued writes are applied in the gaps between reads
+        if @write_batch > 0
+          EventMachine.add_periodic_timer(@write_interval) { @map_group.flush }
+        end
+
+        if @follow
+          FollowerConnection.connect(@replication, *@follow)
+        elsif @replicate
+          EventMachine.add_periodic_timer(1) { @replication.heartbeat }
+          EventMachine.add_periodic_timer(0.01) { @replication.pump }
+        end
 
-        EventMachine.start_server(@host, @port, Handler, @command_processor)
+        if @metrics_port
+          render = proc { @metrics.render(@map_group, @replication) }
+          EventMachine.start_server(@host, @metrics_port, MetricsHandler, render)
+        end
+
+        # followers may come from anywhere unless given a list of addresses
+        followers = @replicate.kind_of?(Array) ? @replicate : nil
+        EventMachine.start_server(@host, @port, Handler, @command_processor, @replication, followers, @metrics)
       end
     end
 
     private
 
     module Handler
-      def initialize(processor)
-        @processor = processor
+      def initialize(processor, replication, followers, metrics)
+        @processor   = processor
+        @replication = replication
+        @followers   = followers
+        @metrics     = metrics
+      end
+
+      def post_init
+        @metrics.connected
       end
 
       def receive_data(data)
+        return if @replicating
+        @metrics.received(data.bytesize)
         data.split("\n").each do |line|
-          output = @processor.process_command(line.strip)
+          if line.strip == 'REPLICATE' && may_replicate?
+            # from now on, this connection only streams to a follower
+            @replicating = true
+            @replication.attach(self)
+            return
+          end
+          output = @processor.process_command(line.strip, self)
           output << "\n"
           send_data(output)
+          @metrics.sent(output.bytesize)
         end
       end
+
+      def unbind
+        @metrics.disconnected
+        @processor.forget(self)
+        @replication.detach(self) if @replicating
+      end
+
+      private
+
+      # only primaries started with :replicate stream to followers, and only
+      # to the addresses listed, if any; others answer REPLICATE with an error
+      def may_replicate?
+        return false unless @replication.respond_to?(:attach)
+        return true unless @followers
+        port, address = Socket.unpack_sockaddr_in(get_peername)
+        @followers.include?(address)
+      end
+    end
+
+    # Answers HTTP requests for /metrics with the server's metrics, in the
+    # Prometheus text format.
+    module MetricsHandler
+      def initialize(render)
+        @render  = render
+        @request = ''
+      end
+
+      def receive_data(data)
+        @request << data
+        return unless @request.include?("\r\n\r\n") || @request.include?("\n\n")
+
+        method, path = @request.split(' ', 3)
+        if method == 'GET' && path.split('?').first == '/metrics'
+          respond('200 OK', 'text/plain; version=0.0.4', @render.call)
+        else
+          respond('404 Not Found', 'text/plain', "Not found\n")
+        end
+      end
+
+      private
+
+      def respond(status, type, body)
+        send_data("HTTP/1.0 #{status}\r\nContent-Type: #{type}\r\nContent-Length: #{body.bytesize}\r\nConnection: close\r\n\r\n")
+        send_data(body)
+        close_connection_after_writing
+      end
+    end
+
+    # Feeds a Replication::Follower from its primary, reconnecting when the
+    # connection drops.
+    module FollowerConnection
+      def self.connect(follower, host, port)
+        EventMachine.connect(host, port, self, follower, host, port)
+      end
+
+      def initialize(follower, host, port)
+        @follower, @host, @port = follower, host, port
+      end
+
+      def connection_completed
+        @follower.connected
+        send_data("REPLICATE\n")
+      end
+
+      def receive_data(data)
+        @follower.receive_data(data)
+      end
+
+      def unbind
+        @follower.disconnected
+        EventMachine.add_timer(1) { FollowerConnection.connect(@follower, @host, @port) }
+      end
     end
   end
 end
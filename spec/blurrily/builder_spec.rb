@@ -0,0 +1,46 @@
+# encoding: utf-8
+
+require 'spec_helper'
+require 'stringio'
+require 'blurrily/builder'
+
+describe Blurrily::Builder do
+  let(:input) { StringIO.new("1\tlondon\t0\n2\tparis\n\n3\trome\t10\n1\tlondres") }
+  let(:path)  { Pathname.new('tmp/builder.trigrams') }
+
+  after { path.delete if path.exist? }
+
+  [1, 3].each do |jobs|
+    context "with #{jobs} jobs" do
+      subject { described_class.new(:jobs => jobs).build([input]) }
+
+      it 'puts every reference' do
+        expect(subject.stats[:references]).to eq(3)
+        expect(subject.find('rome').first).to eq([3, 5, 10])
+      end
+
+      it 'ignores duplicate references' do
+        expect(subject.find('londres').first.first).to eq(1)
+        expect(subject.find('londres').first[1]).to be < 8
+      end
+    end
+  end
+
+  it 'rejects lines without a reference' do
+    expect { described_class.new(:jobs => 2).build([StringIO.new("london\t1\n")]) }.to raise_exception(ArgumentError)
+  end
+
+  describe '.merge' do
+    it 'combines map files' do
+      described_class.new(:jobs => 1).build([input]).save(path.to_s)
+      other = Blurrily::Map.new
+      other.put 'berlin', 4, 0
+      other.save('tmp/builder2.trigrams')
+
+      map = described_class.merge([path.to_s, 'tmp/builder2.trigrams'])
+      expect(map.stats[:references]).to eq(4)
+      expect(map.find('berlin').first.first).to eq(4)
+      File.delete('tmp/builder2.trigrams')
+    end
+  end
+end
@@ -29,6 +29,27 @@ describe Blurrily::Client do
       expect(subject.find("london")).to eq([[1337,1,2]])
     end
 
+    it "returns distances when re-ranking" do
+      mock_tcp_next_request("OK\t1337\t1\t2\t3\t1338\t1\t2\t", "FIND\tlocation_en\tlondon\t10\t5")
+      expect(subject.find("london", 10, 5)).to eq([[1337,1,2,3], [1338,1,2,nil]])
+    end
+
+    it "flags results cut short by a budget" do
+      mock_tcp_next_request("PARTIAL\t1337\t1\t2", "FIND\tlocation_en\tlondon\t10\t\t500")
+      expect(subject.find("london", 10, nil, 500)).to eq([[1337,1,2]])
+      expect(subject).to be_truncated
+    end
+
+    it "finds across data stores" do
+      mock_tcp_next_request("OK\t1337\t1\t2\tlocation_fr", "FINDM\tlocation_en,location_fr\tlondon\t10")
+      expect(subject.find_across(%w(location_en location_fr), "london")).to eq([[1337,1,2,"location_fr"]])
+    end
+
+    it "finds by prefix" do
+      mock_tcp_next_request("OK\t1337\t4\t2", "PREFIX\tlocation_en\tlond\t10")
+      expect(subject.find_prefix("lond")).to eq([[1337,4,2]])
+    end
+
     it "handles no records found correctly" do
       mock_tcp_next_request("OK")
       expect(subject.find("blah")).to be_empty
@@ -66,4 +87,67 @@ describe Blurrily::Client do
       expect(subject.put("London", 123, 0)).to be_nil
     end
   end
+
+  context "connections" do
+    it "reconnects when the server closed the connection" do
+      sockets = [FakeTCPSocket.new(nil), FakeTCPSocket.new("OK\t1337\t1\t2")]
+      allow(TCPSocket).to receive(:new) { sockets.shift }
+      sockets.first.define_singleton_method(:gets) { nil }
+      expect(subject.find("london")).to eq([[1337,1,2]])
+      expect(subject.pool_stats).to include(:connects => 2, :reconnects => 1)
+    end
+
+    it "reconnects all pooled connections after a server restart" do
+      client = described_class.new(config.merge(:pool_size => 3))
+      restarted = false
+      allow(TCPSocket).to receive(:new) do
+        if restarted
+          FakeTCPSocket.new("OK\t1337\t1\t2")
+        else
+          FakeTCPSocket.new("OK").tap { |s| s.define_singleton_method(:gets) { restarted ? nil : (sleep 0.05; "OK\n") } }
+        end
+      end
+      3.times.map { Thread.new { client.find("london") } }.each(&:join)
+      expect(client.pool_stats).to include(:connects => 3, :idle => 3)
+
+      restarted = true
+      expect(client.find("london")).to eq([[1337,1,2]])
+      expect(client.find("london")).to eq([[1337,1,2]])
+      expect(client.pool_stats).to include(:connects => 4, :reconnects => 1, :idle => 1)
+    end
+
+    it "raises its own error when it cannot connect" do
+      allow(TCPSocket).to receive(:new) { raise Errno::ECONNREFUSED }
+      expect { subject.find("london") }.to raise_error(described_class::Error)
+    end
+
+    it "gives up after reconnecting once" do
+      allow(TCPSocket).to receive(:new) { FakeTCPSocket.new(nil).tap { |s| s.define_singleton_method(:gets) { nil } } }
+      expect { subject.find("london") }.to raise_error(described_class::Error)
+    end
+
+    it "times out waiting for replies" do
+      client = described_class.new(config.merge(:read_timeout => 0.05))
+      allow(TCPSocket).to receive(:new) { FakeTCPSocket.new(nil).tap { |s| s.define_singleton_method(:gets) { sleep 1 } } }
+      expect { client.find("london") }.to raise_error(described_class::Error)
+      expect(client.pool_stats[:timeouts]).to eq(1)
+    end
+
+    it "connects round-robin to several servers" do
+      client = described_class.new(:hosts => ['a:1', 'b:2'], :pool_size => 2)
+      opened = []
+      allow(TCPSocket).to receive(:new) { |host, port| opened << [host, port]; FakeTCPSocket.new("OK") }
+      threads = 2.times.map { Thread.new { client.find("london") } }
+      threads.each(&:join)
+      expect(opened.size).to be <= 2
+      expect(opened.first).to eq(['a', 1])
+    end
+  end
+
+  context "stats" do
+    it "returns a hash of integers" do
+      mock_tcp_next_request("OK\treferences\t3\tfind_count\t12", "STATS\tlocation_en")
+      expect(subject.stats).to eq(:references => 3, :find_count => 12)
+    end
+  end
 end
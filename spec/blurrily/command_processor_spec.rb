@@ -1,4 +1,5 @@
 require 'spec_helper'
+require 'stringio'
 require 'blurrily/command_processor'
 require 'blurrily/map_group'
 
@@ -51,6 +52,81 @@ describe Blurrily::CommandProcessor do
       expect(subject.process_command("PUT\tdb\tWhatever string\t12\t1")).to eq('OK')
     end
 
+    it 'STATS returns name/value pairs' do
+      subject.process_command("PUT\tlocations_en\tgreat london\t12")
+      subject.process_command("FIND\tlocations_en\tgreat")
+      status, *pairs = subject.process_command("STATS\tlocations_en").split("\t")
+      stats = Hash[pairs.each_slice(2).to_a]
+      expect(status).to eq('OK')
+      expect(stats['references']).to eq('1')
+      expect(stats['find_count']).to eq('1')
+      expect(stats['find_p99_ns'].to_i).to be > 0
+      expect(stats['saves']).to eq('0')
+    end
+
+    it 'FIND re-ranks by edit distance' do
+      subject.process_command("PUT\tlocations_en\tgreat london\t12")
+      subject.process_command("PUT\tlocations_en\tgreater masovian\t13")
+      expect(subject.process_command("FIND\tlocations_en\tgreat\t10\t5")).to eq("OK\t12\t6\t12\t\t13\t5\t16\t")
+    end
+
+    it 'FIND replies PARTIAL when the budget runs out' do
+      subject.process_command("PUT\tlocations_en\tgreat london\t12")
+      subject.process_command("PUT\tlocations_en\tgreater masovian\t13")
+      expect(subject.process_command("FIND\tlocations_en\tgreat\t10\t\t1")).to eq("PARTIAL\t12\t1\t12")
+      expect(subject.process_command("FIND\tlocations_en\tgreat\t10\t\t100")).to eq("OK\t12\t6\t12\t13\t5\t16")
+    end
+
+    it 'FINDM finds across maps' do
+      subject.process_command("PUT\tlocations_en\tgreat london\t12")
+      subject.process_command("PUT\tlocations_fr\tgrand londres\t13")
+      expect(subject.process_command("FINDM\tlocations_en,locations_fr\tgreat\t2")).to eq("OK\t12\t6\t12\tlocations_en\t13\t2\t13\tlocations_fr")
+      expect(subject.process_command("FINDM\tlocations_en,locations_fr\tgreat\t1\t\t1")).to eq("PARTIAL\t12\t1\t12\tlocations_en")
+    end
+
+    it 'FINDM validates each map name' do
+      expect(subject.process_command("FINDM\tlocations_en,bad db\tgreat")).to match(/^ERROR\tInvalid database name/)
+    end
+
+    it 'PREFIX finds references starting with the needle first' do
+      subject.process_command("PUT\tlocations_en\tparis london\t12")
+      subject.process_command("PUT\tlocations_en\tlondon\t13")
+      expect(subject.process_command("PREFIX\tlocations_en\tlond\t1")).to eq("OK\t13\t4\t6")
+    end
+
+    it 'returns ERROR for not numeric budget' do
+      expect(subject.process_command("FIND\tdb\tWhatever string\t10\t\tbudget")).to match(/^ERROR\tBudget must be a number/)
+    end
+
+    context 'with a write batch' do
+      subject { described_class.new(Blurrily::MapGroup.new('.', :write_batch => 100)) }
+
+      before do
+        subject.process_command("PUT\tlocations_en\tgreat london\t12", :writer)
+      end
+
+      it 'reads its own writes' do
+        expect(subject.process_command("FIND\tlocations_en\tgreat", :writer)).to eq("OK\t12\t6\t12")
+      end
+
+      it 'does not wait for the writes of other clients' do
+        expect(subject.process_command("FIND\tlocations_en\tgreat", :reader)).to eq("OK")
+      end
+    end
+
+    context 'with a slow query log' do
+      let(:log) { StringIO.new }
+      subject { described_class.new(Blurrily::MapGroup.new, :slow_query => 0, :slow_log => log) }
+
+      it 'logs commands with how their find went' do
+        subject.process_command("PUT\tlocations_en\tgreat london\t12")
+        expect(subject.process_command("FIND\tlocations_en\tgreat")).to eq("OK\t12\t6\t12")
+        lines = log.string.lines
+        expect(lines.length).to eq(2)
+        expect(lines.last).to include('"FIND\tlocations_en\tgreat"', 'needle="great"', 'gre:1', 'entries=6', 'candidates=1', 'find_ns=')
+      end
+    end
+
     it 'does not return ERROR for limit' do
       expect(subject.process_command("FIND\tdb\tWhatever string\t2")).to eq("OK")
     end
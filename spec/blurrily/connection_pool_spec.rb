@@ -0,0 +1,70 @@
+# encoding: utf-8
+
+require 'spec_helper'
+require 'blurrily/connection_pool'
+
+describe Blurrily::ConnectionPool do
+  let(:servers) { [TCPServer.new('127.0.0.1', 0), TCPServer.new('127.0.0.1', 0)] }
+  let(:addresses) { servers.map { |server| ['127.0.0.1', server.addr[1]] } }
+  let(:options) { { :size => 2, :timeout => 0.2 } }
+
+  subject { described_class.new(addresses, options) }
+
+  after do
+    subject.shutdown
+    servers.each(&:close)
+  end
+
+  it 'reuses connections' do
+    first  = subject.with { |connection| connection }
+    second = subject.with { |connection| connection }
+    expect(second).to equal(first)
+    expect(subject.stats).to include(:connects => 1, :checkouts => 2, :idle => 1, :busy => 0)
+  end
+
+  it 'spreads connections over addresses' do
+    subject.with do |first|
+      subject.with do |second|
+        expect([first, second].map { |connection| connection.peeraddr[1] }).to eq(addresses.map(&:last))
+      end
+    end
+  end
+
+  it 'skips addresses it cannot connect to' do
+    subject
+    servers.first.close
+    subject.with { |connection| expect(connection.peeraddr[1]).to eq(addresses.last.last) }
+    expect(subject.stats[:connect_failures]).to eq(1)
+  end
+
+  it 'makes threads wait for a free connection' do
+    subject.with do
+      subject.with do
+        expect { subject.with {} }.to raise_error(described_class::Error)
+      end
+    end
+    expect(subject.stats[:waits]).to be > 0
+  end
+
+  it 'closes connections when the block raises' do
+    connection = nil
+    expect { subject.with { |c| connection = c; raise IOError } }.to raise_error(IOError)
+    expect(connection).to be_closed
+    expect(subject.stats).to include(:idle => 0, :busy => 0)
+  end
+
+  it 'discards idle connections opened before a time' do
+    first = subject.with { |connection| subject.with { |other| other }; connection }
+    subject.discard_idle(Time.now)
+    expect(first).to be_closed
+    expect(subject.stats).to include(:idle => 0, :busy => 0)
+    expect(subject.with { |connection| connection }).not_to equal(first)
+  end
+
+  it 'is thread safe' do
+    threads = 8.times.map { Thread.new { 50.times { subject.with { |c| c.peeraddr } } } }
+    threads.each(&:join)
+    expect(subject.stats).to include(:checkouts => 400, :busy => 0)
+    expect(subject.stats[:connects]).to be <= 2
+  end
+end
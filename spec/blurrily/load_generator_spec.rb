@@ -0,0 +1,87 @@
+# encoding: utf-8
+
+require 'spec_helper'
+require 'socket'
+require 'blurrily/load_generator'
+
+describe Blurrily::LoadGenerator do
+  describe Blurrily::LoadGenerator::Histogram do
+    it 'reports percentiles within the bucket width' do
+      (1..100_000).each { |value| subject.record(value * 1000) }
+      expect(subject.percentile(0.5)).to be_within(0.02 * 50_000_000).of(50_000_000)
+      expect(subject.percentile(0.99)).to be_within(0.02 * 99_000_000).of(99_000_000)
+      expect(subject.percentile(1.0)).to eq(100_000_000)
+    end
+
+    it 'merges' do
+      other = described_class.new
+      subject.record(10)
+      other.record(1_000_000)
+      subject.merge(other)
+      expect(subject.count).to eq(2)
+      expect(subject.max).to eq(1_000_000)
+      expect(subject.percentile(0.5)).to eq(10)
+    end
+  end
+
+  describe Blurrily::LoadGenerator::Mix do
+    it 'generates commands as per weights' do
+      mix = described_class.new({ :find => 1 }, :db_name => 'places', :needles => ['london'])
+      expect(mix.next_command(Random.new(0))).to eq("FIND\tplaces\tlondon\t10")
+    end
+
+    it 'makes up needles' do
+      mix = described_class.new(:put => 1, :delete => 1)
+      commands = Array.new(100) { mix.next_command(Random.new(0)) }
+      expect(commands.grep(/\A(PUT\twords\t[a-z]+\t\d+|DELETE\twords\t\d+)\z/).size).to eq(100)
+    end
+  end
+
+  describe Blurrily::LoadGenerator::Replay do
+    it 'loops over the log' do
+      replay = described_class.new(["FIND\tplaces\tparis\n", "\n", "STATS\tplaces\n"])
+      expect(Array.new(3) { replay.next_command(nil) }).to eq(["FIND\tplaces\tparis", "STATS\tplaces", "FIND\tplaces\tparis"])
+    end
+  end
+
+  describe '#run' do
+    let(:server) { TCPServer.new('127.0.0.1', 0) }
+    let(:source) { Blurrily::LoadGenerator::Replay.new(["FIND\tplaces\tparis", "PUT\tplaces\tparis\t1"]) }
+
+    # replies OK to FIND, and an error to anything else, after <delay>
+    def serve(delay = 0)
+      @acceptor = Thread.new do
+        loop do
+          client = server.accept
+          Thread.new(client) do |socket|
+            while (line = socket.gets)
+              sleep(delay) if delay > 0
+              socket.write(line.start_with?('FIND') ? "OK\n" : "ERROR\tRead-only\n")
+            end
+          end
+        end
+      end
+    end
+
+    after do
+      @acceptor.kill
+      server.close
+    end
+
+    it 'sends the number of requests asked' do
+      serve
+      result = described_class.new(:port => server.addr[1], :connections => 3, :requests => 50, :source => source).run
+      expect(result[:requests]).to eq(50)
+      expect(result[:errors]).to eq(25)
+      expect(result[:latencies].keys.sort).to eq(%w(FIND PUT))
+      expect(described_class.report(result).first).to match(/^50 requests in/)
+    end
+
+    it 'counts latency from when requests were due' do
+      serve(0.05)
+      result = described_class.new(:port => server.addr[1], :connections => 1, :rate => 100, :requests => 10, :source => source).run
+      # the last request was due 90ms in, but only sent after 9 x 50ms
+      expect(result[:latency].max).to be > 300_000_000
+    end
+  end
+end
@@ -28,6 +28,112 @@ describe Blurrily::MapGroup do
     end
   end
 
+  context "with a cache size" do
+    subject { described_class.new('.', :cache_size => 4096) }
+
+    it "enables caching on loaded maps" do
+      expect(subject.map('location_en').stats[:cache_max_bytes]).to eq(4096)
+    end
+
+    it "enables caching on cleared maps" do
+      subject.clear('location_en')
+      expect(subject.map('location_en').stats[:cache_max_bytes]).to eq(4096)
+    end
+  end
+
+  context "with a memory budget" do
+    subject { described_class.new('.', :memory_budget => 1) }
+
+    before do
+      subject.map('location_en').put('aaa', 123, 0)
+      subject.map('location_fr')
+    end
+
+    it "keeps the most recently used map" do
+      expect(subject.stats).to include(:maps => 1, :evictions => 1)
+    end
+
+    it "saves evicted maps" do
+      expect(Pathname('location_en.trigrams')).to exist
+    end
+
+    it "reloads evicted maps" do
+      expect(subject.map('location_en').find('aaa').first.first).to eq(123)
+      expect(subject.stats).to include(:hits => 0, :misses => 3, :evictions => 2)
+    end
+
+    it "evicts least recently used maps first" do
+      group = described_class.new('.', :memory_budget => 5 * subject.stats[:bytes] / 2)
+      group.map('location_en')
+      group.map('location_fr')
+      group.map('location_en')
+      group.map('location_de')
+      expect(group.stats[:evictions]).to eq(1)
+      group.map('location_en')
+      expect(group.stats[:misses]).to eq(3)
+    end
+
+    it "keeps maps searched together" do
+      expect(subject.find_across(%w(location_en location_fr), 'aaa')).to eq([[123, 4, 3, 'location_en']])
+    end
+  end
+
+  context "finding across maps" do
+    before do
+      subject.map('location_en').put('london', 123, 0)
+      subject.map('location_fr').put('londres', 124, 0)
+    end
+
+    it "tags results with their map" do
+      expect(subject.find_across(%w(location_fr location_en), 'london')).to eq([[123, 7, 6, 'location_en'], [124, 4, 7, 'location_fr']])
+    end
+
+    it "tells whether any map ran out of budget" do
+      subject.find_across(%w(location_fr location_en), 'london', 10, :budget => 1)
+      expect(subject).to be_truncated
+      subject.find_across(%w(location_fr location_en), 'london')
+      expect(subject).not_to be_truncated
+    end
+  end
+
+  context "with a write batch" do
+    subject { described_class.new('.', :write_batch => 3) }
+
+    before do
+      subject.put('location_en', 'london', 1)
+      subject.put('location_en', 'paris', 2)
+    end
+
+    it "queues writes" do
+      expect(subject.map('location_en').find('london')).to be_empty
+      expect(subject.stats[:queued]).to eq(2)
+    end
+
+    it "applies a full batch" do
+      sequence = subject.delete('location_en', 2)
+      expect(subject.applied('location_en')).to eq(sequence)
+      expect(subject.map('location_en').find('paris')).to be_empty
+      expect(subject.map('location_en').find('london').first.first).to eq(1)
+    end
+
+    it "applies queued writes on flush" do
+      subject.flush
+      expect(subject.map('location_en').stats[:references]).to eq(2)
+      expect(subject.stats).to include(:queued => 0, :batches => 1)
+    end
+
+    it "applies queued writes before saving" do
+      subject.save
+      expect(described_class.new('.').map('location_en').stats[:references]).to eq(2)
+    end
+
+    it "drops queued writes on clear" do
+      subject.clear('location_en')
+      subject.flush
+      expect(subject.map('location_en').stats[:references]).to eq(0)
+    end
+  end
+
   context "saving the map to file" do
     it "saves all maps" do
       subject.map('location_en')
@@ -44,11 +150,70 @@ describe Blurrily::MapGroup do
       expect(Pathname('tmp/test.trigrams')).to exist
     end
 
+    it 'counts saves' do
+      subject.map('location_en')
+      subject.save
+      expect(subject.save_stats('location_en')).to include(:saves => 1, :failures => 0)
+    end
+
     after(:each) do
       FileUtils.rm Dir.glob('tmp/test.trigrams')
     end
   end
 
+  context "saving in the background" do
+    before { subject.map('location_en').put('aaa', 123, 0) }
+
+    it "saves maps" do
+      subject.save(:background => true)
+      subject.wait
+      loaded_map = described_class.new('.').map('location_en')
+      expect(loaded_map.find('aaa').first.first).to eq(123)
+    end
+
+    it "saves a snapshot" do
+      subject.save(:background => true)
+      subject.map('location_en').put('bbb', 124, 0)
+      subject.wait
+      loaded_map = described_class.new('.').map('location_en')
+      expect(loaded_map.find('bbb')).to be_empty
+    end
+
+    it "records metrics" do
+      subject.save(:background => true)
+      subject.wait
+      stats = subject.save_stats('location_en')
+      expect(stats).to include(:saves => 1, :failures => 0)
+      expect(stats[:stall_ns]).to be <= stats[:save_ns]
+    end
+
+    it "skips unchanged maps" do
+      subject.save(:background => true)
+      subject.wait
+      subject.save(:background => true)
+      subject.wait
+      expect(subject.save_stats('location_en')[:saves]).to eq(1)
+    end
+
+    it "saves snapshots" do
+      path = subject.snapshot_in_background('location_en')
+      subject.map('location_en').put('bbb', 124, 0)
+      subject.wait
+      expect(subject.saving?('location_en')).to eq(false)
+      loaded_map = Blurrily::Map.load(path.to_s)
+      expect(loaded_map.find('aaa').first.first).to eq(123)
+      expect(loaded_map.find('bbb')).to be_empty
+    end
+
+    it "completes the save before clearing" do
+      old_map = subject.map('location_en')
+      subject.save(:background => true)
+      subject.clear('location_en')
+      expect(subject.save_stats('location_en')[:saves]).to eq(1)
+      expect { old_map.stats }.to raise_error(Blurrily::Map::ClosedError)
+    end
+  end
+
   after(:each) do
     FileUtils.rm Dir.glob('location*.trigrams')
   end
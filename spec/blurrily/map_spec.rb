@@ -23,6 +23,41 @@ describe Blurrily::Map do
       expect(result[:trigrams]).to be_a_kind_of(Integer)
     end
 
+    context 'when detailed' do
+      let(:result) { subject.stats(true) }
+
+      before do
+        subject.put 'london', 123, 0
+        subject.put 'paris',  124, 0
+        subject.find 'london'
+        subject.put 'rome',   125, 0
+        subject.put 'paris',  100, 0
+      end
+
+      it 'describes posting lists' do
+        expect(result[:lists][:count]).to eq(18)
+        expect(result[:lists][:dirty]).to eq(6) # 'paris', out of order
+        expect(result[:lists][:slack]).to eq(result[:lists][:buckets] - 24)
+        expect(result[:lists][:lengths].first(2)).to eq([12, 6])
+      end
+
+      it 'merges lists on find' do
+        subject.find 'paris'
+        expect(result[:lists][:dirty]).to eq(0)
+      end
+
+      it 'times operations' do
+        expect(result[:phases][:put][:count]).to eq(4)
+        expect(result[:phases][:find][:count]).to eq(1)
+        expect(result[:phases][:find][:histogram].inject(:+)).to eq(1)
+      end
+
+      it 'times the steps of finds' do
+        %i(tokenise copy sort reduce rank).each do |phase|
+          expect(result[:phases][phase][:count]).to eq(1)
+        end
+      end
+    end
   end
 
   describe '#put' do
@@ -58,6 +93,13 @@ describe Blurrily::Map do
       expect(trigrams).to eq(2)
     end
 
+    it 'keeps digits only when they are in its alphabet' do
+      subject.put 'sw1a', 123, 0
+      subject.put 'sw2a', 124, 0
+      # without digits, both read 'sw a'
+      expect(subject.find('sw1a').map { |result| result[1] }).to eq(described_class::ALPHABET.include?('1') ? [5, 2] : [5, 5])
+    end
+
     it 'ignores dupes after save/load cycle' do
       subject.put 'london', 123
       subject.save path.to_s
@@ -115,6 +157,31 @@ describe Blurrily::Map do
 
   end
 
+  describe '#put_batch' do
+    it 'finds the same as separate puts' do
+      other = described_class.new
+      puts  = [['London', 5], ['Paris', 3, 10], ['Londres', 9], ['London', 3]]
+      puts.each { |put| other.put(*put) }
+      subject.put_batch puts
+      expect(subject.find('london')).to eq(other.find('london'))
+      expect(subject.stats).to eq(other.stats)
+    end
+
+    it 'keeps lists sorted with increasing references' do
+      subject.put_batch [['london', 2], ['lonely', 5], ['longing', 7]]
+      expect(subject.stats(true)[:lists][:dirty]).to eq(0)
+    end
+  end
+
+  describe '#delete_batch' do
+    it 'deletes every reference' do
+      subject.put_batch [['london', 5], ['lonely', 2], ['longing', 7]]
+      subject.delete_batch [5, 7, 8]
+      expect(subject.find('lon').map(&:first)).to eq([2])
+      expect(subject.stats[:references]).to eq(1)
+    end
+  end
+
   describe '#find' do
     let(:needle) { 'london' }
     let(:limit)  { 10 }
@@ -141,6 +208,23 @@ describe Blurrily::Map do
       end
     end
 
+    context 'with references put out of order' do
+      let(:refs) { [5, 3, 9, 1, 7, 2, 8] }
+
+      it 'finds all of them' do
+        refs.each { |ref| subject.put 'london', ref, 0 }
+        expect(result.map(&:first).sort).to eq(refs.sort)
+      end
+
+      it 'finds later puts after a merge' do
+        refs.first(3).each { |ref| subject.put 'london', ref, 0 }
+        subject.find 'london'
+        refs.drop(3).each { |ref| subject.put 'london', ref, 0 }
+        subject.delete 3
+        expect(result.map(&:first).sort).to eq(refs.sort - [3])
+      end
+    end
+
     it 'works with duplicated references' do
       subject.put needle, 123
       subject.put 'london2', 123
@@ -207,6 +291,511 @@ describe Blurrily::Map do
       subject.put 'london', 102, 102
       expect(result.map(&:first)).to eq([101, 102, 103])
     end
+
+    context 'with a budget' do
+      before do
+        subject.put 'london', 123, 0
+        20.times { |idx| subject.put 'lonely', idx, 0 }
+      end
+
+      it 'reads the shortest lists first' do
+        expect(subject.find(needle, limit, :budget => 4)).to eq([[123, 4, 6]])
+        expect(subject).to be_truncated
+      end
+
+      it 'reads the start of a list when the budget is smaller than every list' do
+        map = described_class.new
+        200.times { |idx| map.put 'london', idx, 200 - idx }
+        expect(map.find(needle, limit, :budget => 50).length).to eq(10)
+        expect(map).to be_truncated
+
+        map.order_by_weight = true
+        expect(map.find(needle, limit, :budget => 50).first).to eq([199, 1, 1])
+      end
+
+      it 'is not truncated when the budget suffices' do
+        expect(subject.find(needle, limit, :budget => 100).first).to eq([123, 7, 6])
+        expect(subject).not_to be_truncated
+      end
+
+      it 'stops reading lists after the timeout' do
+        expect(subject.find(needle, limit, :timeout => 1e-9)).not_to be_empty
+        expect(subject).to be_truncated
+        expect(subject.stats[:truncated]).to eq(1)
+      end
+    end
+
+    context 'with filters' do
+      before do
+        subject.put 'london',      123, 0
+        subject.put 'londonderry', 124, 0
+        subject.put 'londres',     125, 0
+      end
+
+      it 'only returns references in the filter' do
+        filter = Blurrily::Filter.new([125, 124, 124])
+        expect(subject.find(needle, 1, :filter => filter)).to eq([[124, 6, 11]])
+        expect(subject.find(needle, limit, :filter => [125, 999])).to eq([[125, 4, 7]])
+      end
+
+      it 'only returns weights within bounds' do
+        expect(subject.find(needle, limit, :min_weight => 7).map(&:first)).to eq([124, 125])
+        expect(subject.find(needle, limit, :max_weight => 7).map(&:first)).to eq([123, 125])
+      end
+
+      it 'does not cache filtered results' do
+        subject.cache_size = 4096
+        subject.find(needle, limit, :filter => [125])
+        expect(subject.find(needle, limit).size).to eq(3)
+      end
+    end
+
+    context 'with the :rerank option' do
+      let(:result) { subject.find needle, limit, :rerank => 10 }
+
+      before do
+        subject.keep_needles = true
+        subject.put 'london colney', 124, 0
+        subject.put 'london',        123, 0
+        subject.put 'paris',         125, 0
+        needle.replace 'lonndon'
+      end
+
+      it 'orders by edit distance' do
+        expect(result.map(&:first)).to eq([123, 124])
+        expect(result.map(&:last)).to eq([1, 7])
+      end
+
+      it 'reports unknown distances as nil' do
+        subject.keep_needles = false
+        subject.put 'londres', 126, 0
+        expect(result.assoc(126).last).to be_nil
+      end
+
+      it 'forgets deleted needles' do
+        subject.delete 123
+        expect(result.map(&:first)).to eq([124])
+      end
+
+      it 'keeps needles across saves' do
+        subject.save path.to_s
+        map = described_class.load path.to_s
+        expect(map.find(needle, limit, :rerank => 10).first).to eq(result.first)
+        expect(map.stats[:needles]).to eq(3)
+      end
+    end
+
+    context 'with the :similarity option' do
+      before do
+        subject.put 'london colney', 124, 1
+        subject.put 'london',        123, 6
+        needle.replace 'london'
+      end
+
+      it 'ranks by shared trigrams alone without it' do
+        expect(subject.find(needle, limit).map(&:first)).to eq([124, 123])
+      end
+
+      %w(dice jaccard cosine).each do |similarity|
+        it "ranks closer references first with #{similarity}" do
+          result = subject.find(needle, limit, :similarity => similarity.to_sym)
+          expect(result.map(&:first)).to eq([123, 124])
+          expect(result.first.last).to eq(1.0)
+          expect(result.last.last).to be_between(0.1, 0.9)
+        end
+      end
+
+      it 'scores as per the trigram counts' do
+        # 'london' has 7 trigrams, 'london colney' 14
+        expect(subject.find(needle, limit, :similarity => :dice).last.last).to be_within(1e-6).of(14.0 / 21)
+        expect(subject.find(needle, limit, :similarity => :jaccard).last.last).to be_within(1e-6).of(7.0 / 14)
+      end
+
+      it 'keeps trigram counts across saves, merges and deletes' do
+        subject.save path.to_s
+        map = described_class.new
+        map.merge(described_class.load(path.to_s))
+        expect(map.find(needle, limit, :similarity => :dice)).to eq(subject.find(needle, limit, :similarity => :dice))
+        map.delete 123
+        map.put 'london', 123, 6
+        expect(map.find(needle, limit, :similarity => :dice).first.last).to eq(1.0)
+      end
+
+      it 'rejects unknown measures' do
+        expect { subject.find(needle, limit, :similarity => :hamming) }.to raise_exception(ArgumentError)
+      end
+    end
+
+    context 'with the :prefix option' do
+      let(:indexed) { false }
+
+      before do
+        subject.index_prefixes = indexed
+        subject.put 'paris london', 124, 0
+        subject.put 'london',       123, 0
+        needle.replace 'lond'
+      end
+
+      it 'ranks references starting with the needle first' do
+        expect(subject.find(needle, limit, :prefix => true).map(&:first)).to eq([123, 124])
+      end
+
+      context 'once indexed' do
+        let(:indexed) { true }
+
+        it 'only finds references starting with the needle' do
+          expect(subject.find(needle, limit, :prefix => true).map(&:first)).to eq([123])
+          expect(subject.find(needle, limit).map(&:first)).to eq([123, 124])
+        end
+
+        it 'keeps the index across saves, merges and deletes' do
+          subject.save path.to_s
+          map = described_class.new
+          map.index_prefixes = true
+          map.merge(described_class.load(path.to_s))
+          map.put 'londonderry', 125, 0
+          expect(map.find(needle, limit, :prefix => true).map(&:first)).to match_array([123, 125])
+          map.delete 123
+          expect(map.find(needle, limit, :prefix => true).map(&:first)).to eq([125])
+        end
+
+        it 'indexes references put before it from their kept needles' do
+          map = described_class.new
+          map.keep_needles = true
+          map.put 'paris london', 124, 0
+          map.put 'london',       123, 0
+          map.index_prefixes = true
+          expect(map.find(needle, limit, :prefix => true).map(&:first)).to eq([123])
+        end
+
+        it 'still finds references put before it without needles' do
+          map = described_class.new
+          map.put 'paris london', 124, 0
+          map.put 'london',       123, 0
+          map.index_prefixes = true
+          map.put 'londonderry',  125, 0
+          expect(map.find(needle, limit, :prefix => true).map(&:first)).to match_array([123, 124, 125])
+        end
+
+        it 'drops the index when disabled' do
+          expect(subject.memsize[:prefixes]).to be > 0
+          subject.index_prefixes = false
+          expect(subject.memsize[:prefixes]).to eq(0)
+          expect(subject.find(needle, limit, :prefix => true).map(&:first)).to eq([123, 124])
+        end
+      end
+    end
+
+    context 'with the :explain option' do
+      let(:explained) { subject.find 'London', limit, :explain => true }
+
+      before do
+        subject.put 'london',  124, 0
+        subject.put 'londres', 123, 0
+      end
+
+      it 'returns the results with how the find went' do
+        expect(explained[:results]).to eq(result)
+        expect(explained[:needle]).to eq('london')
+        expect(explained[:trigrams].length).to eq(7)
+        expect(explained[:trigrams]).to include(['lon', 2], ['don', 1], ['**l', 2])
+        expect(explained[:entries]).to eq(11)
+        expect(explained[:candidates]).to eq(2)
+        expect(explained[:phases][:find]).to be > 0
+        expect(explained[:phases].keys).to include(:tokenise, :copy, :sort, :reduce, :rank)
+      end
+
+      it 'counts the lists sorted on demand' do
+        expect(explained[:sorted_lists]).to eq(4)
+        expect(subject.find('london', limit, :explain => true)[:sorted_lists]).to eq(0)
+      end
+    end
+  end
+
+
+  describe '#find_packed' do
+    let(:packed) { subject.find_packed 'london', 10 }
+
+    before do
+      subject.put 'london',      123, 0
+      subject.put 'londonderry', 124, 0
+    end
+
+    it 'packs the same results as #find' do
+      expect(packed.bytesize).to eq(2 * described_class::PACKED_MATCH_SIZE)
+      expect(packed.unpack('L*').each_slice(described_class::PACKED_MATCH_SIZE / 4).map { |match| match.first(3) }).to eq(subject.find('london'))
+    end
+
+    it 'returns references without unpacking' do
+      expect(described_class.packed_references(packed)).to eq([123, 124])
+    end
+
+    it 'reuses a buffer' do
+      buffer = 'junk'
+      expect(subject.find_packed('london', 1, {}, buffer)).to equal(buffer)
+      expect(described_class.packed_references(buffer)).to eq([123])
+    end
+
+    it 'returns an empty string without results' do
+      expect(subject.find_packed('paris', 10)).to be_empty
+    end
+  end
+
+
+  describe Blurrily::Filter do
+    it 'stores dense references as a bitmap' do
+      filter = Blurrily::Filter.new((1..1000).to_a)
+      expect(filter.size).to eq(1000)
+      expect(filter.memsize).to be < 1000 * 4
+      expect(filter).to include(1000)
+      expect(filter).not_to include(1001)
+    end
+
+    it 'stores sparse references as a sorted array' do
+      filter = Blurrily::Filter.new([1 << 30, 5, 1 << 20])
+      expect(filter.memsize).to be < 1024
+      expect([5, 1 << 20, 1 << 30, 6].map { |ref| filter.include?(ref) }).to eq([true, true, true, false])
+    end
+  end
+
+
+  describe '.find_across' do
+    let(:other) { described_class.new }
+
+    before do
+      subject.put 'london',      123, 0
+      subject.put 'londonderry', 124, 0
+      other.put   'londres',     125, 0
+      other.put   'london',      126, 7
+    end
+
+    it 'merges the best results of each map' do
+      expect(described_class.find_across([subject, other], 'london', 3)).to eq([[123, 7, 6, 0], [126, 7, 7, 1], [124, 6, 11, 0]])
+    end
+
+    it 'matches the results of #find' do
+      expect(described_class.find_across([other], 'Londres', 10).map { |result| result.first(3) }).to eq(other.find('Londres'))
+    end
+
+    it 'flags truncation on every map' do
+      described_class.find_across([subject, other], 'london', 10, :budget => 1)
+      expect(subject).to be_truncated
+      expect(other).to be_truncated
+    end
+
+    it 'searches large maps in parallel' do
+      maps = 4.times.map { described_class.new }
+      maps.each_with_index do |map, index|
+        map.put_batch((1..5000).map { |ref| ["london #{ref.to_s(26).tr('0-9', 'q-z')}", ref * 4 + index, 0] })
+      end
+      ranks    = lambda { |results| results.map { |ref, score, weight, index| [-score, weight, index] } }
+      expected = maps.each_with_index.flat_map { |map, index| map.find('london', 10).map { |result| result << index } }
+      expect(ranks[described_class.find_across(maps, 'london', 10)]).to eq(ranks[expected].sort.first(10))
+    end
+  end
+
+
+  describe '#merge' do
+    let(:other) { described_class.new }
+
+    before do
+      subject.put 'london', 10, 0
+      other.put   'paris',  11, 0
+      other.put   'rome',   10, 0
+    end
+
+    it 'adds references from the other map' do
+      expect(subject.merge(other)).to eq(1)
+      expect(subject.find('paris').first.first).to eq(11)
+      expect(subject.stats[:references]).to eq(2)
+    end
+
+    it 'keeps existing references' do
+      subject.merge(other)
+      expect(subject.find('rome')).to be_empty
+    end
+
+    it 'keeps posting lists sorted' do
+      other.put 'london', 5, 0
+      subject.merge(other)
+      expect(subject.stats(true)[:lists][:dirty]).to eq(0)
+      expect(subject.find('london').map(&:first).sort).to eq([5, 10])
+    end
+  end
+
+  describe '#memsize' do
+    let(:result) { subject.memsize }
+
+    before do
+      subject.put 'london', 123, 0
+      subject.put 'paris',  124, 0
+    end
+
+    it 'accounts for postings and slack' do
+      expect(result[:postings]).to eq(13 * 8)
+      expect(result[:slack]).to be > 0
+    end
+
+    it 'is all on the heap for new maps' do
+      expect(result[:mapped]).to eq(0)
+      expect(result[:heap]).to eq(result[:header] + result[:postings] + result[:slack] + result[:refs] + result[:counts] + result[:other])
+    end
+
+    it 'is mostly mapped for loaded maps' do
+      subject.save path.to_s
+      loaded = described_class.load(path.to_s).memsize
+      expect(loaded[:mapped]).to eq(path.size)
+      expect(loaded[:refs]).to eq(0)
+    end
+
+    it 'is reported to ObjectSpace' do
+      require 'objspace'
+      expect(ObjectSpace.memsize_of(subject)).to be >= result[:total]
+    end
+
+    it 'counts towards the garbage collector\'s allocations' do
+      GC.disable
+      begin
+        before = GC.stat(:malloc_increase_bytes)
+        map = described_class.new
+        map.put_batch(Array.new(1000) { |idx| ["london #{idx}", idx, 0] })
+        expect(GC.stat(:malloc_increase_bytes) - before).to be >= map.memsize[:heap]
+      ensure
+        GC.enable
+      end
+    end
+  end
+
+  describe '#shrink!' do
+    before do
+      3.times { |idx| subject.put 'london', idx, 0 }
+      subject.delete 1
+    end
+
+    it 'removes slack' do
+      subject.shrink!
+      expect(subject.memsize[:slack]).to eq(0)
+    end
+
+    it 'keeps the map usable' do
+      subject.shrink!
+      subject.put 'london', 4, 0
+      expect(subject.find('london').map(&:first)).to eq([0, 2, 4])
+    end
+
+    it 'works on loaded maps' do
+      subject.save path.to_s
+      map = described_class.load(path.to_s)
+      map.delete 0
+      map.shrink!
+      expect(map.find('london').map(&:first)).to eq([2])
+    end
+  end
+
+  describe '#order_by_weight=' do
+    let(:reference) { described_class.new }
+    let(:copies)    { subject.stats(true)[:phases][:copy][:count] }
+
+    before do
+      random = Random.new(42)
+      names = %w(london londres paris parish berlin)
+      200.times do |idx|
+        needle, weight = Array.new(1 + random.rand(2)) { names.sample(:random => random) }.join(' '), idx * 7 % 200
+        subject.put needle, idx, weight
+        reference.put needle, idx, weight
+      end
+      subject.order_by_weight = true
+    end
+
+    def ranked(map, needle, limit)
+      map.find(needle, limit).map { |result| result.drop(1) }
+    end
+
+    it 'finds the same best matches without copying lists' do
+      [1, 3, 10].each do |limit|
+        %w(london paris lond berliner).each do |needle|
+          expect(ranked(subject, needle, limit)).to eq(ranked(reference, needle, limit))
+        end
+      end
+      expect(copies).to eq(0)
+    end
+
+    it 'falls back to whole lists after writes' do
+      [subject, reference].each { |map| map.put 'london', 1000, 0 }
+      expect(ranked(subject, 'london', 3)).to eq(ranked(reference, 'london', 3))
+      expect(copies).to eq(1)
+    end
+
+    it 'orders lists again when saved' do
+      [subject, reference].each { |map| map.delete 1 }
+      subject.save path.to_s
+      expect(ranked(subject, 'london', 3)).to eq(ranked(reference, 'london', 3))
+      expect(copies).to eq(0)
+    end
+
+    it 'keeps ordered lists on disk' do
+      subject.save path.to_s
+      map = described_class.load(path.to_s)
+      expect(map.memsize[:by_weight]).to eq(subject.memsize[:by_weight])
+      expect(ranked(map, 'paris', 5)).to eq(ranked(reference, 'paris', 5))
+      expect(map.stats(true)[:phases][:copy][:count]).to eq(0)
+    end
+
+    it 'drops ordered lists when disabled' do
+      expect(subject.memsize[:by_weight]).to be > 0
+      subject.order_by_weight = false
+      expect(subject.memsize[:by_weight]).to eq(0)
+    end
+  end
+
+  describe '#cache_size=' do
+    let(:stats) { subject.stats }
+
+    before do
+      subject.cache_size = 1 << 16
+      subject.put 'london', 123, 0
+      subject.put 'paris',  124, 0
+    end
+
+    it 'does not report cache stats when disabled' do
+      subject.cache_size = 0
+      expect(stats).to eq({ :references => 2, :trigrams => 13 })
+    end
+
+    it 'serves repeated finds from the cache' do
+      first = subject.find('london')
+      expect(subject.find('london')).to eq(first)
+      expect(stats[:cache_misses]).to eq(1)
+      expect(stats[:cache_hits]).to eq(1)
+    end
+
+    it 'keys on the limit' do
+      subject.find('london', 1)
+      subject.find('london', 2)
+      expect(stats[:cache_hits]).to eq(0)
+      expect(stats[:cache_entries]).to eq(2)
+    end
+
+    it 'is invalidated by #put' do
+      subject.find('london')
+      subject.put 'london', 125, 0
+      expect(subject.find('london').map(&:first)).to eq([123, 125])
+      expect(stats[:cache_hits]).to eq(0)
+    end
+
+    it 'is invalidated by #delete' do
+      subject.find('london')
+      subject.delete 123
+      expect(subject.find('london')).to be_empty
+      expect(stats[:cache_hits]).to eq(0)
+    end
+
+    it 'stays within its memory cap' do
+      subject.cache_size = 256
+      %w(london paris rome berlin madrid).each { |needle| subject.find(needle) }
+      expect(stats[:cache_bytes]).to be <= 256
+      expect(stats[:cache_entries]).to be < 5
+    end
   end
 
 
@@ -254,6 +843,14 @@ describe Blurrily::Map do
       }.to raise_exception(Errno::ENOENT)
     end
 
+    it 'leaves no temporary file when it cannot replace the target' do
+      target = Pathname.new('tmp/taken.trigrams')
+      target.mkpath
+      expect { subject.save target.to_s }.to raise_exception(SystemCallError)
+      expect(Dir['tmp/taken.trigrams.tmp.*']).to be_empty
+      target.rmdir
+    end
+
     it 'uses a magic header' do
       perform
       header = path.read(8)
@@ -300,6 +897,17 @@ describe Blurrily::Map do
       expect(subject.find('london')).not_to be_empty
     end
 
+    %w(lazy populate willneed random hugepages).each do |mode|
+      it "results in a searchable map when paged in with mode #{mode}" do
+        map = described_class.load path.to_s, :mode => mode.to_sym
+        expect(map.find('london')).not_to be_empty
+      end
+    end
+
+    it 'raises an exception for unknown modes' do
+      expect { described_class.load path.to_s, :mode => :eager }.to raise_exception(ArgumentError)
+    end
+
     it 'then saves to an identical file' do
       subject.save alt_path.to_s
       expect(path.md5sum).to eq(alt_path.md5sum)
@@ -321,6 +929,11 @@ describe Blurrily::Map do
       expect { subject }.to raise_exception(Errno::EPROTO)
     end
 
+    it 'raises an exception if the file was coded with another alphabet' do
+      path.open('r+b') { |io| io.seek(12) ; io.write '9' } # first letter of the alphabet
+      expect { subject }.to raise_exception(Errno::EPROTO)
+    end
+
     it 'loads clean map' do
       subject
       path.delete_if_exists
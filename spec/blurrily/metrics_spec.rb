@@ -0,0 +1,68 @@
+# encoding: utf-8
+
+require 'spec_helper'
+require 'blurrily/metrics'
+require 'blurrily/map_group'
+require 'blurrily/command_processor'
+
+describe Blurrily::Metrics do
+  let(:map_group) { Blurrily::MapGroup.new('.') }
+  let(:processor) { Blurrily::CommandProcessor.new(map_group, :metrics => subject) }
+  let(:text) { subject.render(map_group) }
+
+  it 'counts commands by kind and map' do
+    processor.process_command("PUT\tlocations_en\tlondon\t12")
+    processor.process_command("FIND\tlocations_en\tlondon")
+    processor.process_command("FINDM\tlocations_en,locations_fr\tlondon")
+    expect(text).to include(%(blurrily_requests_total{command="FIND"} 1))
+    expect(text).to include(%(blurrily_map_requests_total{map="locations_en",command="PUT"} 1))
+    expect(text).to include(%(blurrily_map_requests_total{map="locations_fr",command="FINDM"} 1))
+  end
+
+  it 'counts errors and unknown commands' do
+    processor.process_command("FIND\tbad name\tlondon")
+    processor.process_command("HELLO\tlocations_en")
+    expect(text).to include(%(blurrily_request_errors_total{command="FIND"} 1))
+    expect(text).to include(%(blurrily_requests_total{command="unknown"} 1))
+  end
+
+  it 'keeps latency histograms' do
+    subject.request('FIND', nil, 1_000, false)
+    subject.request('FIND', nil, 3_000, false)
+    subject.request('FIND', nil, 10_000_000_000, false)
+    expect(text).to include(%(blurrily_request_duration_seconds_bucket{command="FIND",le="1.024e-06"} 1))
+    expect(text).to include(%(blurrily_request_duration_seconds_bucket{command="FIND",le="4.096e-06"} 2))
+    expect(text).to include(%(blurrily_request_duration_seconds_bucket{command="FIND",le="+Inf"} 3))
+    expect(text).to include(%(blurrily_request_duration_seconds_count{command="FIND"} 3))
+  end
+
+  it 'describes connections and traffic' do
+    subject.connected
+    subject.received(10)
+    subject.sent(20)
+    expect(text).to include("blurrily_connections 1\n", "blurrily_received_bytes_total 10\n", "blurrily_sent_bytes_total 20\n")
+  end
+
+  it 'describes open maps and their saves' do
+    map_group.put('locations_en', 'london', 12)
+    expect(text).to include(%(blurrily_map_references{map="locations_en"} 1))
+    expect(text).to include(%(blurrily_saves_total{map="locations_en"} 0))
+    expect(text).to include("blurrily_open_maps 1\n")
+  end
+
+  it 'measures each open map once' do
+    map_group.put('locations_en', 'london', 12)
+    map = map_group.map('locations_en')
+    allow(map_group).to receive(:stats).and_return(:maps => 1)
+    expect(map).to receive(:stats).once.and_call_original
+    expect(map).to receive(:memsize).once.and_call_original
+    expect(text).to include(%(blurrily_map_trigrams{map="locations_en"} 7))
+  end
+
+  it 'declares every family' do
+    processor.process_command("FIND\tlocations_en\tlondon")
+    names = text.lines.grep(/^blurrily_/).map { |line| line[/^\w+/].sub(/_(bucket|sum|count)$/, '') }.uniq
+    declared = text.lines.grep(/^# TYPE /).map { |line| line.split[2] }
+    expect(names - declared).to be_empty
+  end
+end
@@ -0,0 +1,116 @@
+# encoding: utf-8
+
+require 'spec_helper'
+require 'fileutils'
+require 'blurrily/replication'
+require 'blurrily/command_processor'
+
+describe Blurrily::Replication do
+  # stands in for the connection between a primary and a follower
+  class FakeReplicationLink
+    def initialize(follower, chunk_size)
+      @follower, @chunk_size = follower, chunk_size
+    end
+
+    def send_data(data)
+      data.dup.force_encoding(Encoding::BINARY).scan(/.{1,#{@chunk_size}}/m).each do |chunk|
+        @follower.receive_data(chunk)
+      end
+    end
+  end
+
+  let(:primary_group)  { Blurrily::MapGroup.new('tmp/primary') }
+  let(:follower_group) { Blurrily::MapGroup.new('tmp/follower') }
+  let(:primary)        { described_class::Primary.new(primary_group) }
+  let(:follower)       { described_class::Follower.new(follower_group) }
+  let(:link)           { FakeReplicationLink.new(follower, 1000) }
+
+  before do
+    primary
+    primary_group.put('locations_en', 'london', 123)
+    primary_group.put('locations_fr', 'paris', 124)
+    follower.connected
+  end
+
+  # attaches the link, and streams to it once snapshots are saved
+  def attach
+    primary.attach(link)
+    primary_group.wait
+    primary.pump
+  end
+
+  after do
+    FileUtils.rm_rf('tmp/primary')
+    FileUtils.rm_rf('tmp/follower')
+  end
+
+  it 'starts with snapshots of every map' do
+    attach
+    expect(follower_group.map('locations_en').find('london').first.first).to eq(123)
+    expect(follower_group.map('locations_fr').find('paris').first.first).to eq(124)
+    expect(follower.stats).to include(:snapshots => 2, :seq => 2, :connected => 1)
+  end
+
+  it 'streams writes' do
+    attach
+    primary_group.put('locations_en', 'londres', 125)
+    primary_group.delete('locations_en', 123)
+    expect(follower_group.map('locations_en').find('london').map(&:first)).to eq([125])
+    expect(follower.stats[:seq]).to eq(4)
+  end
+
+  it 'streams clears' do
+    attach
+    primary_group.clear('locations_fr')
+    expect(follower_group.map('locations_fr').find('paris')).to be_empty
+  end
+
+  it 'sends snapshots as the follower keeps up, holding writes back' do
+    window = described_class::Primary::SNAPSHOT_WINDOW
+    full   = true
+    link.define_singleton_method(:get_outbound_data_size) { full ? window : 0 }
+    primary.attach(link)
+    primary_group.put('locations_en', 'londres', 125)
+    expect(follower.stats[:snapshots]).to eq(0)
+    expect(primary.stats[:backlog_bytes]).to be > window
+
+    full = false
+    primary_group.wait
+    primary.pump
+    expect(follower_group.map('locations_en').find('londres').first.first).to eq(125)
+    expect(follower.stats).to include(:snapshots => 2, :seq => 3)
+  end
+
+  it 'saves snapshots in the background, holding writes back' do
+    primary.attach(link)
+    primary_group.put('locations_en', 'londres', 125)
+    expect(follower.stats[:snapshots]).to eq(0)
+
+    primary_group.wait
+    primary.pump
+    expect(follower_group.map('locations_en').find('londres').first.first).to eq(125)
+    expect(follower.stats).to include(:snapshots => 2, :seq => 3)
+  end
+
+  it 'reports followers' do
+    attach
+    expect(primary.stats).to include(:seq => 2, :followers => 1)
+    primary.detach(link)
+    expect(primary.stats[:followers]).to eq(0)
+  end
+
+  it 'drops partial snapshots on disconnection' do
+    follower.receive_data("SNAPSHOT\tlocations_en\t100\n1234")
+    follower.disconnected
+    expect(Pathname('tmp/follower/locations_en.trigrams.replica')).not_to exist
+    expect(follower.stats[:connected]).to eq(0)
+  end
+
+  it 'serves followers read-only' do
+    processor = Blurrily::CommandProcessor.new(follower_group, :read_only => true, :replication => follower)
+    attach
+    expect(processor.process_command("PUT\tlocations_en\tberlin\t126")).to eq("ERROR\tRead-only replica")
+    expect(processor.process_command("FIND\tlocations_en\tlondon")).to eq("OK\t123\t7\t6")
+    expect(processor.process_command("STATS\tlocations_en")).to include("replication_seq\t2")
+  end
+end